@@ -0,0 +1,254 @@
+#include "sql_normalize.h"
+#include <ctype.h>
+#include <stddef.h>
+
+// Nesting of parentheses tracked by sql_parameterize
+#define MAX_DEPTH 32
+
+static inline int is_ident_char(char c) {
+  return isalnum((unsigned char) c) || c == '_' || c == '$' || (c & 0x80);
+}
+
+static int is_keyword(const char *token, int len, const char *keyword) {
+  int i;
+
+  for (i = 0; i < len; i++) {
+    if (!keyword[i] || (toupper((unsigned char) token[i]) != keyword[i]))
+      return 0;
+  }
+  return !keyword[len];
+}
+
+static int is_any_keyword(const char *token, int len, const char **keywords) {
+  for (; *keywords; keywords++) {
+    if (is_keyword(token, len, *keywords))
+      return 1;
+  }
+  return 0;
+}
+
+static const char *parameterizable[] = {
+  "SELECT", "INSERT", "UPDATE", "DELETE", "REPLACE", "WITH", NULL
+};
+
+// keywords ending result columns, ORDER BY and GROUP BY
+static const char *end_keep[] = {
+  "FROM", "WHERE", "LIMIT", "OFFSET", "HAVING", "WINDOW", "UNION", "INTERSECT",
+  "EXCEPT", NULL
+};
+
+// Classifies the numeric literal of len bytes at start, returns -1 if
+// it isn't one SQLite would accept or doesn't fit in 64 bits
+static int numeric_type(const char *start, int len) {
+  int i = 0, digits = 0, exponent = 0;
+
+  if ((len > 2) && (start[0] == '0') && (start[1] == 'x' || start[1] == 'X')) {
+    for (i = 2; i < len; i++) {
+      if (!isxdigit((unsigned char) start[i]))
+        return -1;
+    }
+    return len - 2 <= 16 ? SQL_LITERAL_INTEGER : -1;
+  }
+
+  for (; (i < len) && isdigit((unsigned char) start[i]); i++)
+    digits++;
+  if (i == len)
+    return digits <= 18 ? SQL_LITERAL_INTEGER : -1;
+  if (start[i] == '.') {
+    for (i++; (i < len) && isdigit((unsigned char) start[i]); i++)
+      digits++;
+  }
+  if ((i < len) && (start[i] == 'e' || start[i] == 'E')) {
+    i++;
+    if ((i < len) && (start[i] == '+' || start[i] == '-'))
+      i++;
+    for (; (i < len) && isdigit((unsigned char) start[i]); i++)
+      exponent++;
+    if (!exponent)
+      return -1;
+  }
+  return (i == len) && digits ? SQL_LITERAL_FLOAT : -1;
+}
+
+static int blob_is_valid(const char *start, int len) {
+  int i;
+
+  if ((len < 3) || (start[len - 1] != '\'') || (len - 3) % 2)
+    return 0;
+  for (i = 2; i < len - 1; i++) {
+    if (!isxdigit((unsigned char) start[i]))
+      return 0;
+  }
+  return 1;
+}
+
+// Shared by sql_normalize and sql_parameterize, which passes literals
+// and gets the SQL as written up to the end of the first statement with
+// only the literals replaced
+static int normalize(const char *sql, int len, char *out, int out_size,
+                     sql_literal *literals, int max_literals, int *literal_count) {
+  int i = 0, n = 0, space = 0, tokens = 0, truncated = 0, start, type, j, end = len;
+  // in sql_parameterize, literals in result columns or ORDER BY and
+  // GROUP BY are kept, also inside parentheses in them such as scalar
+  // subqueries, keep_stack holds the state outside parentheses and
+  // kept_outside the number of levels in it which keep literals
+  int keep = 0, depth = 0, kept_outside = 0;
+  int keep_stack[MAX_DEPTH];
+  char quote;
+
+#define EMIT(c) do { if (n < out_size - 1) out[n++] = (c); else truncated = 1; } while (0)
+#define EMIT_SPACE() do { if (space && n > 0) EMIT(' '); space = 0; } while (0)
+
+  if (literal_count)
+    *literal_count = 0;
+
+  while (i < len) {
+    char c = sql[i];
+
+    if (isspace((unsigned char) c)) {
+      space = 1;
+      i++;
+      continue;
+    } else if (c == '-' && i + 1 < len && sql[i + 1] == '-') {
+      // comment to the end of the line
+      while (i < len && sql[i] != '\n') i++;
+      space = 1;
+      continue;
+    } else if (c == '/' && i + 1 < len && sql[i + 1] == '*') {
+      for (i += 2; i < len && !(sql[i] == '*' && i + 1 < len && sql[i + 1] == '/'); i++);
+      i += 2;
+      space = 1;
+      continue;
+    }
+
+    if (literals && !tokens && !is_ident_char(c))
+      return -1;
+    tokens++;
+    start = i;
+    type = -1;
+
+    if (c == '\'' ||
+        ((c == 'x' || c == 'X') && i + 1 < len && sql[i + 1] == '\'' &&
+         !(i > 0 && is_ident_char(sql[i - 1])))) {
+      // string or blob literal, '' is an escaped quote
+      for (i += c == '\'' ? 1 : 2; i < len; i++) {
+        if (sql[i] == '\'') {
+          if (i + 1 < len && sql[i + 1] == '\'') i++;
+          else break;
+        }
+      }
+      if (i < len) {
+        if (c == '\'')
+          type = SQL_LITERAL_TEXT;
+        else if (blob_is_valid(sql + start, i + 1 - start))
+          type = SQL_LITERAL_BLOB;
+      }
+      i++;
+      if (i > len) i = len;
+    } else if (isdigit((unsigned char) c) ||
+               (c == '.' && i + 1 < len && isdigit((unsigned char) sql[i + 1]))) {
+      // numeric literal, including hex and exponents
+      for (i++; i < len; i++) {
+        char d = sql[i];
+        if (!(isalnum((unsigned char) d) || d == '.' ||
+              ((d == '+' || d == '-') && (sql[i - 1] == 'e' || sql[i - 1] == 'E'))))
+          break;
+      }
+      type = numeric_type(sql + start, i - start);
+    } else if (c == '"' || c == '`' || c == '[') {
+      // quoted identifier, kept verbatim
+      quote = c == '[' ? ']' : c;
+      EMIT_SPACE();
+      for (i++; i < len && sql[i] != quote; i++);
+      if (i < len) i++;
+      for (j = start; j < i; j++) EMIT(sql[j]);
+      continue;
+    } else if (is_ident_char(c) || ((c == '?' || c == ':' || c == '@') && i + 1 < len)) {
+      // keyword, identifier or parameter
+      if (literals && !is_ident_char(c))
+        return -1;
+      if (literals && c == '$')
+        return -1;
+      EMIT_SPACE();
+      EMIT(c);
+      for (i++; i < len && is_ident_char(sql[i]); i++) EMIT(sql[i]);
+      if (literals) {
+        if ((tokens == 1) && !is_any_keyword(sql + start, i - start, parameterizable))
+          return -1;
+        if (is_keyword(sql + start, i - start, "SELECT") ||
+            is_keyword(sql + start, i - start, "BY"))
+          keep = 1;
+        else if (is_any_keyword(sql + start, i - start, end_keep))
+          keep = 0;
+      }
+      continue;
+    } else {
+      i++;
+      if (literals) {
+        if (c == ';') {
+          end = i - 1;
+          break;
+        }
+        if (c == '?')
+          return -1;
+        if (c == '(') {
+          if (depth == MAX_DEPTH)
+            return -1;
+          keep_stack[depth++] = keep;
+          kept_outside += keep;
+        } else if ((c == ')') && depth) {
+          keep = keep_stack[--depth];
+          kept_outside -= keep;
+        }
+      }
+      EMIT_SPACE();
+      EMIT(c);
+      continue;
+    }
+
+    // a literal from start to i
+    EMIT_SPACE();
+    if (!literals) {
+      EMIT('?');
+    } else if (keep || kept_outside || (type < 0)) {
+      for (j = start; j < i; j++) EMIT(sql[j]);
+    } else if (*literal_count == max_literals) {
+      return -1;
+    } else {
+      literals[*literal_count].type = (sql_literal_type) type;
+      literals[*literal_count].start = sql + start;
+      literals[*literal_count].len = i - start;
+      (*literal_count)++;
+      EMIT('?');
+    }
+  }
+
+  if (literals) {
+    // the first statement as written, with the literals replaced
+    n = 0;
+    truncated = 0;
+    for (i = 0, j = 0; i < end; i++) {
+      if ((j < *literal_count) && (sql + i == literals[j].start)) {
+        EMIT('?');
+        i += literals[j++].len - 1;
+      } else {
+        EMIT(sql[i]);
+      }
+    }
+  }
+
+#undef EMIT_SPACE
+#undef EMIT
+
+  out[n] = '\0';
+  return literals && (truncated || !tokens) ? -1 : n;
+}
+
+int sql_normalize(const char *sql, int len, char *out, int out_size) {
+  return normalize(sql, len, out, out_size, NULL, 0, NULL);
+}
+
+int sql_parameterize(const char *sql, int len, char *out, int out_size,
+                     sql_literal *literals, int max_literals, int *literal_count) {
+  return normalize(sql, len, out, out_size, literals, max_literals, literal_count);
+}
@@ -0,0 +1,35 @@
+#ifndef SQL_NORMALIZE_H
+#define SQL_NORMALIZE_H
+
+typedef enum sql_literal_type {
+  SQL_LITERAL_INTEGER, SQL_LITERAL_FLOAT, SQL_LITERAL_TEXT, SQL_LITERAL_BLOB
+} sql_literal_type;
+
+// A literal replaced by sql_parameterize: start points into the SQL at
+// the literal as written, including quotes and the x of blobs.
+typedef struct sql_literal {
+  sql_literal_type type;
+  const char *start;
+  int len;
+} sql_literal;
+
+// Normalizes the len bytes of SQL in sql so that statements differing only
+// in literal values compare equal: string, blob and numeric literals become
+// `?', comments are dropped and whitespace between tokens collapses to one
+// space. Writes at most out_size - 1 bytes followed by a NUL to out and
+// returns the length written.
+int sql_normalize(const char *sql, int len, char *out, int out_size);
+
+// Replaces the literals of the first statement in sql by `?' where a
+// parameter means the same thing: not in result columns (including their
+// subqueries), which they would name, nor in ORDER BY and GROUP BY, where
+// integers are column numbers. Writes the statement to out as written
+// otherwise, with its whitespace and comments, so the names of its result
+// columns don't change. The replaced literals are stored in order in
+// literals. Returns -1 unless sql is a SELECT, INSERT, UPDATE, DELETE,
+// REPLACE or WITH statement without parameters of its own, at most
+// max_literals literals to replace and a statement that fits in out.
+int sql_parameterize(const char *sql, int len, char *out, int out_size,
+                     sql_literal *literals, int max_literals, int *literal_count);
+
+#endif
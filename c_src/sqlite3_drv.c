@@ -1,4 +1,6 @@
 #include "sqlite3_drv.h"
+#include "sql_normalize.h"
+#include "sqlite3_memvfs.h"
 #include <stdarg.h>
 #include <limits.h>
 
@@ -83,6 +85,18 @@ static inline int max(int a, int b) {
 }
 #endif
 
+// Microseconds from an arbitrary point, usable on any thread
+static inline ErlDrvSInt64 drv_now_usec(void) {
+#if ERL_DRV_EXTENDED_MAJOR_VERSION > 3 || \
+  (ERL_DRV_EXTENDED_MAJOR_VERSION == 3 && ERL_DRV_EXTENDED_MINOR_VERSION >= 2)
+  return (ErlDrvSInt64) erl_drv_monotonic_time(ERL_DRV_USEC);
+#else
+  ErlDrvNowData now;
+  driver_get_now(&now);
+  return ((ErlDrvSInt64) now.megasecs * 1000000 + now.secs) * 1000000 + now.microsecs;
+#endif
+}
+
 static inline int sql_is_insert(const char *sql) {
   // neither strcasestr nor strnicmp are portable, so have to do this
   int i;
@@ -122,10 +136,13 @@ unsigned int do_hash(const char *str) {
 // Returns a key determined by the file name for an on-disk database,
 // determined by the port for a private database.
 // This way all access to a single DB will go through one async thread.
-static inline unsigned int sql_async_key(char *db_name, ErlDrvPort port) {
+// Connections to an immutable database don't lock it, so they read it
+// in parallel, and databases in the memory VFS are private, so both are
+// keyed by the port too.
+static inline unsigned int sql_async_key(char *db_name, ErlDrvPort port, int by_port) {
   const char *memory_db_name = ":memory:";
 
-  if (strcmp(db_name, memory_db_name)) {
+  if (strcmp(db_name, memory_db_name) && !by_port) {
     return do_hash(db_name);
   } else {
     #if ERL_DRV_EXTENDED_MAJOR_VERSION > 2 || \
@@ -137,6 +154,12 @@ static inline unsigned int sql_async_key(char *db_name, ErlDrvPort port) {
   }
 }
 
+static inline int traced_step(async_sqlite3_command *async_command, sqlite3_stmt *statement) {
+  int result = sqlite3_step(statement);
+  PROBE1(command__step, async_command, result);
+  return result;
+}
+
 static inline int return_error(
     sqlite3_drv_t *drv, int error_code, const char *error,
     ErlDrvTermData **dataset_p, int *term_count_p, int *term_allocated_p,
@@ -183,6 +206,32 @@ static inline int output_db_error(sqlite3_drv_t *drv) {
   return output_error(drv, sqlite3_errcode(drv->db), sqlite3_errmsg(drv->db));
 }
 
+// Output an error reported by bind_parameters()
+static inline int output_bind_error(
+    sqlite3_drv_t *drv, int error_code, const char *error) {
+  return error ? output_error(drv, error_code, error) : output_db_error(drv);
+}
+
+// Returns {Port, {error, query_rejected, Reason}} for statements refused
+// by admission_check
+static inline int output_rejected(sqlite3_drv_t *drv, const char *reason) {
+  ErlDrvTermData spec[] = {
+      ERL_DRV_PORT, driver_mk_port(drv->port),
+      ERL_DRV_ATOM, drv->atom_error,
+      ERL_DRV_ATOM, drv->atom_query_rejected,
+      ERL_DRV_STRING, (ErlDrvTermData) reason, (ErlDrvTermData) strlen(reason),
+      ERL_DRV_TUPLE, 3,
+      ERL_DRV_TUPLE, 2
+  };
+  return
+  #ifdef PRE_R16B
+  driver_output_term(drv->port,
+  #else
+  erl_drv_output_term(driver_mk_port(drv->port),
+  #endif
+      spec, sizeof(spec) / sizeof(spec[0]));
+}
+
 static inline int output_ok(sqlite3_drv_t *drv) {
   // Return {Port, ok}
   ErlDrvTermData spec[] = {
@@ -211,7 +260,7 @@ static ErlDrvEntry sqlite3_driver_entry = {
   NULL, /* finish */
   NULL, /* handle */
   control, /* control */
-  NULL, /* timeout */
+  busy_timeout, /* timeout */
   NULL, /* outputv */
   ready_async, /* ready_async (defined below) */
   NULL, /* flush */
@@ -247,6 +296,8 @@ static ErlDrvData start(ErlDrvPort port, char* cmd) {
   int  flags = 0;
   
   memset(drv, 0, sizeof(sqlite3_drv_t));
+  drv->checkpoint_on_close = 1;
+  drv->admission_epoch = 1;
 
   // Parse other options
   if (db_name) {
@@ -312,8 +363,54 @@ static ErlDrvData start(ErlDrvPort port, char* cmd) {
         flags |= SQLITE_OPEN_PRIVATECACHE;
       else if (!strcmp(s, "-wal"))
         flags |= SQLITE_OPEN_WAL;
+      else if (!strncmp(s, "-trace=", 7))
+        drv->trace_size = (unsigned int) atoi(s + 7) + 1;
+      else if (!strncmp(s, "-stats=", 7))
+        drv->stats_size = (unsigned int) atoi(s + 7) + 1;
+      else if (!strncmp(s, "-auto-param=", 12))
+        drv->param_cache_size = (unsigned int) atoi(s + 12);
+      else if (!strncmp(s, "-busy-retry=", 12))
+        drv->busy_retry_ms = atoi(s + 12);
+      else if (!strcmp(s, "-no-checkpoint-on-close"))
+        drv->checkpoint_on_close = 0;
+      else if (!strncmp(s, "-max-scan-rows=", 15))
+        drv->admission_max_scan_rows = strtoll(s + 15, NULL, 10);
+      else if (!strcmp(s, "-no-temp-btree"))
+        drv->admission_no_temp_btree = 1;
+      else if (!strncmp(s, "-optimize-every=", 16))
+        drv->optimize_every = atoi(s + 16);
+      else if (!strcmp(s, "-optimize-on-close"))
+        drv->optimize_on_close = 1;
+      else if (!strncmp(s, "-analysis-limit=", 16))
+        drv->analysis_limit = atoi(s + 16);
+      else if (!strcmp(s, "-immutable"))
+        drv->immutable = 1;
+      else if (!strncmp(s, "-mmap-size=", 11))
+        drv->mmap_size = strtoll(s + 11, NULL, 10);
+      else if (!strcmp(s, "-memvfs"))
+        drv->memvfs = 1;
+      else if (!strncmp(s, "-page-size=", 11))
+        drv->page_size = atoi(s + 11);
+      else if (!strncmp(s, "-cache-tables=", 14)) {
+        char *table = s + 14, *end;
+        while (*table) {
+          // the changes of further tables couldn't be reported
+          if (drv->cache_table_count == CACHE_MAX_TABLES)
+            goto BAD_PARAMETER;
+          end = strchr(table, ',');
+          if (!end)
+            end = table + strlen(table);
+          drv->cache_tables[drv->cache_table_count] = driver_alloc(end - table + 1);
+          memcpy(drv->cache_tables[drv->cache_table_count], table, end - table);
+          drv->cache_tables[drv->cache_table_count++][end - table] = '\0';
+          table = *end ? end + 1 : end;
+        }
+      }
       else {
+      BAD_PARAMETER:
         fprintf(stderr, "Error parsing parameter: %s\r\n", s);
+        while (drv->cache_table_count)
+          driver_free(drv->cache_tables[--drv->cache_table_count]);
         driver_free(drv);
         return ERL_DRV_ERROR_BADARG;
       }
@@ -360,7 +457,13 @@ static ErlDrvData start(ErlDrvPort port, char* cmd) {
   }
 
   // Create and open the database
-  status = sqlite3_open_v2(db_name, &db, flags, NULL);
+  if (drv->memvfs) {
+    status = memvfs_register();
+    if (status == SQLITE_OK)
+      status = sqlite3_open_v2(db_name, &db, flags, MEMVFS_NAME);
+  } else {
+    status = sqlite3_open_v2(db_name, &db, flags, NULL);
+  }
 #if defined(_MSC_VER)
 #pragma warning(default: 4306)
 #endif
@@ -372,10 +475,28 @@ static ErlDrvData start(ErlDrvPort port, char* cmd) {
   drv->port = port;
   drv->db = db;
   drv->db_name = db_name_copy;
-  drv->key = sql_async_key(db_name_copy, port);
+  drv->key = sql_async_key(db_name_copy, port, drv->immutable || drv->memvfs);
   drv->prepared_stmts = NULL;
   drv->prepared_count = 0;
   drv->prepared_alloc = 0;
+  // trace_size is 1 + the -trace option if one was given
+  drv->trace_size = drv->trace_size ? drv->trace_size - 1 : TRACE_DEFAULT_SIZE;
+  if (drv->trace_size) {
+    drv->trace = driver_alloc(sizeof(trace_entry) * drv->trace_size);
+    memset(drv->trace, 0, sizeof(trace_entry) * drv->trace_size);
+  }
+  // and stats_size is 1 + the -stats option
+  drv->stats_size = drv->stats_size ? drv->stats_size - 1 : STATS_DEFAULT_SIZE;
+  if (drv->stats_size) {
+    drv->stats_mutex = erl_drv_mutex_create("sqlite3_drv_stats");
+    drv->stats = driver_alloc(sizeof(stats_entry) * drv->stats_size);
+    drv->stats_buckets = driver_alloc(sizeof(int) * drv->stats_size);
+    memset(drv->stats_buckets, -1, sizeof(int) * drv->stats_size);
+  }
+  if (drv->param_cache_size) {
+    drv->param_cache = driver_alloc(sizeof(param_cache_entry) * drv->param_cache_size);
+    memset(drv->param_cache, 0, sizeof(param_cache_entry) * drv->param_cache_size);
+  }
 
   drv->atom_blob        = driver_mk_atom("blob");
   drv->atom_error       = driver_mk_atom("error");
@@ -388,6 +509,60 @@ static ErlDrvData start(ErlDrvPort port, char* cmd) {
   drv->atom_true        = driver_mk_atom("true");
   drv->atom_false       = driver_mk_atom("false");
   drv->atom_unknown_cmd = driver_mk_atom("unknown_command");
+  drv->atom_exec        = driver_mk_atom("exec");
+  drv->atom_script      = driver_mk_atom("script");
+  drv->atom_step        = driver_mk_atom("step");
+  drv->atom_batch       = driver_mk_atom("batch");
+  drv->atom_wal_archive = driver_mk_atom("wal_archive");
+  drv->atom_close       = driver_mk_atom("close");
+  drv->atom_recycle     = driver_mk_atom("recycle");
+  drv->atom_query_rejected = driver_mk_atom("query_rejected");
+  drv->atom_changed     = driver_mk_atom("changed");
+  drv->atom_shared      = driver_mk_atom("shared");
+  drv->atom_unshared    = driver_mk_atom("unshared");
+
+  if ((status == SQLITE_OK) && drv->cache_table_count) {
+    sqlite3_preupdate_hook(db, changes_hook, drv);
+    sqlite3_rollback_hook(db, rollback_hook, drv);
+  }
+  if ((status == SQLITE_OK) &&
+      (drv->cache_table_count || drv->admission_max_scan_rows || drv->admission_no_temp_btree))
+    sqlite3_set_authorizer(db, authorizer, drv);
+  // before the first write, which fixes the page size
+  if ((status == SQLITE_OK) && drv->page_size) {
+    char pragma[64];
+    snprintf(pragma, sizeof(pragma), "PRAGMA page_size=%d;", drv->page_size);
+    sqlite3_exec(db, pragma, NULL, NULL, NULL);
+  }
+  if ((status == SQLITE_OK) && drv->memvfs) {
+    char pragma[64];
+    snprintf(pragma, sizeof(pragma), "PRAGMA journal_mode=OFF; PRAGMA cache_size=-%d;",
+             MEMVFS_CACHE_KIB);
+    sqlite3_exec(db, pragma, NULL, NULL, NULL);
+  }
+  if ((status == SQLITE_OK) && drv->immutable) {
+    sqlite3_exec(db, "PRAGMA query_only=1;", NULL, NULL, NULL);
+    if (!drv->mmap_size)
+      drv->mmap_size = IMMUTABLE_MMAP_SIZE;
+  }
+  if ((status == SQLITE_OK) && drv->mmap_size) {
+    char pragma[64];
+    snprintf(pragma, sizeof(pragma), "PRAGMA mmap_size=%lld;", (long long) drv->mmap_size);
+    sqlite3_exec(db, pragma, NULL, NULL, NULL);
+  }
+  // SQLite before 3.32 ignores the unknown pragma, ANALYZE reads everything
+  if ((status == SQLITE_OK) && drv->analysis_limit) {
+    char pragma[64];
+    snprintf(pragma, sizeof(pragma), "PRAGMA analysis_limit=%d;", drv->analysis_limit);
+    sqlite3_exec(db, pragma, NULL, NULL, NULL);
+  }
+
+  if (status == SQLITE_OK)
+    save_settings(drv, db);
+
+  // keep the driver loaded until the emulator exits, so connections
+  // opened and closed in quick succession don't load and unload it
+  driver_lock_driver(port);
 
   if (status != SQLITE_OK) {
     LOG_DEBUG("Unable to open file %s: \"%s\"\n\n", db_name, sqlite3_errmsg(db));
@@ -400,9 +575,9 @@ static ErlDrvData start(ErlDrvPort port, char* cmd) {
   return (ErlDrvData) drv;
 }
 
-// Driver Stop
-static void stop(ErlDrvData handle) {
-  sqlite3_drv_t* drv = (sqlite3_drv_t*) handle;
+// Finalizes the statements and closes the database, on the async thread
+// after CMD_CLOSE or in stop if the port is closed without it
+static int close_connection(sqlite3_drv_t *drv) {
   unsigned int i;
   int close_result;
 
@@ -410,15 +585,84 @@ static void stop(ErlDrvData handle) {
     for (i = 0; i < drv->prepared_count; i++)
       sqlite3_finalize(drv->prepared_stmts[i]);
     driver_free(drv->prepared_stmts);
+    drv->prepared_stmts = NULL;
+    drv->prepared_count = drv->prepared_alloc = 0;
+  }
+
+  if (drv->param_cache) {
+    for (i = 0; i < drv->param_cache_count; i++) {
+      sqlite3_finalize(drv->param_cache[i].statement);
+      driver_free(drv->param_cache[i].sql);
+    }
+    driver_free(drv->param_cache);
+    drv->param_cache = NULL;
+    drv->param_cache_count = 0;
+  }
+
+  if (drv->queries) {
+    for (i = 0; i < drv->query_count; i++)
+      sqlite3_finalize(drv->queries[i]);
+    driver_free(drv->queries);
+    driver_free(drv->query_admitted);
+    drv->queries = NULL;
+    drv->query_admitted = NULL;
+    drv->query_count = 0;
+  }
+
+  if (drv->optimize_on_close)
+    sqlite3_exec(drv->db, "PRAGMA optimize;", NULL, NULL, NULL);
+
+  // archive what's left in the WAL, sqlite3_close() checkpoints it
+  if (drv->wal_archive_dir) {
+    wal_archive_segment(drv);
+    driver_free(drv->wal_archive_dir);
+    drv->wal_archive_dir = NULL;
   }
 
+  if (!drv->checkpoint_on_close)
+    sqlite3_db_config(drv->db, SQLITE_DBCONFIG_NO_CKPT_ON_CLOSE, 1, NULL);
+
   close_result = sqlite3_close(drv->db);
   if (close_result != SQLITE_OK)
     LOG_ERROR("Failed to close DB %s, some resources aren't finalized!", drv->db_name);
+  else
+    drv->db = NULL;
+  return close_result;
+}
+
+// Driver Stop
+static void stop(ErlDrvData handle) {
+  sqlite3_drv_t* drv = (sqlite3_drv_t*) handle;
+  unsigned int i;
+
+  if (drv->busy_command) {
+    driver_cancel_timer(drv->port);
+    sql_free_async(drv->busy_command);
+  }
+
+  // normally closed already by CMD_CLOSE, off the scheduler thread
+  if (drv->db)
+    close_connection(drv);
 
   if (drv->log && (drv->log != stderr))
     fclose(drv->log);
 
+  if (drv->trace)
+    driver_free(drv->trace);
+
+  if (drv->stats) {
+    for (i = 0; i < drv->stats_count; i++)
+      driver_free(drv->stats[i].sql);
+    driver_free(drv->stats);
+    driver_free(drv->stats_buckets);
+    while (drv->stats_pending)
+      stats_take_pending(drv, drv->stats_pending->statement);
+    erl_drv_mutex_destroy(drv->stats_mutex);
+  }
+
+  for (i = 0; i < (unsigned int) drv->cache_table_count; i++)
+    driver_free(drv->cache_tables[i]);
+
   if (drv->db_name)
     driver_free(drv->db_name);
   driver_free(drv);
@@ -431,13 +675,18 @@ static ErlDrvSSizeT control(
   sqlite3_drv_t* drv = (sqlite3_drv_t*) drv_data;
   if (len > INT_MAX) {
     output_error(drv, SQLITE_MISUSE, "Command size doesn't fit into int type");
+  } else if (drv->closing) {
+    output_error(drv, SQLITE_MISUSE, "Database connection is closing");
   } else {
     switch (command) {
     case CMD_SQL_EXEC:
       sql_exec(drv, buf, (int) len);
       break;
     case CMD_SQL_BIND_AND_EXEC:
-      sql_bind_and_exec(drv, buf, (int) len);
+      sql_bind_and_exec(drv, buf, (int) len, 0);
+      break;
+    case CMD_SHARED_QUERY:
+      sql_bind_and_exec(drv, buf, (int) len, 1);
       break;
     case CMD_PREPARE:
       prepare(drv, buf, (int) len);
@@ -475,6 +724,39 @@ static ErlDrvSSizeT control(
     case CMD_TABLE_EXISTS:
       table_exists(drv, buf, (int) len);
       break;
+    case CMD_PREPARED_BATCH:
+      prepared_batch(drv, buf, (int) len, 0);
+      break;
+    case CMD_PREPARED_UPSERT_BATCH:
+      prepared_batch(drv, buf, (int) len, 1);
+      break;
+    case CMD_PREPARED_DBSTAT:
+      prepared_dbstat(drv, buf, (int) len);
+      break;
+    case CMD_WAL_ARCHIVE:
+      wal_archive(drv, buf, (int) len);
+      break;
+    case CMD_TRACE:
+      trace(drv, buf, (int) len);
+      break;
+    case CMD_STATEMENT_STATS:
+      statement_stats(drv, buf, (int) len);
+      break;
+    case CMD_PREPARED_SCAN_STATUS:
+      prepared_scan_status(drv, buf, (int) len);
+      break;
+    case CMD_CLOSE:
+      close_db(drv, buf, (int) len);
+      break;
+    case CMD_RECYCLE:
+      recycle(drv, buf, (int) len);
+      break;
+    case CMD_REGISTER_QUERIES:
+      register_queries(drv, buf, (int) len);
+      break;
+    case CMD_QUERY:
+      query(drv, buf, (int) len);
+      break;
     default:
       unknown(drv, buf, (int) len);
     }
@@ -598,27 +880,382 @@ static inline async_sqlite3_command *make_async_command_script(
   return result;
 }
 
-static inline void exec_async_command(
-    sqlite3_drv_t *drv, void (*async_invoke)(void*),
-    async_sqlite3_command *async_command) {
+// Runs the command on the async thread, timing it for the trace ring
+static void timed_async(void *_async_command) {
+  async_sqlite3_command *async_command = (async_sqlite3_command *) _async_command;
+  sqlite3_drv_t *drv = async_command->driver_data;
+  int timed = drv->trace_size > 0;
+
+  if (timed)
+    async_command->started_at = drv_now_usec();
+  drv->running_thread = erl_drv_thread_self();
+  drv->running_command = async_command;
+  async_command->invoke(async_command);
+  drv->running_command = NULL;
+  if (timed)
+    async_command->finished_at = drv_now_usec();
+  if (drv->optimize_every && drv->db && (async_command->type != t_optimize) &&
+      (sqlite3_total_changes(drv->db) - drv->optimize_changes >= drv->optimize_every))
+    async_command->optimize_due = 1;
+}
+
+// Runs PRAGMA optimize, queued by ready_async once it's due and no other
+// command of the connection is queued, so only commands sent while it
+// runs wait for it. Inside a transaction it's left for a later command;
+// failures (such as SQLITE_BUSY) aren't reported, it's due again after
+// the next change.
+static void optimize_async(void *_async_command) {
+  async_sqlite3_command *async_command = (async_sqlite3_command *) _async_command;
+  sqlite3_drv_t *drv = async_command->driver_data;
+  int result;
+
+  if (!sqlite3_get_autocommit(drv->db))
+    return;
+  result = sqlite3_exec(drv->db, "PRAGMA optimize;", NULL, NULL, NULL);
+  if (result == SQLITE_OK)
+    drv->optimize_changes = sqlite3_total_changes(drv->db);
+  else
+    LOG_DEBUG("PRAGMA optimize failed: %s", sqlite3_errmsg(drv->db));
+}
+
+// Index of table in cache_tables, or cache_table_count. Identifiers
+// are case-insensitive
+static int cache_table_index(sqlite3_drv_t *drv, const char *db_name, const char *table) {
+  int i;
+
+  if (!db_name || !table || strcmp(db_name, "main"))
+    return drv->cache_table_count;
+  for (i = 0; (i < drv->cache_table_count) && sqlite3_stricmp(drv->cache_tables[i], table); i++);
+  return i;
+}
+
+// The command running on the async thread when a hook is called by it,
+// NULL when control calls SQLite on the emulator thread meanwhile
+static async_sqlite3_command *hook_command(sqlite3_drv_t *drv) {
+  async_sqlite3_command *async_command = drv->running_command;
+
+  if (async_command && !erl_drv_equal_tids(drv->running_thread, erl_drv_thread_self()))
+    return NULL;
+  return async_command;
+}
+
+// Notes a row of cache table i changed by async_command
+static void note_changed_row(async_sqlite3_command *async_command, int i,
+                             sqlite3_int64 rowid) {
+  if (async_command->changed_tables & (1u << i))
+    return;
+
+  if (async_command->changed_count >= CACHE_MAX_CHANGES) {
+    async_command->changed_tables |= 1u << i;
+    return;
+  }
+  if (async_command->changed_count >= async_command->changed_allocated) {
+    async_command->changed_allocated =
+      async_command->changed_allocated ? 2 * async_command->changed_allocated : 16;
+    async_command->changed =
+      driver_realloc(async_command->changed,
+                     async_command->changed_allocated * sizeof(changed_row));
+  }
+  async_command->changed[async_command->changed_count].table = i;
+  async_command->changed[async_command->changed_count].rowid = rowid;
+  async_command->changed_count++;
+}
+
+// Pre-update hook on the async thread: notes rows of the cache tables
+// changed by the running command. Unlike the update hook, it sees the
+// rows deleted by DELETE without WHERE and by REPLACE, and the old rowid
+// of an UPDATE which changes it
+static void changes_hook(void *_drv, sqlite3 *db, int op, const char *db_name,
+                         const char *table, sqlite3_int64 old_rowid, sqlite3_int64 new_rowid) {
+  sqlite3_drv_t *drv = (sqlite3_drv_t *) _drv;
+  async_sqlite3_command *async_command = hook_command(drv);
+  int i;
+
+  if (!async_command)
+    return;
+  i = cache_table_index(drv, db_name, table);
+  if (i == drv->cache_table_count)
+    return;
+  if (op != SQLITE_INSERT)
+    note_changed_row(async_command, i, old_rowid);
+  if ((op != SQLITE_DELETE) && ((op == SQLITE_INSERT) || (new_rowid != old_rowid)))
+    note_changed_row(async_command, i, new_rowid);
+}
+
+// Whether a statement may change the plans admission_check looks at:
+// schema changes, ANALYZE and writes to sqlite_stat1 (which is how
+// PRAGMA optimize runs ANALYZE)
+static int changes_plans(int action, const char *arg1) {
+  switch (action) {
+  case SQLITE_ANALYZE:
+  case SQLITE_CREATE_INDEX:
+  case SQLITE_DROP_INDEX:
+  case SQLITE_CREATE_TEMP_INDEX:
+  case SQLITE_DROP_TEMP_INDEX:
+  case SQLITE_CREATE_TABLE:
+  case SQLITE_DROP_TABLE:
+  case SQLITE_CREATE_TEMP_TABLE:
+  case SQLITE_DROP_TEMP_TABLE:
+  case SQLITE_ALTER_TABLE:
+    return 1;
+  case SQLITE_INSERT:
+  case SQLITE_UPDATE:
+  case SQLITE_DELETE:
+    return arg1 && !sqlite3_stricmp(arg1, "sqlite_stat1");
+  default:
+    return 0;
+  }
+}
+
+// Authorizer: dropping or altering a cache table changes all its rows
+// without the pre-update hook seeing them, and schema or statistics
+// changes make the admission verdicts of named queries stale. It runs
+// when statements are prepared: on the async thread for scripts and
+// re-prepared statements, which the running command reports, and
+// otherwise by control, whose statement goes with the next command
+// queued, see exec_async_command
+static int authorizer(void *_drv, int action, const char *arg1, const char *arg2,
+                      const char *db_name, const char *trigger) {
+  sqlite3_drv_t *drv = (sqlite3_drv_t *) _drv;
+  async_sqlite3_command *async_command = hook_command(drv);
+  int i;
+
+  if (changes_plans(action, arg1)) {
+    if (async_command)
+      async_command->plans_changed = 1;
+    else
+      drv->prepared_plans_changed = 1;
+  }
+  if (action == SQLITE_DROP_TABLE)
+    i = cache_table_index(drv, db_name, arg1);
+  else if (action == SQLITE_ALTER_TABLE)
+    i = cache_table_index(drv, arg1, arg2);
+  else
+    return SQLITE_OK;
+  if (i == drv->cache_table_count)
+    return SQLITE_OK;
+  if (async_command)
+    async_command->changed_tables |= 1u << i;
+  else
+    drv->prepared_changed_tables |= 1u << i;
+  return SQLITE_OK;
+}
+
+// Rolled back changes aren't reported by the update hook, so all cache
+// tables are reported as changed
+static void rollback_hook(void *_drv) {
+  sqlite3_drv_t *drv = (sqlite3_drv_t *) _drv;
+  async_sqlite3_command *async_command = hook_command(drv);
+
+  if (async_command)
+    async_command->changed_tables = (drv->cache_table_count == CACHE_MAX_TABLES) ?
+      ~0u : (1u << drv->cache_table_count) - 1;
+}
+
+// Sends {Port, {changed, [{Table, Rowid}], [Table]}} for the changes of
+// the command, where Table is the index in -cache-tables, ahead of its
+// reply, so the cache is invalidated before the writer continues
+static void output_changes(sqlite3_drv_t *drv, async_sqlite3_command *async_command) {
+  int i, tables = 0, term_count = 0;
+  ErlDrvTermData *spec;
+
+  for (i = 0; i < drv->cache_table_count; i++) {
+    if (async_command->changed_tables & (1u << i))
+      tables++;
+  }
+  spec = driver_alloc(sizeof(ErlDrvTermData) *
+                      (14 + 6 * async_command->changed_count + 2 * tables));
+  spec[term_count++] = ERL_DRV_PORT;
+  spec[term_count++] = driver_mk_port(drv->port);
+  spec[term_count++] = ERL_DRV_ATOM;
+  spec[term_count++] = drv->atom_changed;
+  for (i = 0; i < async_command->changed_count; i++) {
+    spec[term_count++] = ERL_DRV_UINT;
+    spec[term_count++] = (ErlDrvTermData) async_command->changed[i].table;
+    spec[term_count++] = ERL_DRV_INT64;
+    spec[term_count++] = (ErlDrvTermData) &async_command->changed[i].rowid;
+    spec[term_count++] = ERL_DRV_TUPLE;
+    spec[term_count++] = 2;
+  }
+  spec[term_count++] = ERL_DRV_NIL;
+  spec[term_count++] = ERL_DRV_LIST;
+  spec[term_count++] = (ErlDrvTermData) async_command->changed_count + 1;
+  for (i = 0; i < drv->cache_table_count; i++) {
+    if (async_command->changed_tables & (1u << i)) {
+      spec[term_count++] = ERL_DRV_UINT;
+      spec[term_count++] = (ErlDrvTermData) i;
+    }
+  }
+  spec[term_count++] = ERL_DRV_NIL;
+  spec[term_count++] = ERL_DRV_LIST;
+  spec[term_count++] = (ErlDrvTermData) tables + 1;
+  spec[term_count++] = ERL_DRV_TUPLE;
+  spec[term_count++] = 3;
+  spec[term_count++] = ERL_DRV_TUPLE;
+  spec[term_count++] = 2;
+  #ifdef PRE_R16B
+  driver_output_term(drv->port,
+  #else
+  erl_drv_output_term(driver_mk_port(drv->port),
+  #endif
+      spec, term_count);
+  driver_free(spec);
+}
+
+// Hands the command to the async thread of the connection
+static void dispatch_async_command(sqlite3_drv_t *drv, async_sqlite3_command *async_command) {
   // Check is required because we are sometimes accessing
   // sqlite3 from the emulator thread. Could also be fixed
   // by making _all_ access except start/stop go through driver_async
   if (sqlite3_threadsafe()) {
-    long status = driver_async(drv->port, &drv->key, async_invoke,
+    long status = driver_async(drv->port, &drv->key, timed_async,
                                async_command, sql_free_async);
 
     // see https://groups.google.com/d/msg/erlang-programming/XiFR6xxhGos/B6ARBIlvpMUJ
     if (status < 0) {
       LOG_ERROR("driver_async call failed: %ld", status);
+      drv->commands_queued--;
       output_error(drv, SQLITE_ERROR, "driver_async call failed");
     }
   } else {
-    async_invoke(async_command);
+    timed_async(async_command);
     ready_async((ErlDrvData) drv, (ErlDrvThreadData) async_command);
   }
 }
 
+static inline void exec_async_command(
+    sqlite3_drv_t *drv, void (*async_invoke)(void*),
+    async_sqlite3_command *async_command) {
+  async_command->id = ++drv->command_count;
+  async_command->invoke = async_invoke;
+  drv->commands_queued++;
+  if (async_command->type != t_optimize) {
+    async_command->changed_tables |= drv->prepared_changed_tables;
+    drv->prepared_changed_tables = 0;
+    async_command->plans_changed |= drv->prepared_plans_changed;
+    drv->prepared_plans_changed = 0;
+  }
+  if (drv->trace_size)
+    async_command->enqueued_at = drv_now_usec();
+  if (async_command->type == t_script) {
+    PROBE2(command__enqueue, async_command, async_command->script,
+           async_command->end - async_command->script);
+  } else {
+    PROBE2(command__enqueue, async_command,
+           async_command->statement ? sqlite3_sql(async_command->statement) : NULL,
+           async_command->type == t_batch ? async_command->batch_size : 0);
+  }
+
+  dispatch_async_command(drv, async_command);
+}
+
+// Called on the async thread when the command got SQLITE_BUSY: unless its
+// deadline has passed, it's marked to be run again once a driver timer
+// with a doubling delay fires (see ready_async), keeping the async thread
+// free for the other connections. Inside an explicit transaction the
+// error is returned, since the transaction usually has to be rolled back.
+static int busy_should_retry(async_sqlite3_command *async_command) {
+  sqlite3_drv_t *drv = async_command->driver_data;
+  ErlDrvSInt64 now;
+
+  if (!drv->busy_retry_ms || !sqlite3_get_autocommit(drv->db))
+    return 0;
+
+  now = drv_now_usec();
+  if (!async_command->busy_deadline) {
+    async_command->busy_deadline = now + (ErlDrvSInt64) drv->busy_retry_ms * 1000;
+    async_command->busy_delay_ms = 1;
+  } else if (async_command->busy_delay_ms < BUSY_MAX_DELAY) {
+    async_command->busy_delay_ms *= 2;
+  }
+  if (now + (ErlDrvSInt64) async_command->busy_delay_ms * 1000 > async_command->busy_deadline)
+    return 0;
+
+  async_command->busy_retry = 1;
+  return 1;
+}
+
+static void busy_timeout(ErlDrvData drv_data) {
+  sqlite3_drv_t *drv = (sqlite3_drv_t *) drv_data;
+  async_sqlite3_command *async_command = drv->busy_command;
+
+  if (async_command) {
+    drv->busy_command = NULL;
+    async_command->busy_retry = 0;
+    dispatch_async_command(drv, async_command);
+  }
+}
+
+// Estimated rows of table by ANALYZE, -1 if it hasn't been analyzed
+static sqlite3_int64 table_rows(sqlite3_drv_t *drv, const char *table, int table_len) {
+  sqlite3_stmt *statement;
+  sqlite3_int64 rows = -1;
+
+  // the first number of every stat of a table is its row count
+  if (sqlite3_prepare_v2(drv->db, "SELECT CAST(stat AS INTEGER) FROM sqlite_stat1 "
+                         "WHERE tbl = ?1 LIMIT 1", -1, &statement, NULL) != SQLITE_OK)
+    return -1;
+  sqlite3_bind_text(statement, 1, table, table_len, SQLITE_STATIC);
+  if (sqlite3_step(statement) == SQLITE_ROW)
+    rows = sqlite3_column_int64(statement, 0);
+  sqlite3_finalize(statement);
+  return rows;
+}
+
+// Looks at the EXPLAIN QUERY PLAN of statement, which doesn't read any
+// table, and returns 1 with the reason (at most reason_size bytes) if
+// admission control rejects it: a full scan of a table estimated to
+// have more than admission_max_scan_rows rows or, with
+// admission_no_temp_btree, a temporary b-tree for ORDER BY, GROUP BY or
+// DISTINCT. Tables that haven't been analyzed are let through.
+static int admission_check(sqlite3_drv_t *drv, sqlite3_stmt *statement,
+                           char *reason, int reason_size) {
+  const char *sql = sqlite3_sql(statement);
+  char *explain;
+  sqlite3_stmt *plan;
+  const char *detail, *table;
+  int table_len, rejected = 0;
+  sqlite3_int64 rows;
+
+  if ((!drv->admission_max_scan_rows && !drv->admission_no_temp_btree) || !sql)
+    return 0;
+
+  explain = driver_alloc(strlen(sql) + 20);
+  strcpy(explain, "EXPLAIN QUERY PLAN ");
+  strcat(explain, sql);
+  if (sqlite3_prepare_v2(drv->db, explain, -1, &plan, NULL) != SQLITE_OK) {
+    driver_free(explain);
+    return 0;
+  }
+  driver_free(explain);
+
+  while (!rejected && (sqlite3_step(plan) == SQLITE_ROW)) {
+    detail = (const char *) sqlite3_column_text(plan, 3);
+    if (!detail)
+      continue;
+    if (drv->admission_no_temp_btree && !strncmp(detail, "USE TEMP B-TREE", 15)) {
+      snprintf(reason, reason_size, "%s", detail);
+      rejected = 1;
+    } else if (drv->admission_max_scan_rows && !strncmp(detail, "SCAN ", 5)) {
+      // "SCAN TABLE t ..." (or "SCAN t ..." in later SQLite versions)
+      table = detail + 5;
+      if (!strncmp(table, "TABLE ", 6))
+        table += 6;
+      for (table_len = 0; table[table_len] && (table[table_len] != ' '); table_len++);
+      if (!strncmp(table, "SUBQUERY", 8) || !strncmp(table, "CONSTANT", 8))
+        continue;
+      rows = table_rows(drv, table, table_len);
+      if (rows > drv->admission_max_scan_rows) {
+        snprintf(reason, reason_size, "full scan of %.*s with about %lld rows",
+                 table_len, table, (long long) rows);
+        rejected = 1;
+      }
+    }
+  }
+  sqlite3_finalize(plan);
+  return rejected;
+}
+
 static inline int sql_exec_statement(
     sqlite3_drv_t *drv, sqlite3_stmt *statement) {
   async_sqlite3_command *async_command = make_async_command_statement(drv, statement, 1);
@@ -629,17 +1266,146 @@ static inline int sql_exec_statement(
   return 0;
 }
 
+// Returns the cache entry for the normalized SQL, preparing it on a miss.
+// NULL if every entry is in use or the SQL doesn't prepare, which leaves
+// the cache as it was.
+static param_cache_entry *param_cache_get(sqlite3_drv_t *drv, const char *sql) {
+  unsigned int hash = do_hash(sql), i;
+  param_cache_entry *entry = NULL;
+  sqlite3_stmt *statement;
+
+  for (i = 0; i < drv->param_cache_count; i++) {
+    if ((drv->param_cache[i].hash == hash) && !strcmp(drv->param_cache[i].sql, sql)) {
+      drv->param_cache[i].last_used = ++drv->param_cache_clock;
+      return &drv->param_cache[i];
+    }
+  }
+
+  if (drv->param_cache_count == drv->param_cache_size) {
+    for (i = 0; i < drv->param_cache_count; i++) {
+      if (!drv->param_cache[i].in_use &&
+          (!entry || (drv->param_cache[i].last_used < entry->last_used)))
+        entry = &drv->param_cache[i];
+    }
+    if (!entry)
+      return NULL;
+  }
+#if SQLITE_VERSION_NUMBER >= 3020000
+  if (sqlite3_prepare_v3(drv->db, sql, -1, SQLITE_PREPARE_PERSISTENT, &statement, NULL) ||
+      !statement)
+#else
+  if (sqlite3_prepare_v2(drv->db, sql, -1, &statement, NULL) || !statement)
+#endif
+    return NULL;
+
+  if (entry) {
+    sqlite3_finalize(entry->statement);
+    driver_free(entry->sql);
+  } else {
+    entry = &drv->param_cache[drv->param_cache_count++];
+  }
+  entry->hash = hash;
+  entry->sql = driver_alloc(strlen(sql) + 1);
+  strcpy(entry->sql, sql);
+  entry->last_used = ++drv->param_cache_clock;
+  entry->in_use = 0;
+  entry->statement = statement;
+  return entry;
+}
+
+static int bind_literal(sqlite3_stmt *statement, int param_index, const sql_literal *literal) {
+  char *value;
+  int i, n = 0, result;
+
+  switch (literal->type) {
+  case SQL_LITERAL_INTEGER:
+    if ((literal->len > 2) && (literal->start[1] == 'x' || literal->start[1] == 'X')) {
+      return sqlite3_bind_int64(statement, param_index,
+        (sqlite3_int64) strtoull(literal->start + 2, NULL, 16));
+    }
+    return sqlite3_bind_int64(statement, param_index,
+                              (sqlite3_int64) strtoll(literal->start, NULL, 10));
+  case SQL_LITERAL_FLOAT:
+    return sqlite3_bind_double(statement, param_index, strtod(literal->start, NULL));
+  case SQL_LITERAL_TEXT:
+    // without the quotes and with '' unescaped
+    value = driver_alloc(literal->len);
+    for (i = 1; i < literal->len - 1; i++) {
+      value[n++] = literal->start[i];
+      if (literal->start[i] == '\'') i++;
+    }
+    result = sqlite3_bind_text(statement, param_index, value, n, SQLITE_TRANSIENT);
+    driver_free(value);
+    return result;
+  case SQL_LITERAL_BLOB:
+    value = driver_alloc(literal->len / 2);
+    for (i = 2; i < literal->len - 1; i += 2) {
+      char hex[3] = {literal->start[i], literal->start[i + 1], '\0'};
+      value[n++] = (char) strtol(hex, NULL, 16);
+    }
+    result = sqlite3_bind_blob(statement, param_index, value, n, SQLITE_TRANSIENT);
+    driver_free(value);
+    return result;
+  }
+  return SQLITE_MISUSE;
+}
+
+// Runs the first statement in command from the statement cache, with its
+// literals bound to parameters. Returns -1 without any output if it
+// can't, then the statement has to be prepared as it is.
+static int sql_exec_parameterized(sqlite3_drv_t *drv, char *command, int command_size) {
+  sql_literal literals[PARAM_MAX_LITERALS];
+  char reason[ADMISSION_REASON_SIZE];
+  int literal_count, i;
+  char *sql = driver_alloc(command_size + 1);
+  param_cache_entry *entry = NULL;
+  async_sqlite3_command *async_command;
+
+  if (sql_parameterize(command, command_size, sql, command_size + 1,
+                       literals, PARAM_MAX_LITERALS, &literal_count) >= 0)
+    entry = param_cache_get(drv, sql);
+  driver_free(sql);
+  if (!entry || entry->in_use ||
+      (sqlite3_bind_parameter_count(entry->statement) != literal_count))
+    return -1;
+  if (admission_check(drv, entry->statement, reason, sizeof(reason))) {
+    output_rejected(drv, reason);
+    return 0;
+  }
+
+  for (i = 0; i < literal_count; i++) {
+    if (bind_literal(entry->statement, i + 1, &literals[i]) != SQLITE_OK) {
+      sqlite3_clear_bindings(entry->statement);
+      return -1;
+    }
+  }
+
+  LOG_DEBUG("Parameterized: %s\n", entry->sql);
+  entry->in_use = 1;
+  async_command = make_async_command_statement(drv, entry->statement, 0);
+  async_command->reset_statement_on_free = 1;
+  async_command->param_cache_entry = entry;
+  exec_async_command(drv, sql_exec_async, async_command);
+  return 0;
+}
+
 static int sql_exec(sqlite3_drv_t *drv, char *command, int command_size) {
   int result;
   const char *rest;
   sqlite3_stmt *statement;
+  char reason[ADMISSION_REASON_SIZE];
 
   LOG_DEBUG("Preexec: %.*s\n", command_size, command);
+  if (drv->param_cache_size && (sql_exec_parameterized(drv, command, command_size) == 0))
+    return 0;
   result = sqlite3_prepare_v2(drv->db, command, command_size, &statement, &rest);
   if (result != SQLITE_OK) {
     return output_db_error(drv);
   } else if (statement == NULL) {
     return output_error(drv, SQLITE_MISUSE, "empty statement");
+  } else if (admission_check(drv, statement, reason, sizeof(reason))) {
+    sqlite3_finalize(statement);
+    return output_rejected(drv, reason);
   }
   return sql_exec_statement(drv, statement);
 }
@@ -653,9 +1419,13 @@ static int sql_exec_script(sqlite3_drv_t *drv, char *command, int command_size)
   return 0;
 }
 
+// Binding errors are reported through p_error (NULL means the message
+// should be taken from sqlite3_errmsg), so that the functions can also be
+// used on an async thread where nothing may be output directly.
 static inline int decode_and_bind_param(
     sqlite3_drv_t *drv, char *buffer, int *p_index,
-    sqlite3_stmt *statement, int param_index, int *p_type, int *p_size) {
+    sqlite3_stmt *statement, int param_index, int *p_type, int *p_size,
+    const char **p_error) {
   int result;
   sqlite3_int64 int64_val;
   double double_val;
@@ -683,10 +1453,12 @@ static inline int decode_and_bind_param(
     char_buf_val = driver_alloc((*p_size + 1) * sizeof(char));
     ei_decode_atom(buffer, p_index, char_buf_val);
     if (strncmp(char_buf_val, "null", 5) == 0) {
+      driver_free(char_buf_val);
       result = sqlite3_bind_null(statement, param_index);
     } else {
-      output_error(drv, SQLITE_MISUSE, "Non-null atom as parameter");
-      return 1;
+      driver_free(char_buf_val);
+      *p_error = "Non-null atom as parameter";
+      return SQLITE_MISUSE;
     }
     break;
   case ERL_STRING_EXT:
@@ -705,25 +1477,25 @@ static inline int decode_and_bind_param(
     ei_get_type(buffer, p_index, p_type, p_size);
     ei_decode_tuple_header(buffer, p_index, p_size);
     if (*p_size != 2) {
-      output_error(drv, SQLITE_MISUSE, "bad parameter type");
-      return 1;
+      *p_error = "bad parameter type";
+      return SQLITE_MISUSE;
     }
     ei_skip_term(buffer, p_index); // skipped the atom 'blob'
     ei_get_type(buffer, p_index, p_type, p_size);
     if (*p_type != ERL_BINARY_EXT) {
-      output_error(drv, SQLITE_MISUSE, "bad parameter type");
-      return 1;
+      *p_error = "bad parameter type";
+      return SQLITE_MISUSE;
     }
     char_buf_val = driver_alloc(*p_size * sizeof(char));
     ei_decode_binary(buffer, p_index, char_buf_val, &bin_size);
     result = sqlite3_bind_blob(statement, param_index, char_buf_val, *p_size, &driver_free_fun);
     break;
   default:
-    output_error(drv, SQLITE_MISUSE, "bad parameter type");
-    return 1;
+    *p_error = "bad parameter type";
+    return SQLITE_MISUSE;
   }
   if (result != SQLITE_OK) {
-    output_db_error(drv);
+    *p_error = NULL;
     return result;
   }
   return SQLITE_OK;
@@ -731,7 +1503,7 @@ static inline int decode_and_bind_param(
 
 static int bind_parameters(
     sqlite3_drv_t *drv, char *buffer, int buffer_size, int *p_index,
-    sqlite3_stmt *statement, int *p_type, int *p_size) {
+    sqlite3_stmt *statement, int *p_type, int *p_size, const char **p_error) {
   // decoding parameters
   int i, cur_list_size = -1, param_index = 1, param_indices_are_explicit = 0, result = 0;
   long param_index_long;
@@ -744,8 +1516,8 @@ static int bind_parameters(
     // and the list was encoded as string (see ei documentation)
     ei_get_type(buffer, p_index, p_type, p_size);
     if (*p_type != ERL_STRING_EXT) {
-      return output_error(drv, SQLITE_ERROR,
-                          "error while binding parameters");
+      *p_error = "error while binding parameters";
+      return SQLITE_ERROR;
     }
     acc_string = driver_alloc(sizeof(char) * (*p_size + 1));
     ei_decode_string(buffer, p_index, acc_string);
@@ -758,8 +1530,8 @@ static int bind_parameters(
 
   for (i = 0; i < cur_list_size; i++) {
     if (*p_index >= buffer_size) {
-      return output_error(drv, SQLITE_ERROR,
-                          "error while binding parameters");
+      *p_error = "error while binding parameters";
+      return SQLITE_ERROR;
     }
 
     ei_get_type(buffer, p_index, p_type, p_size);
@@ -768,8 +1540,8 @@ static int bind_parameters(
       // param with name or explicit index
       param_indices_are_explicit = 1;
       if (*p_size != 2) {
-        return output_error(drv, SQLITE_MISUSE,
-                            "tuple should contain index or name, and value");
+        *p_error = "tuple should contain index or name, and value";
+        return SQLITE_MISUSE;
       }
       ei_decode_tuple_header(buffer, p_index, p_size);
       ei_get_type(buffer, p_index, p_type, p_size);
@@ -795,7 +1567,8 @@ static int bind_parameters(
         break;
       case ERL_STRING_EXT:
         if (*p_size >= MAXATOMLEN) {
-          return output_error(drv, SQLITE_TOOBIG, "parameter name too long");
+          *p_error = "parameter name too long";
+          return SQLITE_TOOBIG;
         }
         ei_decode_string(buffer, p_index, param_name);
         // insert zero terminator
@@ -803,26 +1576,26 @@ static int bind_parameters(
         param_index = sqlite3_bind_parameter_index(statement, param_name);
         break;
       default:
-        return output_error(drv, SQLITE_MISMATCH,
-                            "parameter index must be given as integer, atom, or string");
+        *p_error = "parameter index must be given as integer, atom, or string";
+        return SQLITE_MISMATCH;
       }
       result = decode_and_bind_param(
-        drv, buffer, p_index, statement, param_index, p_type, p_size);
+        drv, buffer, p_index, statement, param_index, p_type, p_size, p_error);
       if (result != SQLITE_OK) {
-        return result; // error has already been output
+        return result; // p_error has already been set
       }
     }
     else {
       IMPLICIT_INDEX:
       if (param_indices_are_explicit) {
-        return output_error(drv, SQLITE_MISUSE,
-                            "parameters without indices shouldn't follow indexed or named parameters");
+        *p_error = "parameters without indices shouldn't follow indexed or named parameters";
+        return SQLITE_MISUSE;
       }
 
       result = decode_and_bind_param(
-        drv, buffer, p_index, statement, param_index, p_type, p_size);
+        drv, buffer, p_index, statement, param_index, p_type, p_size, p_error);
       if (result != SQLITE_OK) {
-        return result; // error has already been output
+        return result; // p_error has already been set
       }
       ++param_index;
     }
@@ -853,7 +1626,10 @@ static void get_columns(
   (*dataset_p)[base + column_count * 3 + 2] = column_count + 1;
 }
 
-static int sql_bind_and_exec(sqlite3_drv_t *drv, char *buffer, int buffer_size) {
+// With shared, only runs a read-only statement and reports whether the
+// database changed while it ran, see CMD_SHARED_QUERY
+static int sql_bind_and_exec(sqlite3_drv_t *drv, char *buffer, int buffer_size, int shared) {
+  async_sqlite3_command *async_command;
   int result;
   int index = 0;
   int type, size;
@@ -861,6 +1637,8 @@ static int sql_bind_and_exec(sqlite3_drv_t *drv, char *buffer, int buffer_size)
   sqlite3_stmt *statement;
   long bin_size;
   char *command;
+  const char *error = NULL;
+  char reason[ADMISSION_REASON_SIZE];
 
   LOG_DEBUG("Preexec: %.*s\n", buffer_size, buffer);
 
@@ -889,14 +1667,26 @@ static int sql_bind_and_exec(sqlite3_drv_t *drv, char *buffer, int buffer_size)
     return output_db_error(drv);
   } else if (statement == NULL) {
     return output_error(drv, SQLITE_MISUSE, "empty statement");
+  } else if (admission_check(drv, statement, reason, sizeof(reason))) {
+    sqlite3_finalize(statement);
+    return output_rejected(drv, reason);
+  } else if (shared && !sqlite3_stmt_readonly(statement)) {
+    sqlite3_finalize(statement);
+    return output_error(drv, SQLITE_READONLY, "Shared queries must be read-only");
   }
 
-  result = bind_parameters(drv, buffer, buffer_size, &index, statement, &type, &size);
-  if (result == SQLITE_OK) {
+  result = bind_parameters(drv, buffer, buffer_size, &index, statement, &type, &size, &error);
+  if ((result == SQLITE_OK) && !shared) {
     return sql_exec_statement(drv, statement);
+  } else if (result == SQLITE_OK) {
+    async_command = make_async_command_statement(drv, statement, 1);
+    async_command->shared = 1;
+    exec_async_command(drv, sql_exec_async, async_command);
+    return 0;
   } else {
+    output_bind_error(drv, result, error);
     sqlite3_finalize(statement);
-    return result; // error has already been output
+    return result;
   }
 }
 
@@ -909,17 +1699,164 @@ static void sql_free_async(void *_async_command) {
 
   free_ptr_list(async_command->binaries, &driver_free_binary_fun);
 
-  if ((async_command->type == t_stmt) &&
+  if (async_command->changed)
+    driver_free(async_command->changed);
+
+  if (async_command->reset_statement_on_free) {
+    sqlite3_reset(async_command->statement);
+    sqlite3_clear_bindings(async_command->statement);
+    if (async_command->param_cache_entry)
+      async_command->param_cache_entry->in_use = 0;
+  } else if ((async_command->type == t_stmt) &&
       async_command->finalize_statement_on_free &&
       async_command->statement) {
     sqlite3_finalize(async_command->statement);
     async_command->statement = NULL;
   } else if (async_command->type == t_script) {
     driver_free(async_command->script);
+  } else if ((async_command->type == t_batch) ||
+             (async_command->type == t_wal_archive)) {
+    driver_free(async_command->batch);
   }
   driver_free(async_command);
 }
 
+// Returns the index of the statistics entry with the given hash and
+// normalized SQL (any SQL if NULL) or -1, called with stats_mutex held
+static int stats_find(sqlite3_drv_t *drv, unsigned int hash, const char *sql) {
+  int i;
+
+  for (i = drv->stats_buckets[hash % drv->stats_size]; i >= 0; i = drv->stats[i].next) {
+    if ((drv->stats[i].hash == hash) && (!sql || !strcmp(drv->stats[i].sql, sql)))
+      return i;
+  }
+  return -1;
+}
+
+// Adds an empty entry for the normalized SQL, evicting the one with the
+// fewest calls when the table is full, called with stats_mutex held
+static int stats_insert(sqlite3_drv_t *drv, unsigned int hash, const char *sql) {
+  stats_entry *entry;
+  unsigned int i, victim = 0;
+  int *link;
+
+  if (drv->stats_count < drv->stats_size) {
+    victim = drv->stats_count++;
+  } else {
+    for (i = 1; i < drv->stats_size; i++) {
+      if (drv->stats[i].calls < drv->stats[victim].calls)
+        victim = i;
+    }
+    entry = &drv->stats[victim];
+    for (link = &drv->stats_buckets[entry->hash % drv->stats_size];
+         *link != (int) victim; link = &drv->stats[*link].next);
+    *link = entry->next;
+    driver_free(entry->sql);
+  }
+
+  entry = &drv->stats[victim];
+  memset(entry, 0, sizeof(stats_entry));
+  entry->hash = hash;
+  entry->sql = driver_alloc(strlen(sql) + 1);
+  strcpy(entry->sql, sql);
+  entry->min_us = -1;
+  entry->next = drv->stats_buckets[hash % drv->stats_size];
+  drv->stats_buckets[hash % drv->stats_size] = (int) victim;
+  return (int) victim;
+}
+
+// Takes the time of the unfinished execution of statement out of
+// stats_pending, called with stats_mutex held
+static ErlDrvSInt64 stats_take_pending(sqlite3_drv_t *drv, sqlite3_stmt *statement) {
+  stats_pending **link, *pending;
+  ErlDrvSInt64 elapsed;
+
+  for (link = &drv->stats_pending; *link; link = &(*link)->next) {
+    if ((*link)->statement == statement) {
+      pending = *link;
+      elapsed = pending->elapsed_us;
+      *link = pending->next;
+      driver_free(pending);
+      return elapsed;
+    }
+  }
+  return 0;
+}
+
+// Called with stats_mutex held before statement is finalized or reset,
+// so nothing recorded for it is carried over to a statement which gets
+// its address
+static void stats_forget(sqlite3_drv_t *drv, sqlite3_stmt *statement) {
+  if (drv->stats_cached_statement == statement)
+    drv->stats_cached_statement = NULL;
+  stats_take_pending(drv, statement);
+}
+
+// Adds calls executions of statement taking elapsed microseconds in total
+// to its statistics. calls is 0 for a step that didn't finish the
+// execution, its time is kept per statement until the execution is done.
+// cache is set for prepared statements, which are executed one step at a
+// time.
+static void stats_record(
+    sqlite3_drv_t *drv, sqlite3_stmt *statement, int cache, int calls,
+    ErlDrvSInt64 elapsed, int rows, int changes) {
+  char sql[STATS_SQL_MAX];
+  const char *raw_sql;
+  unsigned int hash;
+  stats_entry *entry;
+  int i = -1;
+
+  if (!drv->stats_size)
+    return;
+
+  erl_drv_mutex_lock(drv->stats_mutex);
+  if (cache && (statement == drv->stats_cached_statement))
+    i = stats_find(drv, drv->stats_cached_hash, NULL);
+  if (i < 0) {
+    raw_sql = sqlite3_sql(statement);
+    sql_normalize(raw_sql, raw_sql ? (int) strlen(raw_sql) : 0, sql, sizeof(sql));
+    hash = do_hash(sql);
+    if ((i = stats_find(drv, hash, sql)) < 0)
+      i = stats_insert(drv, hash, sql);
+    if (cache) {
+      drv->stats_cached_statement = statement;
+      drv->stats_cached_hash = hash;
+    }
+  }
+
+  entry = &drv->stats[i];
+  if (calls) {
+    if (cache)
+      elapsed += stats_take_pending(drv, statement);
+    entry->calls += calls;
+    entry->total_us += elapsed;
+    // batches only tell the mean time of their executions
+    if ((entry->min_us < 0) || (elapsed / calls < entry->min_us))
+      entry->min_us = elapsed / calls;
+    if (elapsed / calls > entry->max_us)
+      entry->max_us = elapsed / calls;
+  } else {
+    stats_pending *pending;
+    for (pending = drv->stats_pending; pending && (pending->statement != statement);
+         pending = pending->next);
+    if (!pending) {
+      pending = driver_alloc(sizeof(stats_pending));
+      pending->statement = statement;
+      pending->elapsed_us = 0;
+      pending->next = drv->stats_pending;
+      drv->stats_pending = pending;
+    }
+    pending->elapsed_us += elapsed;
+  }
+  entry->rows += rows;
+  entry->changes += changes;
+  entry->fullscan_steps += sqlite3_stmt_status(statement, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+  entry->sorts += sqlite3_stmt_status(statement, SQLITE_STMTSTATUS_SORT, 1);
+  entry->autoindexes += sqlite3_stmt_status(statement, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+  entry->vm_steps += sqlite3_stmt_status(statement, SQLITE_STMTSTATUS_VM_STEP, 1);
+  erl_drv_mutex_unlock(drv->stats_mutex);
+}
+
 static int sql_exec_one_statement(
     sqlite3_stmt *statement, async_sqlite3_command *async_command,
     int *term_count_p, int *term_allocated_p, ErlDrvTermData **dataset_p) {
@@ -928,6 +1865,7 @@ static int sql_exec_one_statement(
   int base_term_count;
   int has_error = 0; // bool
   sqlite3_drv_t *drv = async_command->driver_data;
+  ErlDrvSInt64 started_at = drv->stats_size ? drv_now_usec() : 0;
   ptr_list **ptrs_p = &(async_command->ptrs);
   ptr_list **binaries_p = &(async_command->binaries);
   // printf("\nsql_exec_one_statement. SQL:\n%s\n Term count: %d, terms alloc: %d\n", sqlite3_sql(statement), *term_count_p, *term_allocated_p);
@@ -947,7 +1885,7 @@ static int sql_exec_one_statement(
 
   LOG_DEBUG("Exec: %s\n", sqlite3_sql(statement));
 
-  while ((next_row = sqlite3_step(statement)) == SQLITE_ROW) {
+  while ((next_row = traced_step(async_command, statement)) == SQLITE_ROW) {
     for (i = 0; i < column_count; i++) {
       LOG_DEBUG("Column %d type: %d\n", i, sqlite3_column_type(statement, i));
       switch (sqlite3_column_type(statement, i)) {
@@ -1010,6 +1948,18 @@ static int sql_exec_one_statement(
     row_count++;
   }
 
+  // a script can't be retried, its earlier statements have run already
+  if ((next_row == SQLITE_BUSY) && (async_command->type == t_stmt) && !row_count &&
+      busy_should_retry(async_command)) {
+    sqlite3_reset(statement);
+    return 1;
+  }
+
+  if (drv->stats_size) {
+    stats_record(drv, statement, 0, 1, drv_now_usec() - started_at, row_count,
+                 sqlite3_stmt_readonly(statement) ? 0 : sqlite3_changes(drv->db));
+  }
+
   if (next_row != SQLITE_DONE) {
     if (column_count == 0) {
         return_error(drv, next_row, sqlite3_errmsg(drv->db),
@@ -1051,6 +2001,9 @@ static int sql_exec_one_statement(
     append_to_dataset(2, *dataset_p, *term_count_p, ERL_DRV_ATOM, drv->atom_ok);
   }
 
+  async_command->row_count += row_count;
+  PROBE2(command__encoded, async_command, row_count,
+         *term_count_p * sizeof(ErlDrvTermData));
   LOG_DEBUG("Total term count: %p %d, rows count: %dx%d\n",
     statement, *term_count_p, column_count, row_count);
   async_command->finalize_statement_on_free = 1;
@@ -1058,10 +2011,26 @@ static int sql_exec_one_statement(
   return has_error;
 }
 
+// PRAGMA data_version of the main database, which changes when another
+// connection commits, -1 if it can't be read
+static sqlite3_int64 data_version(sqlite3 *db) {
+  sqlite3_stmt *statement;
+  sqlite3_int64 version = -1;
+
+  if (sqlite3_prepare_v2(db, "PRAGMA data_version;", -1, &statement, NULL) != SQLITE_OK)
+    return -1;
+  if (sqlite3_step(statement) == SQLITE_ROW)
+    version = sqlite3_column_int64(statement, 0);
+  sqlite3_finalize(statement);
+  return version;
+}
+
 static void sql_exec_async(void *_async_command) {
   async_sqlite3_command *async_command = (async_sqlite3_command *) _async_command;
 
   sqlite3_stmt *statement = NULL;
+  sqlite3_int64 version = -1;
+  int shared_slot = 0;
   int result;
   const char *rest;
   const char *end;
@@ -1071,14 +2040,40 @@ static void sql_exec_async(void *_async_command) {
 
   sqlite3_drv_t *drv = async_command->driver_data;
 
+  PROBE1(command__start, async_command,
+         async_command->type == t_script ? async_command->script
+                                         : sqlite3_sql(async_command->statement));
+
   EXTEND_DATASET_DIRECT(2);
   append_to_dataset(2, dataset, term_count, ERL_DRV_PORT, driver_mk_port(drv->port));
 
   switch (async_command->type) {
   case t_stmt:
     statement = async_command->statement;
+    if (async_command->shared) {
+      // {shared, Result}, the atom is replaced if the database changes
+      version = data_version(drv->db);
+      EXTEND_DATASET_DIRECT(2);
+      append_to_dataset(2, dataset, term_count, ERL_DRV_ATOM, drv->atom_shared);
+      shared_slot = term_count - 1;
+    }
     sql_exec_one_statement(statement, async_command, &term_count,
                            &term_allocated, &dataset);
+    if (async_command->shared && !async_command->busy_retry) {
+      if ((version < 0) || (data_version(drv->db) != version))
+        dataset[shared_slot] = drv->atom_unshared;
+      EXTEND_DATASET_DIRECT(2);
+      append_to_dataset(2, dataset, term_count, ERL_DRV_TUPLE, (ErlDrvTermData) 2);
+    }
+    if (async_command->busy_retry) {
+      // nothing was returned yet, so run it again from scratch
+      driver_free(dataset);
+      free_ptr_list(async_command->ptrs, &driver_free_fun);
+      async_command->ptrs = NULL;
+      free_ptr_list(async_command->binaries, &driver_free_binary_fun);
+      async_command->binaries = NULL;
+      return;
+    }
     break;
   case t_script:
     rest = async_command->script;
@@ -1109,6 +2104,15 @@ static void sql_exec_async(void *_async_command) {
     EXTEND_DATASET_DIRECT(3);
     append_to_dataset(3, dataset, term_count,
       ERL_DRV_NIL, ERL_DRV_LIST, (ErlDrvTermData) (num_statements + 1));
+    break;
+  case t_batch:
+  case t_wal_archive:
+  case t_close:
+  case t_recycle:
+  case t_optimize:
+    // executed by sql_batch_async, wal_archive_async, close_async,
+    // recycle_async and optimize_async
+    break;
   }
 
   EXTEND_DATASET_DIRECT(2);
@@ -1119,6 +2123,8 @@ static void sql_exec_async(void *_async_command) {
   async_command->term_count = term_count;
   async_command->term_allocated = term_allocated;
   async_command->dataset = dataset;
+  PROBE2(command__done, async_command, async_command->row_count,
+         async_command->error_code);
 }
 
 static void sql_step_async(void *_async_command) {
@@ -1135,11 +2141,27 @@ static void sql_step_async(void *_async_command) {
   ptr_list *binaries = NULL;
   int i;
   int result;
+  ErlDrvSInt64 started_at = drv->stats_size ? drv_now_usec() : 0;
+  int first_step = !sqlite3_stmt_busy(statement);
 
-  switch(result = sqlite3_step(statement)) {
-  case SQLITE_ROW:
-    column_count = sqlite3_column_count(statement);
-    EXTEND_DATASET_DIRECT(2);
+  PROBE1(command__start, async_command, sqlite3_sql(statement));
+
+  result = traced_step(async_command, statement);
+  if ((result == SQLITE_BUSY) && first_step && busy_should_retry(async_command)) {
+    sqlite3_reset(statement);
+    return;
+  }
+  if (drv->stats_size) {
+    stats_record(drv, statement, 1, result != SQLITE_ROW, drv_now_usec() - started_at,
+                 result == SQLITE_ROW,
+                 (result == SQLITE_DONE) && !sqlite3_stmt_readonly(statement) ?
+                 sqlite3_changes(drv->db) : 0);
+  }
+
+  switch(result) {
+  case SQLITE_ROW:
+    column_count = sqlite3_column_count(statement);
+    EXTEND_DATASET_DIRECT(2);
     append_to_dataset(2, dataset, term_count, ERL_DRV_PORT, driver_mk_port(drv->port));
 
     for (i = 0; i < column_count; i++) {
@@ -1246,15 +2268,324 @@ POPULATE_COMMAND:
   async_command->term_count = term_count;
   async_command->ptrs = ptrs;
   async_command->binaries = binaries;
-  async_command->row_count = 1;
+  async_command->row_count = result == SQLITE_ROW;
+  PROBE2(command__encoded, async_command, async_command->row_count,
+         term_count * sizeof(ErlDrvTermData));
+  PROBE2(command__done, async_command, async_command->row_count,
+         async_command->error_code);
   LOG_DEBUG("Total term count: %p %d, columns count: %d\n", statement, term_count, column_count);
 }
 
+// Adds the totals of the table or index named name to the dataset
+static void append_dbstat_entry(const char *name, sqlite3_int64 *totals,
+                                ErlDrvTermData **dataset_p, int *term_count_p,
+                                int *term_allocated_p) {
+  int i;
+
+  EXTEND_DATASET_PTR(3);
+  append_to_dataset(3, *dataset_p, *term_count_p,
+    ERL_DRV_BUF2BINARY, (ErlDrvTermData) name, (ErlDrvTermData) strlen(name));
+  for (i = 0; i < 9; i++) {
+    EXTEND_DATASET_PTR(2);
+    append_to_dataset(2, *dataset_p, *term_count_p,
+      ERL_DRV_INT64, (ErlDrvTermData) &totals[i]);
+  }
+  EXTEND_DATASET_PTR(2);
+  append_to_dataset(2, *dataset_p, *term_count_p, ERL_DRV_TUPLE, (ErlDrvTermData) 10);
+}
+
+// See prepared_dbstat. The rows come ordered by name and path, so the
+// pages of a table or index are consecutive and in tree order; a page not
+// following the previous one is counted as non-sequential.
+static void sql_dbstat_async(void *_async_command) {
+  async_sqlite3_command *async_command = (async_sqlite3_command *) _async_command;
+  sqlite3_drv_t *drv = async_command->driver_data;
+  sqlite3_stmt *statement = async_command->statement;
+  ErlDrvTermData *dataset = NULL;
+  int term_count = 0, term_allocated = 0, entries = 0, pages = 0, result = SQLITE_ROW;
+  ptr_list *ptrs = NULL;
+  char *name = NULL;
+  // pages, leaf pages, overflow pages, leaf cells, payload, unused,
+  // non-sequential pages, first and last page
+  sqlite3_int64 *totals = NULL;
+
+  // the atom is filled in when it is known
+  EXTEND_DATASET_DIRECT(4);
+  append_to_dataset(4, dataset, term_count,
+    ERL_DRV_PORT, driver_mk_port(drv->port), ERL_DRV_ATOM, drv->atom_ok);
+
+  while ((pages < async_command->slice_pages) &&
+         ((result = traced_step(async_command, statement)) == SQLITE_ROW)) {
+    const char *row_name = (const char *) sqlite3_column_text(statement, 0);
+    const char *page_type = (const char *) sqlite3_column_text(statement, 2);
+    sqlite3_int64 page = sqlite3_column_int64(statement, 1);
+
+    if (!row_name)
+      row_name = "";
+    if (!page_type)
+      page_type = "";
+    if (!name || strcmp(name, row_name)) {
+      if (name) {
+        append_dbstat_entry(name, totals, &dataset, &term_count, &term_allocated);
+        entries++;
+      }
+      name = driver_alloc(strlen(row_name) + 1);
+      strcpy(name, row_name);
+      totals = driver_alloc(sizeof(sqlite3_int64) * 9);
+      memset(totals, 0, sizeof(sqlite3_int64) * 9);
+      totals[7] = page;
+      ptrs = add_to_ptr_list(ptrs, name);
+      ptrs = add_to_ptr_list(ptrs, totals);
+    } else if (page != totals[8] + 1) {
+      totals[6]++;
+    }
+    totals[0]++;
+    if (!strcmp(page_type, "leaf")) {
+      totals[1]++;
+      totals[3] += sqlite3_column_int64(statement, 3);
+    } else if (!strcmp(page_type, "overflow")) {
+      totals[2]++;
+    }
+    totals[4] += sqlite3_column_int64(statement, 4);
+    totals[5] += sqlite3_column_int64(statement, 5);
+    totals[8] = page;
+    pages++;
+  }
+
+  if ((result == SQLITE_ROW) || (result == SQLITE_DONE)) {
+    if (name) {
+      append_dbstat_entry(name, totals, &dataset, &term_count, &term_allocated);
+      entries++;
+    }
+    if (result == SQLITE_DONE)
+      sqlite3_reset(statement);
+    EXTEND_DATASET_DIRECT(7);
+    append_to_dataset(7, dataset, term_count,
+      ERL_DRV_NIL, ERL_DRV_LIST, (ErlDrvTermData) (entries + 1),
+      ERL_DRV_TUPLE, (ErlDrvTermData) 2,
+      ERL_DRV_TUPLE, (ErlDrvTermData) 2);
+    if (result == SQLITE_DONE)
+      dataset[3] = drv->atom_done;
+  } else {
+    // drop the atom and the entries, keeping the port
+    term_count = 2;
+    return_error(drv, result, sqlite3_errmsg(drv->db), &dataset, &term_count,
+                 &term_allocated, &async_command->error_code);
+    EXTEND_DATASET_DIRECT(2);
+    append_to_dataset(2, dataset, term_count, ERL_DRV_TUPLE, (ErlDrvTermData) 2);
+    sqlite3_reset(statement);
+  }
+
+  async_command->dataset = dataset;
+  async_command->term_count = term_count;
+  async_command->term_allocated = term_allocated;
+  async_command->ptrs = ptrs;
+  async_command->row_count = pages;
+}
+
+// Executes a prepared statement once for every parameter list in the batch,
+// all on the async thread: {Port, {ok, RowsExecuted}} or {Port, {error, ...}}.
+// Transactions are left to the caller. Upsert batches reply
+// {Port, {ok, Inserted, Updated, Unchanged}} instead: an execution
+// changing no row left its row unchanged, and one which didn't set the
+// last insert rowid (reset to 0 before it) updated its row. Inserts into
+// WITHOUT ROWID tables count as updates.
+static void sql_batch_async(void *_async_command) {
+  async_sqlite3_command *async_command = (async_sqlite3_command *) _async_command;
+  sqlite3_drv_t *drv = async_command->driver_data;
+  sqlite3_stmt *statement = async_command->statement;
+  char *buffer = async_command->batch;
+  int index = async_command->batch_index;
+  int term_count = 0, term_allocated = 0;
+  ErlDrvTermData *dataset = NULL;
+  int i, rows = 0, type, size, result = SQLITE_OK;
+  int returned = 0, changes = 0, readonly = sqlite3_stmt_readonly(statement);
+  int inserted = 0, updated = 0, unchanged = 0;
+  const char *error = NULL;
+  ErlDrvSInt64 started_at = drv->stats_size ? drv_now_usec() : 0;
+
+  PROBE1(command__start, async_command, sqlite3_sql(statement));
+
+  EXTEND_DATASET_DIRECT(2);
+  append_to_dataset(2, dataset, term_count, ERL_DRV_PORT, driver_mk_port(drv->port));
+
+  if (ei_decode_list_header(buffer, &index, &rows)) {
+    result = SQLITE_MISUSE;
+    error = "Expected a list of parameter lists";
+  }
+
+  for (i = 0; (i < rows) && (result == SQLITE_OK); i++) {
+    result = bind_parameters(drv, buffer, async_command->batch_size, &index,
+                             statement, &type, &size, &error);
+    if (result == SQLITE_OK) {
+      if (async_command->count_upserts)
+        sqlite3_set_last_insert_rowid(drv->db, UPSERT_NO_ROWID);
+      while ((result = traced_step(async_command, statement)) == SQLITE_ROW)
+        returned++;
+      if (result == SQLITE_DONE) {
+        result = SQLITE_OK;
+        if (!readonly)
+          changes += sqlite3_changes(drv->db);
+        if (async_command->count_upserts) {
+          if (!sqlite3_changes(drv->db))
+            unchanged++;
+          else if (sqlite3_last_insert_rowid(drv->db) != UPSERT_NO_ROWID)
+            inserted++;
+          else
+            updated++;
+        }
+      } else {
+        error = NULL;
+      }
+    }
+    if (result != SQLITE_OK && !error) {
+      // copy the message, it must outlive the following sqlite3_reset
+      const char *db_error = sqlite3_errmsg(drv->db);
+      char *error_copy = driver_alloc(strlen(db_error) + 1);
+      strcpy(error_copy, db_error);
+      async_command->ptrs = add_to_ptr_list(async_command->ptrs, error_copy);
+      error = error_copy;
+    }
+    sqlite3_reset(statement);
+    sqlite3_clear_bindings(statement);
+  }
+
+  if (drv->stats_size && i) {
+    stats_record(drv, statement, 1, i, drv_now_usec() - started_at,
+                 returned, changes);
+  }
+
+  if (result != SQLITE_OK) {
+    return_error(drv, result, error, &dataset, &term_count,
+                 &term_allocated, &async_command->error_code);
+  } else if (async_command->count_upserts) {
+    EXTEND_DATASET_DIRECT(10);
+    append_to_dataset(10, dataset, term_count,
+      ERL_DRV_ATOM, drv->atom_ok,
+      ERL_DRV_UINT, (ErlDrvTermData) inserted,
+      ERL_DRV_UINT, (ErlDrvTermData) updated,
+      ERL_DRV_UINT, (ErlDrvTermData) unchanged,
+      ERL_DRV_TUPLE, (ErlDrvTermData) 4);
+  } else {
+    EXTEND_DATASET_DIRECT(6);
+    append_to_dataset(6, dataset, term_count,
+      ERL_DRV_ATOM, drv->atom_ok,
+      ERL_DRV_UINT, (ErlDrvTermData) rows,
+      ERL_DRV_TUPLE, (ErlDrvTermData) 2);
+  }
+
+  EXTEND_DATASET_DIRECT(2);
+  append_to_dataset(2, dataset, term_count, ERL_DRV_TUPLE, (ErlDrvTermData) 2);
+
+  async_command->dataset = dataset;
+  async_command->term_count = term_count;
+  async_command->term_allocated = term_allocated;
+  async_command->row_count = i;
+  PROBE2(command__done, async_command, i, async_command->error_code);
+}
+
+// sdbm as in do_hash, over len bytes
+static unsigned int do_hash_n(const char *str, size_t len) {
+  unsigned int hash = 0;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    hash = (unsigned char) str[i] + (hash << 6) + (hash << 16) - hash;
+  return hash;
+}
+
+// Records a completed command in the trace ring
+static void trace_command(sqlite3_drv_t *drv, async_sqlite3_command *async_command) {
+  trace_entry *entry = &drv->trace[drv->trace_count++ % drv->trace_size];
+  const char *sql = NULL;
+  size_t len = 0;
+
+  switch (async_command->type) {
+  case t_script:
+    sql = async_command->script;
+    len = (size_t) (async_command->end - async_command->script);
+    entry->kind = drv->atom_script;
+    break;
+  case t_stmt:
+  case t_batch:
+    sql = sqlite3_sql(async_command->statement);
+    len = sql ? strlen(sql) : 0;
+    entry->kind = async_command->type == t_batch ? drv->atom_batch :
+      async_command->invoke == sql_step_async ? drv->atom_step : drv->atom_exec;
+    break;
+  case t_wal_archive:
+    entry->kind = drv->atom_wal_archive;
+    break;
+  case t_close:
+    entry->kind = drv->atom_close;
+    break;
+  case t_recycle:
+    entry->kind = drv->atom_recycle;
+    break;
+  case t_optimize:
+    // has no reply, so isn't traced (see ready_async)
+    break;
+  }
+
+  entry->id = async_command->id;
+  entry->sql_hash = do_hash_n(sql, len);
+  if (len >= TRACE_SQL_PREFIX)
+    len = TRACE_SQL_PREFIX - 1;
+  if (sql)
+    memcpy(entry->sql, sql, len);
+  entry->sql[len] = '\0';
+  entry->enqueued_at = async_command->enqueued_at;
+  entry->started_at = async_command->started_at;
+  entry->finished_at = async_command->finished_at;
+  entry->replied_at = drv_now_usec();
+  entry->rows = async_command->row_count;
+  entry->error_code = async_command->error_code;
+}
+
+// Writes the trace ring, oldest command first, to the log or stderr
+static void fprint_trace(sqlite3_drv_t *drv) {
+  FILE *out = drv->log ? drv->log : stderr;
+  unsigned long i = drv->trace_count > drv->trace_size ? drv->trace_count - drv->trace_size : 0;
+
+  fprintf(out, "[TRACE] %s: last %lu commands (wait/exec/reply usec, rows, error)\r\n",
+          drv->db_name, drv->trace_count - i);
+  for (; i < drv->trace_count; i++) {
+    trace_entry *entry = &drv->trace[i % drv->trace_size];
+    fprintf(out, "[TRACE] #%lu %08x %lld/%lld/%lld %d %d %s\r\n",
+            entry->id, entry->sql_hash,
+            (long long) (entry->started_at - entry->enqueued_at),
+            (long long) (entry->finished_at - entry->started_at),
+            (long long) (entry->replied_at - entry->finished_at),
+            entry->rows, entry->error_code, entry->sql);
+  }
+  fflush(out);
+}
+
 static void ready_async(ErlDrvData drv_data, ErlDrvThreadData thread_data) {
   async_sqlite3_command *async_command = (async_sqlite3_command *) thread_data;
   sqlite3_drv_t *drv = async_command->driver_data;
+  int res;
 
-  int res =
+  if (async_command->busy_retry) {
+    drv->busy_command = async_command;
+    driver_set_timer(drv->port, (unsigned long) async_command->busy_delay_ms);
+    return;
+  }
+  drv->commands_queued--;
+  // once the statement ran, so that queries admitted meanwhile are
+  // checked again with the new schema and statistics
+  if (async_command->plans_changed && !++drv->admission_epoch)
+    drv->admission_epoch = 1;
+  if (async_command->type == t_optimize) {
+    drv->optimize_pending = 0;
+    sql_free_async(async_command);
+    return;
+  }
+
+  if (async_command->changed_count || async_command->changed_tables)
+    output_changes(drv, async_command);
+
+  res =
     #ifdef PRE_R16B
     driver_output_term(drv->port,
     #else
@@ -1269,7 +2600,23 @@ static void ready_async(ErlDrvData drv_data, ErlDrvThreadData thread_data) {
 #endif
   }
 
+  PROBE2(command__reply, async_command,
+         async_command->term_count * sizeof(ErlDrvTermData), res);
+  if (drv->trace_size) {
+    trace_command(drv, async_command);
+    if (async_command->error_code && drv->trace_dump_on_error)
+      fprint_trace(drv);
+  }
   LOG_DEBUG("Total term count: %p %d, rows count: %d (%d)\n", async_command->statement, async_command->term_count, async_command->row_count, res);
+  if (async_command->optimize_due)
+    drv->optimize_due = 1;
+  if (drv->optimize_due && !drv->commands_queued && !drv->optimize_pending && !drv->closing) {
+    async_sqlite3_command *optimize_command = make_async_command_statement(drv, NULL, 0);
+    optimize_command->type = t_optimize;
+    drv->optimize_due = 0;
+    drv->optimize_pending = 1;
+    exec_async_command(drv, optimize_async, optimize_command);
+  }
   sql_free_async(async_command);
 }
 
@@ -1278,6 +2625,7 @@ static int prepare(sqlite3_drv_t *drv, char *command, int command_size) {
   const char *rest;
   sqlite3_stmt *statement;
   ErlDrvTermData spec[6];
+  char reason[ADMISSION_REASON_SIZE];
 
   LOG_DEBUG("Preparing statement: %.*s\n", command_size, command);
   result = sqlite3_prepare_v2(drv->db, command, command_size, &statement, &rest);
@@ -1285,6 +2633,9 @@ static int prepare(sqlite3_drv_t *drv, char *command, int command_size) {
     return output_db_error(drv);
   } else if (statement == NULL) {
     return output_error(drv, SQLITE_MISUSE, "empty statement");
+  } else if (admission_check(drv, statement, reason, sizeof(reason))) {
+    sqlite3_finalize(statement);
+    return output_rejected(drv, reason);
   }
 
   if (drv->prepared_count >= drv->prepared_alloc) {
@@ -1318,6 +2669,7 @@ static int prepared_bind(sqlite3_drv_t *drv, char *buffer, int buffer_size) {
   long long_prepared_index;
   int index = 0, type, size;
   sqlite3_stmt *statement;
+  const char *error = NULL;
 
   LOG_DEBUG("Finalizing prepared statement: %.*s\n", buffer_size, buffer);
 
@@ -1334,11 +2686,11 @@ static int prepared_bind(sqlite3_drv_t *drv, char *buffer, int buffer_size) {
 
   statement = drv->prepared_stmts[prepared_index];
   result =
-    bind_parameters(drv, buffer, buffer_size, &index, statement, &type, &size);
+    bind_parameters(drv, buffer, buffer_size, &index, statement, &type, &size, &error);
   if (result == SQLITE_OK) {
     return output_ok(drv);
   } else {
-    return result; // error has already been output
+    return output_bind_error(drv, result, error);
   }
 }
 
@@ -1387,6 +2739,85 @@ static int prepared_columns(sqlite3_drv_t *drv, char *buffer, int buffer_size) {
   return 0;
 }
 
+// Returns {Port, [{SelectId, Name, Explain, Loops, Visited, Estimated,
+// Cycles}]} with the counters of every loop in the plan of a prepared
+// statement since it was prepared or last asked for, and resets them.
+// Cycles needs SQLite 3.42 or newer and is 0 otherwise.
+static int prepared_scan_status(sqlite3_drv_t *drv, char *buffer, int buffer_size) {
+#ifdef SQLITE_ENABLE_STMT_SCANSTATUS
+  unsigned int prepared_index;
+  long long_prepared_index;
+  int index = 0, term_count = 0, term_allocated = 0, loop, select_id;
+  sqlite3_stmt *statement;
+  ErlDrvTermData *dataset = NULL, port;
+  ptr_list *ptrs = NULL;
+  const char *name, *explain;
+
+  ei_decode_version(buffer, &index, NULL);
+  ei_decode_long(buffer, &index, &long_prepared_index);
+  prepared_index = (unsigned int) long_prepared_index;
+
+  if ((prepared_index >= drv->prepared_count) || !drv->prepared_stmts[prepared_index]) {
+    return output_error(drv, SQLITE_MISUSE,
+                        "Trying to get scan status of non-existent prepared statement");
+  }
+
+  statement = drv->prepared_stmts[prepared_index];
+
+  port = driver_mk_port(drv->port);
+  EXTEND_DATASET_DIRECT(2);
+  append_to_dataset(2, dataset, term_count, ERL_DRV_PORT, port);
+
+  for (loop = 0; ; loop++) {
+    sqlite3_int64 *counters = driver_alloc(sizeof(sqlite3_int64) * 3);
+    double *estimated = driver_alloc(sizeof(double));
+    ptrs = add_to_ptr_list(ptrs, counters);
+    ptrs = add_to_ptr_list(ptrs, estimated);
+    if (sqlite3_stmt_scanstatus(statement, loop, SQLITE_SCANSTAT_NLOOP, &counters[0]))
+      break;
+    sqlite3_stmt_scanstatus(statement, loop, SQLITE_SCANSTAT_NVISIT, &counters[1]);
+    sqlite3_stmt_scanstatus(statement, loop, SQLITE_SCANSTAT_EST, estimated);
+    sqlite3_stmt_scanstatus(statement, loop, SQLITE_SCANSTAT_NAME, &name);
+    sqlite3_stmt_scanstatus(statement, loop, SQLITE_SCANSTAT_EXPLAIN, &explain);
+    sqlite3_stmt_scanstatus(statement, loop, SQLITE_SCANSTAT_SELECTID, &select_id);
+    counters[2] = 0;
+#ifdef SQLITE_SCANSTAT_NCYCLE
+    sqlite3_stmt_scanstatus(statement, loop, SQLITE_SCANSTAT_NCYCLE, &counters[2]);
+#endif
+    if (!name) name = "";
+    if (!explain) explain = "";
+
+    EXTEND_DATASET_DIRECT(18);
+    append_to_dataset(18, dataset, term_count,
+      ERL_DRV_INT, (ErlDrvTermData) (ErlDrvSInt) select_id,
+      ERL_DRV_BUF2BINARY, (ErlDrvTermData) name, (ErlDrvTermData) strlen(name),
+      ERL_DRV_BUF2BINARY, (ErlDrvTermData) explain, (ErlDrvTermData) strlen(explain),
+      ERL_DRV_INT64, (ErlDrvTermData) &counters[0],
+      ERL_DRV_INT64, (ErlDrvTermData) &counters[1],
+      ERL_DRV_FLOAT, (ErlDrvTermData) estimated,
+      ERL_DRV_INT64, (ErlDrvTermData) &counters[2],
+      ERL_DRV_TUPLE, (ErlDrvTermData) 7);
+  }
+  EXTEND_DATASET_DIRECT(5);
+  append_to_dataset(5, dataset, term_count,
+    ERL_DRV_NIL, ERL_DRV_LIST, (ErlDrvTermData) (loop + 1),
+    ERL_DRV_TUPLE, (ErlDrvTermData) 2);
+
+  #ifdef PRE_R16B
+  driver_output_term(drv->port,
+  #else
+  erl_drv_output_term(port,
+  #endif
+    dataset, term_count);
+  sqlite3_stmt_scanstatus_reset(statement);
+  free_ptr_list(ptrs, driver_free_fun);
+  driver_free(dataset);
+  return 0;
+#else
+  return output_error(drv, SQLITE_MISUSE, "scan status not enabled, recompile erlang-sqlite3 with SQLITE_ENABLE_STMT_SCANSTATUS defined");
+#endif
+}
+
 static int prepared_step(sqlite3_drv_t *drv, char *buffer, int buffer_size) {
   unsigned int prepared_index;
   long long_prepared_index;
@@ -1413,6 +2844,81 @@ static int prepared_step(sqlite3_drv_t *drv, char *buffer, int buffer_size) {
   return 0;
 }
 
+static int prepared_batch(sqlite3_drv_t *drv, char *buffer, int buffer_size,
+                          int count_upserts) {
+  unsigned int prepared_index;
+  long long_prepared_index;
+  int index = 0, size;
+  async_sqlite3_command *async_command;
+
+  ei_decode_version(buffer, &index, NULL);
+  if (ei_decode_tuple_header(buffer, &index, &size) || (size != 2)) {
+    return output_error(drv, SQLITE_MISUSE,
+                        "Expected a tuple of prepared statement and parameter lists");
+  }
+  ei_decode_long(buffer, &index, &long_prepared_index);
+  prepared_index = (unsigned int) long_prepared_index;
+
+  if (prepared_index >= drv->prepared_count || !drv->prepared_stmts[prepared_index]) {
+    LOG_DEBUG("Tried to run a batch on prepared statement #%d, but maximum possible is #%d\n",
+      prepared_index, drv->prepared_count - 1);
+    return output_error(drv, SQLITE_MISUSE,
+                        "Trying to evaluate non-existent prepared statement");
+  }
+
+  LOG_DEBUG("Running a batch on prepared statement #%d\n", prepared_index);
+
+  // the parameters are decoded on the async thread, so keep a copy of them
+  async_command = make_async_command_statement(drv, drv->prepared_stmts[prepared_index], 0);
+  async_command->type = t_batch;
+  async_command->batch = driver_alloc(sizeof(char) * buffer_size);
+  memcpy(async_command->batch, buffer, sizeof(char) * buffer_size);
+  async_command->batch_size = buffer_size;
+  async_command->batch_index = index;
+  async_command->count_upserts = count_upserts;
+
+  exec_async_command(drv, sql_batch_async, async_command);
+  return 0;
+}
+
+// Steps a prepared `SELECT name, pageno, pagetype, ncell, payload, unused
+// FROM dbstat' through at most SlicePages pages and sums them up per table
+// or index: {Port, {ok | done, [{Name, Pages, LeafPages, OverflowPages,
+// LeafCells, Payload, Unused, NonSequential, FirstPage, LastPage}]}}.
+// done once the statement has no more rows, it is reset then. A table
+// or index may continue in the next slice. The statement keeps its read
+// transaction between slices: dbstat has no constraint on the name to
+// restart it from, every restart would read the pages before again.
+static int prepared_dbstat(sqlite3_drv_t *drv, char *buffer, int buffer_size) {
+  unsigned int prepared_index;
+  long long_prepared_index, slice_pages;
+  int index = 0, size;
+  async_sqlite3_command *async_command;
+
+  ei_decode_version(buffer, &index, NULL);
+  if (ei_decode_tuple_header(buffer, &index, &size) || (size != 2) ||
+      ei_decode_long(buffer, &index, &long_prepared_index) ||
+      ei_decode_long(buffer, &index, &slice_pages) || (slice_pages <= 0)) {
+    return output_error(drv, SQLITE_MISUSE,
+                        "Expected a tuple of prepared statement and number of pages");
+  }
+  prepared_index = (unsigned int) long_prepared_index;
+
+  if (prepared_index >= drv->prepared_count || !drv->prepared_stmts[prepared_index]) {
+    return output_error(drv, SQLITE_MISUSE,
+                        "Trying to evaluate non-existent prepared statement");
+  }
+  if (sqlite3_column_count(drv->prepared_stmts[prepared_index]) != 6) {
+    return output_error(drv, SQLITE_MISUSE, "Expected a statement with the 6 dbstat columns");
+  }
+
+  async_command = make_async_command_statement(drv, drv->prepared_stmts[prepared_index], 0);
+  async_command->slice_pages = slice_pages > INT_MAX ? INT_MAX : (int) slice_pages;
+
+  exec_async_command(drv, sql_dbstat_async, async_command);
+  return 0;
+}
+
 static int prepared_reset(sqlite3_drv_t *drv, char *buffer, int buffer_size) {
   unsigned int prepared_index;
   long long_prepared_index;
@@ -1433,6 +2939,11 @@ static int prepared_reset(sqlite3_drv_t *drv, char *buffer, int buffer_size) {
   LOG_DEBUG("Resetting prepared statement #%d\n", prepared_index);
   // don't bother about error code, any errors should already be shown by step
   statement = drv->prepared_stmts[prepared_index];
+  if (drv->stats_size) {
+    erl_drv_mutex_lock(drv->stats_mutex);
+    stats_forget(drv, statement);
+    erl_drv_mutex_unlock(drv->stats_mutex);
+  }
   sqlite3_reset(statement);
   return output_ok(drv);
 }
@@ -1477,6 +2988,11 @@ static int prepared_finalize(sqlite3_drv_t *drv, char *buffer, int buffer_size)
 
   LOG_DEBUG("Finalizing prepared statement #%d\n", prepared_index);
   // finalize the statement and make sure it isn't accidentally executed again
+  if (drv->stats_size) {
+    erl_drv_mutex_lock(drv->stats_mutex);
+    stats_forget(drv, drv->prepared_stmts[prepared_index]);
+    erl_drv_mutex_unlock(drv->stats_mutex);
+  }
   sqlite3_finalize(drv->prepared_stmts[prepared_index]);
   drv->prepared_stmts[prepared_index] = NULL;
 
@@ -1488,6 +3004,684 @@ static int prepared_finalize(sqlite3_drv_t *drv, char *buffer, int buffer_size)
   return output_ok(drv);
 }
 
+// Returns the path of the WAL archive file with sequence number seq and
+// extension ext (the caller frees it). Names sort in sequence order and
+// also carry the time, so sqlite3_archive can restore up to a point in time.
+static char *wal_archive_path(sqlite3_drv_t *drv, unsigned int seq, const char *ext) {
+  size_t len = strlen(drv->wal_archive_dir) + 48;
+  char *path = driver_alloc(len);
+  snprintf(path, len, "%s/%010u-%lld.%s", drv->wal_archive_dir, seq,
+           (long long) time(NULL), ext);
+  return path;
+}
+
+// Copies file from to file to, writing to a temporary file first so an
+// archive never holds a partially written file. Returns the number of
+// bytes copied (nothing is created for an empty or missing file) or -1.
+static long copy_file(const char *from, const char *to) {
+  size_t tmp_len = strlen(to) + 5, n;
+  char *tmp = driver_alloc(tmp_len);
+  char *buf = NULL;
+  FILE *in, *out = NULL;
+  long copied = 0;
+
+  snprintf(tmp, tmp_len, "%s.tmp", to);
+  in = fopen(from, "rb");
+  if (in) {
+    buf = driver_alloc(65536);
+    while ((copied >= 0) && (n = fread(buf, 1, 65536, in)) > 0) {
+      if (!out && !(out = fopen(tmp, "wb")))
+        copied = -1;
+      else if (fwrite(buf, 1, n, out) != n)
+        copied = -1;
+      else
+        copied += (long) n;
+    }
+    if (ferror(in))
+      copied = -1;
+    fclose(in);
+    driver_free(buf);
+  }
+  if (out) {
+    if (fclose(out) || (copied > 0 && rename(tmp, to)))
+      copied = -1;
+    if (copied <= 0)
+      remove(tmp);
+  }
+  driver_free(tmp);
+  return copied;
+}
+
+// Writes a base snapshot of the database with the backup API. Base N
+// contains everything in the WAL segments before N.
+static int wal_archive_snapshot(sqlite3_drv_t *drv) {
+  char *path = wal_archive_path(drv, drv->wal_archive_seq, "base");
+  size_t tmp_len = strlen(path) + 5;
+  char *tmp = driver_alloc(tmp_len);
+  sqlite3 *dest = NULL;
+  sqlite3_backup *backup;
+  int result;
+
+  snprintf(tmp, tmp_len, "%s.tmp", path);
+  result = sqlite3_open_v2(tmp, &dest, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+  if (result == SQLITE_OK) {
+    backup = sqlite3_backup_init(dest, "main", drv->db, "main");
+    if (backup) {
+      sqlite3_backup_step(backup, -1);
+      sqlite3_backup_finish(backup);
+    }
+    result = sqlite3_errcode(dest);
+  }
+  sqlite3_close(dest);
+
+  if (result == SQLITE_OK && rename(tmp, path) == 0) {
+    drv->wal_segments_since_snapshot = 0;
+  } else {
+    LOG_ERROR("Failed to write WAL archive snapshot %s: %d", path, result);
+    remove(tmp);
+    result = result == SQLITE_OK ? SQLITE_CANTOPEN : result;
+  }
+  driver_free(tmp);
+  driver_free(path);
+  return result;
+}
+
+// Copies the WAL into the next archive segment, then checkpoints it. The
+// driver is the only one checkpointing, so no frame reaches the database
+// file before it's archived; when the copy fails nothing is checkpointed
+// and the next commit retries.
+static int wal_archive_segment(sqlite3_drv_t *drv) {
+  const char *db_file = sqlite3_db_filename(drv->db, "main");
+  size_t wal_len = strlen(db_file) + 5;
+  char *wal_file = driver_alloc(wal_len);
+  char *path = wal_archive_path(drv, drv->wal_archive_seq, "wal");
+  long copied;
+  int result = SQLITE_OK;
+
+  snprintf(wal_file, wal_len, "%s-wal", db_file);
+  copied = copy_file(wal_file, path);
+  if (copied < 0) {
+    LOG_ERROR("Failed to archive %s to %s", wal_file, path);
+    result = SQLITE_IOERR;
+  } else {
+    if (copied > 0) {
+      drv->wal_archive_seq++;
+      drv->wal_segments_since_snapshot++;
+    }
+    // SQLITE_BUSY means readers kept the WAL from being reset, so the next
+    // segment repeats some frames; restoring them twice is harmless
+    result = sqlite3_wal_checkpoint_v2(drv->db, "main", SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL);
+    if (result == SQLITE_BUSY)
+      result = SQLITE_OK;
+    if ((result == SQLITE_OK) &&
+        (drv->wal_segments_since_snapshot >= drv->wal_snapshot_every))
+      result = wal_archive_snapshot(drv);
+  }
+  driver_free(path);
+  driver_free(wal_file);
+  return result;
+}
+
+// Replaces the automatic checkpoint once the WAL has grown past
+// wal_archive_pages. The commit has already happened, so failures are
+// only logged.
+static int wal_archive_hook(void *data, sqlite3 *db, const char *db_name, int pages) {
+  sqlite3_drv_t *drv = (sqlite3_drv_t *) data;
+
+  if ((pages >= drv->wal_archive_pages) && !strcmp(db_name, "main"))
+    wal_archive_segment(drv);
+  return SQLITE_OK;
+}
+
+// Either enables archiving ({Dir, Pages, SnapshotEvery, NextSeq}) or
+// archives the current WAL right away ('segment'): {Port, ok} or
+// {Port, {error, ...}}.
+static void wal_archive_async(void *_async_command) {
+  async_sqlite3_command *async_command = (async_sqlite3_command *) _async_command;
+  sqlite3_drv_t *drv = async_command->driver_data;
+  char *buffer = async_command->batch;
+  int index = async_command->batch_index;
+  int term_count = 0, term_allocated = 0;
+  ErlDrvTermData *dataset = NULL;
+  int size, type, result = SQLITE_OK;
+  long pages, snapshot_every, seq, dir_len;
+  char atom[MAXATOMLEN];
+  char *dir;
+  const char *error = NULL;
+  sqlite3_stmt *statement;
+
+  EXTEND_DATASET_DIRECT(2);
+  append_to_dataset(2, dataset, term_count, ERL_DRV_PORT, driver_mk_port(drv->port));
+
+  if (!ei_decode_atom(buffer, &index, atom) && !strcmp(atom, "segment")) {
+    if (drv->wal_archive_dir) {
+      result = wal_archive_segment(drv);
+      error = "Failed to archive the WAL";
+    } else {
+      result = SQLITE_MISUSE;
+      error = "WAL archiving is not enabled";
+    }
+  } else if (ei_decode_tuple_header(buffer, &index, &size) || (size != 4) ||
+             ei_get_type(buffer, &index, &type, &size) || (type != ERL_BINARY_EXT)) {
+    result = SQLITE_MISUSE;
+    error = "Expected {Dir, Pages, SnapshotEvery, NextSeq}";
+  } else {
+    dir = driver_alloc(size + 1);
+    ei_decode_binary(buffer, &index, dir, &dir_len);
+    dir[dir_len] = '\0';
+    if (ei_decode_long(buffer, &index, &pages) ||
+        ei_decode_long(buffer, &index, &snapshot_every) ||
+        ei_decode_long(buffer, &index, &seq)) {
+      driver_free(dir);
+      result = SQLITE_MISUSE;
+      error = "Expected {Dir, Pages, SnapshotEvery, NextSeq}";
+    } else {
+      // the driver must be the only one checkpointing, and only WAL has frames to archive
+      result = sqlite3_prepare_v2(drv->db, "PRAGMA journal_mode=WAL;", -1, &statement, NULL);
+      if (result == SQLITE_OK) {
+        if ((sqlite3_step(statement) != SQLITE_ROW) ||
+            strcmp((const char *) sqlite3_column_text(statement, 0), "wal")) {
+          result = SQLITE_MISUSE;
+          error = "WAL archiving requires an on-disk database in WAL mode";
+        }
+        sqlite3_finalize(statement);
+      }
+      if (result == SQLITE_OK) {
+        if (drv->wal_archive_dir)
+          driver_free(drv->wal_archive_dir);
+        drv->wal_archive_dir = dir;
+        drv->wal_archive_pages = (int) pages;
+        drv->wal_snapshot_every = (int) snapshot_every;
+        drv->wal_archive_seq = (unsigned int) seq;
+        sqlite3_wal_hook(drv->db, wal_archive_hook, drv);
+        // start from a base snapshot, frames already in the WAL are part of it
+        result = wal_archive_snapshot(drv);
+        error = "Failed to write the WAL archive base snapshot";
+        if (result == SQLITE_OK) {
+          sqlite3_wal_checkpoint_v2(drv->db, "main", SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL);
+        } else {
+          sqlite3_wal_autocheckpoint(drv->db, 1000); // the SQLite default
+          driver_free(drv->wal_archive_dir);
+          drv->wal_archive_dir = NULL;
+        }
+      } else {
+        driver_free(dir);
+      }
+    }
+  }
+
+  if (result != SQLITE_OK) {
+    return_error(drv, result, error ? error : sqlite3_errmsg(drv->db), &dataset,
+                 &term_count, &term_allocated, &async_command->error_code);
+  } else {
+    EXTEND_DATASET_DIRECT(2);
+    append_to_dataset(2, dataset, term_count, ERL_DRV_ATOM, drv->atom_ok);
+  }
+
+  EXTEND_DATASET_DIRECT(2);
+  append_to_dataset(2, dataset, term_count, ERL_DRV_TUPLE, (ErlDrvTermData) 2);
+
+  async_command->dataset = dataset;
+  async_command->term_count = term_count;
+  async_command->term_allocated = term_allocated;
+}
+
+static int wal_archive(sqlite3_drv_t *drv, char *buffer, int buffer_size) {
+  int index = 0;
+  async_sqlite3_command *async_command;
+
+  ei_decode_version(buffer, &index, NULL);
+
+  // the hook and the archive state are only used on the async thread
+  async_command = make_async_command_statement(drv, NULL, 0);
+  async_command->type = t_wal_archive;
+  async_command->batch = driver_alloc(sizeof(char) * buffer_size);
+  memcpy(async_command->batch, buffer, sizeof(char) * buffer_size);
+  async_command->batch_size = buffer_size;
+  async_command->batch_index = index;
+
+  exec_async_command(drv, wal_archive_async, async_command);
+  return 0;
+}
+
+static void close_async(void *_async_command) {
+  async_sqlite3_command *async_command = (async_sqlite3_command *) _async_command;
+  sqlite3_drv_t *drv = async_command->driver_data;
+  int term_count = 0, term_allocated = 0;
+  ErlDrvTermData *dataset = NULL;
+  int result;
+
+  EXTEND_DATASET_DIRECT(2);
+  append_to_dataset(2, dataset, term_count, ERL_DRV_PORT, driver_mk_port(drv->port));
+
+  result = close_connection(drv);
+  if (result != SQLITE_OK) {
+    return_error(drv, result, sqlite3_errmsg(drv->db), &dataset,
+                 &term_count, &term_allocated, &async_command->error_code);
+  } else {
+    EXTEND_DATASET_DIRECT(2);
+    append_to_dataset(2, dataset, term_count, ERL_DRV_ATOM, drv->atom_ok);
+  }
+
+  EXTEND_DATASET_DIRECT(2);
+  append_to_dataset(2, dataset, term_count, ERL_DRV_TUPLE, (ErlDrvTermData) 2);
+
+  async_command->dataset = dataset;
+  async_command->term_count = term_count;
+  async_command->term_allocated = term_allocated;
+}
+
+// Closes the database on the async thread after the commands queued
+// before, since finalizing and checkpointing a large WAL can take long.
+// Replies {Port, ok}, the port should be closed after that; commands sent
+// in between are refused.
+static int close_db(sqlite3_drv_t *drv, char *buffer, int buffer_size) {
+  async_sqlite3_command *async_command;
+
+  drv->closing = 1;
+  // nobody is waiting for a command still to be retried any more
+  if (drv->busy_command) {
+    driver_cancel_timer(drv->port);
+    sql_free_async(drv->busy_command);
+    drv->busy_command = NULL;
+  }
+
+  async_command = make_async_command_statement(drv, NULL, 0);
+  async_command->type = t_close;
+  exec_async_command(drv, close_async, async_command);
+  return 0;
+}
+
+// Connection settings a user may change, which recycle restores
+static const char *recycled_pragmas[] = {
+  "foreign_keys", "defer_foreign_keys", "recursive_triggers", "query_only", "busy_timeout",
+  "synchronous", "cache_size", "temp_store", NULL
+};
+
+// Saves recycled_pragmas as a script setting them back, and the journal
+// mode
+static void save_settings(sqlite3_drv_t *drv, sqlite3 *db) {
+  char sql[64];
+  sqlite3_stmt *statement;
+  int i, n = 0;
+
+  for (i = 0; recycled_pragmas[i]; i++) {
+    snprintf(sql, sizeof(sql), "PRAGMA %s;", recycled_pragmas[i]);
+    if (sqlite3_prepare_v2(db, sql, -1, &statement, NULL) != SQLITE_OK)
+      continue;
+    if (sqlite3_step(statement) == SQLITE_ROW)
+      n += snprintf(drv->recycle_pragmas + n, sizeof(drv->recycle_pragmas) - n,
+                    "PRAGMA %s=%lld;", recycled_pragmas[i],
+                    (long long) sqlite3_column_int64(statement, 0));
+    sqlite3_finalize(statement);
+  }
+  if (sqlite3_prepare_v2(db, "PRAGMA journal_mode;", -1, &statement, NULL) == SQLITE_OK) {
+    if (sqlite3_step(statement) == SQLITE_ROW)
+      snprintf(drv->journal_mode, sizeof(drv->journal_mode), "%s",
+               (const char *) sqlite3_column_text(statement, 0));
+    sqlite3_finalize(statement);
+  }
+}
+
+// Detaches the attached databases, drops the TEMP schema and restores
+// the settings saved by save_settings. A changed journal mode is only
+// restored if neither is WAL, which is a setting of the file.
+static int reset_session(sqlite3_drv_t *drv) {
+  sqlite3_stmt *statement;
+  char *script = NULL;
+  char sql[64];
+  int result;
+
+  // query_only would keep the TEMP schema, the saved value is restored below
+  result = sqlite3_exec(drv->db, "PRAGMA query_only=0;", NULL, NULL, NULL);
+  if (result == SQLITE_OK)
+    result = sqlite3_prepare_v2(drv->db,
+      "SELECT group_concat(sql, '') FROM ("
+      " SELECT 'DETACH DATABASE \"' || replace(name, '\"', '\"\"') || '\";' AS sql"
+      "  FROM pragma_database_list WHERE seq > 1"
+      " UNION ALL"
+      " SELECT 'DROP ' || type || ' IF EXISTS temp.\"' || replace(name, '\"', '\"\"') || '\";'"
+      "  FROM sqlite_temp_master"
+      "  WHERE type IN ('trigger', 'view', 'table') AND name NOT LIKE 'sqlite\\_%' ESCAPE '\\');",
+      -1, &statement, NULL);
+  if (result != SQLITE_OK)
+    return result;
+  if ((sqlite3_step(statement) == SQLITE_ROW) && sqlite3_column_text(statement, 0))
+    script = sqlite3_mprintf("%s", (const char *) sqlite3_column_text(statement, 0));
+  result = sqlite3_finalize(statement);
+  if (script) {
+    if (result == SQLITE_OK)
+      result = sqlite3_exec(drv->db, script, NULL, NULL, NULL);
+    sqlite3_free(script);
+  }
+  if (result == SQLITE_OK)
+    result = sqlite3_exec(drv->db, drv->recycle_pragmas, NULL, NULL, NULL);
+
+  if ((result == SQLITE_OK) && drv->journal_mode[0] && strcmp(drv->journal_mode, "wal") &&
+      (sqlite3_prepare_v2(drv->db, "PRAGMA journal_mode;", -1, &statement, NULL) == SQLITE_OK)) {
+    if ((sqlite3_step(statement) == SQLITE_ROW) &&
+        strcmp((const char *) sqlite3_column_text(statement, 0), "wal") &&
+        strcmp((const char *) sqlite3_column_text(statement, 0), drv->journal_mode))
+      snprintf(sql, sizeof(sql), "PRAGMA journal_mode=%s;", drv->journal_mode);
+    else
+      sql[0] = '\0';
+    sqlite3_finalize(statement);
+    if (sql[0])
+      result = sqlite3_exec(drv->db, sql, NULL, NULL, NULL);
+  }
+  return result;
+}
+
+static void recycle_async(void *_async_command) {
+  async_sqlite3_command *async_command = (async_sqlite3_command *) _async_command;
+  sqlite3_drv_t *drv = async_command->driver_data;
+  int term_count = 0, term_allocated = 0;
+  ErlDrvTermData *dataset = NULL;
+  int result = SQLITE_OK;
+  unsigned int i;
+
+  EXTEND_DATASET_DIRECT(2);
+  append_to_dataset(2, dataset, term_count, ERL_DRV_PORT, driver_mk_port(drv->port));
+
+  if (drv->stats_size) {
+    erl_drv_mutex_lock(drv->stats_mutex);
+    drv->stats_cached_statement = NULL;
+    while (drv->stats_pending)
+      stats_take_pending(drv, drv->stats_pending->statement);
+    erl_drv_mutex_unlock(drv->stats_mutex);
+  }
+  for (i = 0; i < drv->prepared_count; i++)
+    sqlite3_finalize(drv->prepared_stmts[i]);
+  drv->prepared_count = 0;
+
+  if (!sqlite3_get_autocommit(drv->db))
+    result = sqlite3_exec(drv->db, "ROLLBACK;", NULL, NULL, NULL);
+  if (result == SQLITE_OK)
+    result = reset_session(drv);
+
+  if (result != SQLITE_OK) {
+    return_error(drv, result, sqlite3_errmsg(drv->db), &dataset,
+                 &term_count, &term_allocated, &async_command->error_code);
+  } else {
+    EXTEND_DATASET_DIRECT(2);
+    append_to_dataset(2, dataset, term_count, ERL_DRV_ATOM, drv->atom_ok);
+  }
+
+  EXTEND_DATASET_DIRECT(2);
+  append_to_dataset(2, dataset, term_count, ERL_DRV_TUPLE, (ErlDrvTermData) 2);
+
+  async_command->dataset = dataset;
+  async_command->term_count = term_count;
+  async_command->term_allocated = term_allocated;
+}
+
+// Returns the connection to the state of a new one for the next user:
+// finalizes the prepared statements, rolls back an open transaction and
+// resets the session (see reset_session), but keeps the loaded schema
+// and the cache of auto-parameterized statements.
+static int recycle(sqlite3_drv_t *drv, char *buffer, int buffer_size) {
+  async_sqlite3_command *async_command = make_async_command_statement(drv, NULL, 0);
+
+  async_command->type = t_recycle;
+  exec_async_command(drv, recycle_async, async_command);
+  return 0;
+}
+
+// Prepares [{Index, Name, SQL}] as persistent statements, replacing the
+// queries at indices below query_count. Either all of them compile and
+// are registered or the error of the first one that doesn't is returned.
+static int register_queries(sqlite3_drv_t *drv, char *buffer, int buffer_size) {
+  int index = 0, count, size, type, i, n, result = SQLITE_OK;
+  long query_index, sql_len;
+  char name[MAXATOMLEN];
+  char message[MAXATOMLEN + 128];
+  char *sql;
+  const char *tail;
+  long *indices;
+  sqlite3_stmt **statements;
+  unsigned int new_count;
+
+  ei_decode_version(buffer, &index, NULL);
+  if (ei_decode_list_header(buffer, &index, &count) || (count < 0))
+    return output_error(drv, SQLITE_MISUSE, "Expected a list of {Index, Name, SQL}");
+  if (!count)
+    return output_ok(drv);
+
+  indices = driver_alloc(sizeof(long) * count);
+  statements = driver_alloc(sizeof(sqlite3_stmt *) * count);
+  new_count = drv->query_count;
+  for (n = 0; n < count; n++) {
+    if (ei_decode_tuple_header(buffer, &index, &size) || (size != 3) ||
+        ei_decode_long(buffer, &index, &query_index) ||
+        (query_index < 0) || (query_index > (long) drv->query_count + count) ||
+        ei_decode_atom(buffer, &index, name) ||
+        ei_get_type(buffer, &index, &type, &size) || (type != ERL_BINARY_EXT)) {
+      result = SQLITE_MISUSE;
+      snprintf(message, sizeof(message), "Expected a list of {Index, Name, SQL}");
+      break;
+    }
+    sql = driver_alloc(size + 1);
+    ei_decode_binary(buffer, &index, sql, &sql_len);
+#if SQLITE_VERSION_NUMBER >= 3020000
+    result = sqlite3_prepare_v3(drv->db, sql, (int) sql_len, SQLITE_PREPARE_PERSISTENT,
+                                &statements[n], &tail);
+#else
+    result = sqlite3_prepare_v2(drv->db, sql, (int) sql_len, &statements[n], &tail);
+#endif
+    if (result != SQLITE_OK) {
+      snprintf(message, sizeof(message), "Query %s: %s", name, sqlite3_errmsg(drv->db));
+    } else if (!statements[n]) {
+      result = SQLITE_MISUSE;
+      snprintf(message, sizeof(message), "Query %s: empty statement", name);
+    } else {
+      while ((tail < sql + sql_len) && (isspace((unsigned char) *tail) || (*tail == ';')))
+        tail++;
+      if (tail < sql + sql_len) {
+        sqlite3_finalize(statements[n]);
+        result = SQLITE_MISUSE;
+        snprintf(message, sizeof(message), "Query %s: more than one statement", name);
+      }
+    }
+    driver_free(sql);
+    if (result != SQLITE_OK)
+      break;
+    indices[n] = query_index;
+    if ((unsigned int) query_index >= new_count)
+      new_count = (unsigned int) query_index + 1;
+  }
+
+  if (result != SQLITE_OK) {
+    for (i = 0; i < n; i++)
+      sqlite3_finalize(statements[i]);
+  } else {
+    if (new_count > drv->query_count) {
+      drv->queries = driver_realloc(drv->queries, sizeof(sqlite3_stmt *) * new_count);
+      drv->query_admitted = driver_realloc(drv->query_admitted,
+                                           sizeof(unsigned int) * new_count);
+      memset(drv->queries + drv->query_count, 0,
+             sizeof(sqlite3_stmt *) * (new_count - drv->query_count));
+      memset(drv->query_admitted + drv->query_count, 0,
+             sizeof(unsigned int) * (new_count - drv->query_count));
+      drv->query_count = new_count;
+    }
+    for (i = 0; i < count; i++) {
+      if (drv->queries[indices[i]]) {
+        if (drv->stats_size) {
+          erl_drv_mutex_lock(drv->stats_mutex);
+          stats_forget(drv, drv->queries[indices[i]]);
+          erl_drv_mutex_unlock(drv->stats_mutex);
+        }
+        sqlite3_finalize(drv->queries[indices[i]]);
+      }
+      drv->queries[indices[i]] = statements[i];
+      drv->query_admitted[indices[i]] = 0;
+    }
+  }
+  driver_free(indices);
+  driver_free(statements);
+
+  return result == SQLITE_OK ? output_ok(drv) : output_error(drv, result, message);
+}
+
+// Runs the named query {Index, Params} like sql_bind_and_exec, but
+// without preparing or finalizing anything. Admission control keeps its
+// verdict until the schema or the statistics change (admission_epoch);
+// a rejected query is checked again on every call.
+static int query(sqlite3_drv_t *drv, char *buffer, int buffer_size) {
+  int index = 0, type, size, result;
+  long query_index;
+  sqlite3_stmt *statement;
+  const char *error = NULL;
+  char reason[ADMISSION_REASON_SIZE];
+  async_sqlite3_command *async_command;
+
+  ei_decode_version(buffer, &index, NULL);
+  if (ei_decode_tuple_header(buffer, &index, &size) || (size != 2) ||
+      ei_decode_long(buffer, &index, &query_index)) {
+    return output_error(drv, SQLITE_MISUSE, "Expected a tuple of query index and params");
+  }
+  if ((query_index < 0) || (query_index >= (long) drv->query_count) ||
+      !drv->queries[query_index]) {
+    return output_error(drv, SQLITE_MISUSE, "Trying to run non-existent query");
+  }
+
+  statement = drv->queries[query_index];
+  if (drv->query_admitted[query_index] != drv->admission_epoch) {
+    if (admission_check(drv, statement, reason, sizeof(reason)))
+      return output_rejected(drv, reason);
+    drv->query_admitted[query_index] = drv->admission_epoch;
+  }
+  result = bind_parameters(drv, buffer, buffer_size, &index, statement, &type, &size, &error);
+  if (result != SQLITE_OK) {
+    sqlite3_clear_bindings(statement);
+    return output_bind_error(drv, result, error);
+  }
+
+  async_command = make_async_command_statement(drv, statement, 0);
+  async_command->reset_statement_on_free = 1;
+  exec_async_command(drv, sql_exec_async, async_command);
+  return 0;
+}
+
+// 'dump' returns {Port, [{Id, Kind, SqlHash, Sql, EnqueuedAt, WaitUs,
+// ExecUs, ReplyUs, Rows, ErrorCode}]} for the recent commands, oldest
+// first; {dump_on_error, Bool} sets whether the ring is written to the
+// log (or stderr) when a command fails.
+static int trace(sqlite3_drv_t *drv, char *buffer, int buffer_size) {
+  int index = 0, size, term_count = 0, term_allocated = 0, dump_on_error;
+  char atom[MAXATOMLEN];
+  ErlDrvTermData *dataset = NULL;
+  unsigned long i, first;
+
+  ei_decode_version(buffer, &index, NULL);
+  if (!ei_decode_tuple_header(buffer, &index, &size)) {
+    if ((size != 2) || ei_decode_atom(buffer, &index, atom) ||
+        strcmp(atom, "dump_on_error") || ei_decode_boolean(buffer, &index, &dump_on_error)) {
+      return output_error(drv, SQLITE_MISUSE, "Expected {dump_on_error, Bool}");
+    }
+    drv->trace_dump_on_error = dump_on_error;
+    return output_ok(drv);
+  } else if (ei_decode_atom(buffer, &index, atom) || strcmp(atom, "dump")) {
+    return output_error(drv, SQLITE_MISUSE, "Expected dump or {dump_on_error, Bool}");
+  }
+
+  first = drv->trace_count > drv->trace_size ? drv->trace_count - drv->trace_size : 0;
+  EXTEND_DATASET_DIRECT(2);
+  append_to_dataset(2, dataset, term_count, ERL_DRV_PORT, driver_mk_port(drv->port));
+  for (i = first; i < drv->trace_count; i++) {
+    trace_entry *entry = &drv->trace[i % drv->trace_size];
+    EXTEND_DATASET_DIRECT(23);
+    append_to_dataset(23, dataset, term_count,
+      ERL_DRV_UINT, (ErlDrvTermData) entry->id,
+      ERL_DRV_ATOM, entry->kind,
+      ERL_DRV_UINT, (ErlDrvTermData) entry->sql_hash,
+      ERL_DRV_BUF2BINARY, (ErlDrvTermData) entry->sql, (ErlDrvTermData) strlen(entry->sql),
+      ERL_DRV_INT64, (ErlDrvTermData) &entry->enqueued_at,
+      ERL_DRV_INT, (ErlDrvTermData) (ErlDrvSInt) (entry->started_at - entry->enqueued_at),
+      ERL_DRV_INT, (ErlDrvTermData) (ErlDrvSInt) (entry->finished_at - entry->started_at),
+      ERL_DRV_INT, (ErlDrvTermData) (ErlDrvSInt) (entry->replied_at - entry->finished_at),
+      ERL_DRV_INT, (ErlDrvTermData) (ErlDrvSInt) entry->rows,
+      ERL_DRV_INT, (ErlDrvTermData) (ErlDrvSInt) entry->error_code,
+      ERL_DRV_TUPLE, (ErlDrvTermData) 10);
+  }
+  EXTEND_DATASET_DIRECT(5);
+  append_to_dataset(5, dataset, term_count,
+    ERL_DRV_NIL, ERL_DRV_LIST, (ErlDrvTermData) (drv->trace_count - first + 1),
+    ERL_DRV_TUPLE, (ErlDrvTermData) 2);
+
+  #ifdef PRE_R16B
+  driver_output_term(drv->port,
+  #else
+  erl_drv_output_term(dataset[1],
+  #endif
+    dataset, term_count);
+  driver_free(dataset);
+  return 0;
+}
+
+// 'dump' returns {Port, [{Sql, Calls, TotalUs, MinUs, MaxUs, Rows,
+// Changes, FullscanSteps, Sorts, Autoindexes, VmSteps}]} for every
+// normalized statement recorded, 'reset' forgets them all.
+static int statement_stats(sqlite3_drv_t *drv, char *buffer, int buffer_size) {
+  int index = 0, term_count = 0, term_allocated = 0;
+  char atom[MAXATOMLEN];
+  ErlDrvTermData *dataset = NULL;
+  unsigned int i;
+
+  ei_decode_version(buffer, &index, NULL);
+  if (ei_decode_atom(buffer, &index, atom) || (strcmp(atom, "dump") && strcmp(atom, "reset"))) {
+    return output_error(drv, SQLITE_MISUSE, "Expected dump or reset");
+  } else if (!drv->stats_size) {
+    return output_error(drv, SQLITE_MISUSE, "Statement statistics are disabled");
+  }
+
+  erl_drv_mutex_lock(drv->stats_mutex);
+  if (!strcmp(atom, "reset")) {
+    for (i = 0; i < drv->stats_count; i++)
+      driver_free(drv->stats[i].sql);
+    drv->stats_count = 0;
+    memset(drv->stats_buckets, -1, sizeof(int) * drv->stats_size);
+    drv->stats_cached_statement = NULL;
+    erl_drv_mutex_unlock(drv->stats_mutex);
+    return output_ok(drv);
+  }
+
+  EXTEND_DATASET_DIRECT(2);
+  append_to_dataset(2, dataset, term_count, ERL_DRV_PORT, driver_mk_port(drv->port));
+  for (i = 0; i < drv->stats_count; i++) {
+    stats_entry *entry = &drv->stats[i];
+    EXTEND_DATASET_DIRECT(25);
+    append_to_dataset(25, dataset, term_count,
+      ERL_DRV_BUF2BINARY, (ErlDrvTermData) entry->sql, (ErlDrvTermData) strlen(entry->sql),
+      ERL_DRV_INT64, (ErlDrvTermData) &entry->calls,
+      ERL_DRV_INT64, (ErlDrvTermData) &entry->total_us,
+      ERL_DRV_INT64, (ErlDrvTermData) &entry->min_us,
+      ERL_DRV_INT64, (ErlDrvTermData) &entry->max_us,
+      ERL_DRV_INT64, (ErlDrvTermData) &entry->rows,
+      ERL_DRV_INT64, (ErlDrvTermData) &entry->changes,
+      ERL_DRV_INT64, (ErlDrvTermData) &entry->fullscan_steps,
+      ERL_DRV_INT64, (ErlDrvTermData) &entry->sorts,
+      ERL_DRV_INT64, (ErlDrvTermData) &entry->autoindexes,
+      ERL_DRV_INT64, (ErlDrvTermData) &entry->vm_steps,
+      ERL_DRV_TUPLE, (ErlDrvTermData) 11);
+  }
+  EXTEND_DATASET_DIRECT(5);
+  append_to_dataset(5, dataset, term_count,
+    ERL_DRV_NIL, ERL_DRV_LIST, (ErlDrvTermData) (drv->stats_count + 1),
+    ERL_DRV_TUPLE, (ErlDrvTermData) 2);
+
+  // the entries are copied into the message, keep them until then
+  #ifdef PRE_R16B
+  driver_output_term(drv->port,
+  #else
+  erl_drv_output_term(dataset[1],
+  #endif
+    dataset, term_count);
+  erl_drv_mutex_unlock(drv->stats_mutex);
+  driver_free(dataset);
+  return 0;
+}
+
 // Unknown Command
 static int unknown(sqlite3_drv_t *drv, char *command, int command_size) {
   // Return {Port, error, -1, unknown_command}
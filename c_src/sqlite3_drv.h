@@ -10,9 +10,11 @@
 #include <ei.h>
 #include <sqlite3.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
 
 #if SQLITE_VERSION_NUMBER < 3006001
 #error "SQLite3 of version 3.6.1 minumum required"
@@ -37,6 +39,38 @@ typedef int ErlDrvSSizeT;
 extern FILE* __cdecl __iob_func(void);
 #endif
 
+// Statically defined tracepoints (provider erlang_sqlite3) for perf,
+// bpftrace and SystemTap. An unattached probe costs a single nop; they're
+// compiled out where <sys/sdt.h> is missing or ERLANG_SQLITE3_NO_PROBES
+// is defined. Every probe gets the port and the command id first:
+//   command__enqueue(port, id, sql, sql_bytes)  command handed to driver_async
+//   command__start(port, id, sql)               async thread picked it up
+//   command__step(port, id, rc)                 after each sqlite3_step
+//   command__encoded(port, id, rows, bytes)     result rows put into the reply
+//   command__done(port, id, rows, rc)           async thread finished
+//   command__reply(port, id, bytes, rc)         reply sent by ready_async
+// sql is a pointer to the SQL text (a script isn't NUL-terminated, use
+// sql_bytes) and bytes counts the ErlDrvTermData of the reply.
+#if defined(__has_include) && !defined(ERLANG_SQLITE3_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define ERLANG_SQLITE3_PROBES
+#endif
+#endif
+
+// Probes for an async command, its port and id are passed first
+#ifdef ERLANG_SQLITE3_PROBES
+#define PROBE1(name, command, a) \
+  DTRACE_PROBE3(erlang_sqlite3, name, (uintptr_t) (command)->driver_data->port, \
+                (command)->id, a)
+#define PROBE2(name, command, a, b) \
+  DTRACE_PROBE4(erlang_sqlite3, name, (uintptr_t) (command)->driver_data->port, \
+                (command)->id, a, b)
+#else
+#define PROBE1(name, command, a) do {} while (0)
+#define PROBE2(name, command, a, b) do {} while (0)
+#endif
+
 // Binary commands between Erlang VM and Driver
 #define CMD_SQL_EXEC 2
 // #define CMD_DEL 3
@@ -53,23 +87,226 @@ extern FILE* __cdecl __iob_func(void);
 #define CMD_CHANGES 14
 #define CMD_FILENAME 15
 #define CMD_TABLE_EXISTS 16
+#define CMD_PREPARED_BATCH 17
+#define CMD_WAL_ARCHIVE 18
+#define CMD_TRACE 19
+#define CMD_STATEMENT_STATS 20
+#define CMD_PREPARED_SCAN_STATUS 21
+#define CMD_CLOSE 22
+#define CMD_RECYCLE 23
+#define CMD_REGISTER_QUERIES 24
+#define CMD_QUERY 25
+#define CMD_PREPARED_UPSERT_BATCH 26
+#define CMD_PREPARED_DBSTAT 27
+#define CMD_SHARED_QUERY 28
+
+// Default number of recent commands kept in the trace ring of every
+// connection (see the -trace=N option) and the length of SQL kept with each
+#define TRACE_DEFAULT_SIZE 32
+#define TRACE_SQL_PREFIX 80
+
+// Default number of distinct normalized statements with statistics kept
+// per connection (see the -stats=N option) and the longest normalized SQL
+#define STATS_DEFAULT_SIZE 256
+#define STATS_SQL_MAX 1024
+
+// Memory map size of immutable databases without the -mmap-size option
+#define IMMUTABLE_MMAP_SIZE 268435456
+
+// Page cache of -memvfs connections in KiB: reading a page from the memory
+// VFS is a copy, so a larger cache would only hold every page twice
+#define MEMVFS_CACHE_KIB 64
+
+// Most literals replaced by parameters in a statement run through the
+// statement cache (see the -auto-param=N option)
+#define PARAM_MAX_LITERALS 100
+
+// Longest pause in milliseconds between retries of a command that got
+// SQLITE_BUSY (see the -busy-retry=Ms option)
+#define BUSY_MAX_DELAY 64
+
+// Last insert rowid set before each row of an upsert batch, still there
+// after the row if it wasn't inserted into a rowid table
+#define UPSERT_NO_ROWID ((sqlite3_int64) (-9223372036854775807LL - 1))
+
+// Longest reason of a statement rejected by admission control
+#define ADMISSION_REASON_SIZE 256
+
+// Longest script of the settings recycle restores, see save_settings
+#define RECYCLE_PRAGMAS_SIZE 512
+
+// Most tables whose changed rows are reported (see the -cache-tables=
+// option) and most rows reported one by one per command, the tables of
+// further rows are reported as changed as a whole
+#define CACHE_MAX_TABLES 32
+#define CACHE_MAX_CHANGES 1024
 
 typedef struct ptr_list {
   void *head;
   struct ptr_list *tail;
 } ptr_list;
 
+// A completed command in the trace ring, times are in microseconds
+typedef struct trace_entry {
+  unsigned long id;
+  ErlDrvTermData kind; // atom: exec, script, step, batch or wal_archive
+  unsigned int sql_hash;
+  char sql[TRACE_SQL_PREFIX];
+  ErlDrvSInt64 enqueued_at;
+  ErlDrvSInt64 started_at;
+  ErlDrvSInt64 finished_at;
+  ErlDrvSInt64 replied_at;
+  int rows;
+  int error_code;
+} trace_entry;
+
+// Aggregated executions of one normalized statement, times in microseconds
+typedef struct stats_entry {
+  unsigned int hash;
+  int next; // next entry in the same bucket, -1 at the end
+  char *sql;
+  ErlDrvSInt64 calls;
+  ErlDrvSInt64 total_us;
+  ErlDrvSInt64 min_us;
+  ErlDrvSInt64 max_us;
+  ErlDrvSInt64 rows;
+  ErlDrvSInt64 changes;
+  ErlDrvSInt64 fullscan_steps;
+  ErlDrvSInt64 sorts;
+  ErlDrvSInt64 autoindexes;
+  ErlDrvSInt64 vm_steps;
+} stats_entry;
+
+// Time spent in the steps of a prepared statement whose execution isn't
+// done yet, counted with the step that finishes it
+typedef struct stats_pending {
+  sqlite3_stmt *statement;
+  ErlDrvSInt64 elapsed_us;
+  struct stats_pending *next;
+} stats_pending;
+
+// A row of a cache table changed by a command, see changes_hook
+typedef struct changed_row {
+  int table; // index in cache_tables
+  sqlite3_int64 rowid;
+} changed_row;
+
+// A statement prepared from SQL with its literals replaced by parameters
+typedef struct param_cache_entry {
+  unsigned int hash;
+  char *sql; // SQL with its literals replaced by parameters
+  sqlite3_stmt *statement;
+  unsigned long last_used;
+  int in_use; // by a command, which resets it when done
+} param_cache_entry;
+
 // Define struct to hold state across calls
 typedef struct sqlite3_drv_t {
   ErlDrvPort port;
   unsigned int key;
   struct sqlite3 *db;
   char* db_name;
+  unsigned long command_count; // last command id, see the probes above
   FILE *log;
   int debug;
   sqlite3_stmt **prepared_stmts;
   unsigned int prepared_count;
   unsigned int prepared_alloc;
+  // WAL archiving, used on the async thread (see wal_archive_async) and
+  // freed by close_connection, which stop() runs on the emulator thread
+  // when the port goes away without CMD_CLOSE
+  char *wal_archive_dir;
+  int wal_archive_pages;
+  int wal_snapshot_every;
+  unsigned int wal_archive_seq;
+  int wal_segments_since_snapshot;
+  // Ring of the last trace_size commands, trace_count of them recorded so
+  // far. Only used from the emulator thread holding the port lock (control
+  // and ready_async), so it needs no synchronization.
+  trace_entry *trace;
+  unsigned int trace_size;
+  unsigned long trace_count;
+  int trace_dump_on_error;
+  // Statistics of up to stats_size normalized statements, chained from
+  // stats_buckets. Updated on the async thread and read by control, so
+  // guarded by stats_mutex. The hash of the last prepared statement
+  // recorded is kept to avoid normalizing its SQL on every step, and the
+  // time of unfinished executions per prepared statement in stats_pending.
+  ErlDrvMutex *stats_mutex;
+  stats_entry *stats;
+  int *stats_buckets;
+  unsigned int stats_size;
+  unsigned int stats_count;
+  sqlite3_stmt *stats_cached_statement;
+  unsigned int stats_cached_hash;
+  stats_pending *stats_pending;
+  // Statements of sql_exec with literals bound as parameters, up to
+  // param_cache_size of them, evicting the least recently used
+  param_cache_entry *param_cache;
+  unsigned int param_cache_size;
+  unsigned int param_cache_count;
+  unsigned long param_cache_clock;
+  // Retry commands getting SQLITE_BUSY for up to busy_retry_ms after a
+  // driver timer instead of blocking the async thread, busy_command is
+  // the one waiting for the timer
+  int busy_retry_ms;
+  struct async_sqlite3_command *busy_command;
+  // Named queries of sqlite3:register_queries/2 by index, prepared once
+  // and kept when the connection is recycled
+  sqlite3_stmt **queries;
+  unsigned int query_count;
+  // Admission control: statements whose plan scans a table with more
+  // than admission_max_scan_rows rows (by sqlite_stat1) or sorts in a
+  // temporary b-tree are rejected before they run, see admission_check
+  sqlite3_int64 admission_max_scan_rows;
+  int admission_no_temp_btree;
+  // Bumped by ready_async after commands that change the schema or the
+  // statistics; query_admitted[i] is the epoch named query i was last
+  // admitted at, 0 if never (see query)
+  unsigned int admission_epoch;
+  unsigned int *query_admitted;
+  // Set by the authorizer for such statements prepared by control, and
+  // carried by the next command queued like prepared_changed_tables
+  int prepared_plans_changed;
+  // Tables of the main database whose inserted, updated and deleted rows
+  // are reported by the pre-update hook before the reply of the command
+  // which changed them, see changes_hook
+  char *cache_tables[CACHE_MAX_TABLES];
+  int cache_table_count;
+  // The command running on the async thread (running_thread), which the
+  // hooks called by it add to, see hook_command
+  struct async_sqlite3_command *running_command;
+  ErlDrvTid running_thread;
+  // Cache tables dropped or altered by statements prepared by control,
+  // reported with the next command queued (see authorizer)
+  unsigned int prepared_changed_tables;
+  // Commands queued or running on the async thread (counted until their
+  // ready_async), optimize only runs when there are none
+  int commands_queued;
+  // Maintenance: PRAGMA optimize is due once optimize_every rows have
+  // changed since optimize_changes (the sqlite3_total_changes() it last
+  // ran at) and queued when the connection is idle, see optimize_async;
+  // it's run at close with optimize_on_close
+  int optimize_every;
+  int optimize_changes;
+  int optimize_due;
+  int optimize_pending;
+  int optimize_on_close;
+  int analysis_limit;
+  // Set once CMD_CLOSE has been queued, later commands are refused
+  int closing;
+  int checkpoint_on_close;
+  // Settings of the connection after opening it, which recycle restores
+  char recycle_pragmas[RECYCLE_PRAGMAS_SIZE];
+  char journal_mode[16];
+  // Opened with -immutable: the file never changes, so the connection is
+  // query_only, memory mapped and has an async thread key of its own
+  int immutable;
+  sqlite3_int64 mmap_size;
+  // Opened with -memvfs: the database lives in the memory VFS (see
+  // sqlite3_memvfs.h) without a journal
+  int memvfs;
+  int page_size;
   ErlDrvTermData atom_blob;
   ErlDrvTermData atom_error;
   ErlDrvTermData atom_columns;
@@ -81,13 +318,32 @@ typedef struct sqlite3_drv_t {
   ErlDrvTermData atom_true;
   ErlDrvTermData atom_false;
   ErlDrvTermData atom_unknown_cmd;
+  ErlDrvTermData atom_exec;
+  ErlDrvTermData atom_script;
+  ErlDrvTermData atom_step;
+  ErlDrvTermData atom_batch;
+  ErlDrvTermData atom_wal_archive;
+  ErlDrvTermData atom_close;
+  ErlDrvTermData atom_recycle;
+  ErlDrvTermData atom_query_rejected;
+  ErlDrvTermData atom_changed;
+  ErlDrvTermData atom_shared;
+  ErlDrvTermData atom_unshared;
 } sqlite3_drv_t;
 
-typedef enum async_sqlite3_command_type {t_stmt, t_script} async_sqlite3_command_type;
+typedef enum async_sqlite3_command_type {
+  t_stmt, t_script, t_batch, t_wal_archive, t_close, t_recycle, t_optimize
+} async_sqlite3_command_type;
 
 typedef struct async_sqlite3_command {
   sqlite3_drv_t *driver_data;
   async_sqlite3_command_type type;
+  unsigned long id;
+  void (*invoke)(void *async_command);
+  // set when tracing: see timed_async
+  ErlDrvSInt64 enqueued_at;
+  ErlDrvSInt64 started_at;
+  ErlDrvSInt64 finished_at;
   union {
     sqlite3_stmt *statement;
     struct {
@@ -95,6 +351,15 @@ typedef struct async_sqlite3_command {
       char *end;
     };
   };
+  // t_batch, t_wal_archive: copy of the encoded command term and offset
+  // of the part left to decode on the async thread
+  char *batch;
+  int batch_size;
+  int batch_index;
+  // t_batch of an upsert: count inserted, updated and unchanged rows
+  int count_upserts;
+  // dbstat rows (pages) stepped through by one command
+  int slice_pages;
   ErlDrvTermData *dataset;
   int term_count;
   int term_allocated;
@@ -102,7 +367,26 @@ typedef struct async_sqlite3_command {
   ptr_list *ptrs;
   ptr_list *binaries;
   int finalize_statement_on_free;
+  int reset_statement_on_free; // for cached statements, instead
+  param_cache_entry *param_cache_entry; // marked not in use when freed
+  // set on the async thread when the command has to be run again
+  int busy_retry;
+  int busy_delay_ms;
+  ErlDrvSInt64 busy_deadline;
   int error_code;
+  // rows of cache tables changed by the command and a bit for every
+  // cache table changed as a whole (too many rows or a rollback)
+  changed_row *changed;
+  int changed_count;
+  int changed_allocated;
+  unsigned int changed_tables;
+  // the command changed the schema or the statistics, see admission_epoch
+  int plans_changed;
+  // set on the async thread when PRAGMA optimize is due after the command
+  int optimize_due;
+  // CMD_SHARED_QUERY: the reply is {shared, Result}, or {unshared, Result}
+  // if the database changed while the statement ran
+  int shared;
 } async_sqlite3_command;
 
 
@@ -111,7 +395,7 @@ static void stop(ErlDrvData handle);
 static ErlDrvSSizeT control(ErlDrvData drv_data, unsigned int command, char *buf,
                             ErlDrvSizeT len, char **rbuf, ErlDrvSizeT rlen);
 static int sql_exec(sqlite3_drv_t *drv, char *buf, int len);
-static int sql_bind_and_exec(sqlite3_drv_t *drv, char *buf, int len);
+static int sql_bind_and_exec(sqlite3_drv_t *drv, char *buf, int len, int shared);
 static int sql_exec_script(sqlite3_drv_t *drv, char *buf, int len);
 static int prepare(sqlite3_drv_t *drv, char *buf, int len);
 static int prepared_bind(sqlite3_drv_t *drv, char *buf, int len);
@@ -120,14 +404,41 @@ static int prepared_reset(sqlite3_drv_t *drv, char *buf, int len);
 static int prepared_clear_bindings(sqlite3_drv_t *drv, char *buf, int len);
 static int prepared_finalize(sqlite3_drv_t *drv, char *buf, int len);
 static int prepared_columns(sqlite3_drv_t *drv, char *buf, int len);
+static int prepared_batch(sqlite3_drv_t *drv, char *buf, int len, int count_upserts);
+static int prepared_scan_status(sqlite3_drv_t *drv, char *buf, int len);
+static int prepared_dbstat(sqlite3_drv_t *drv, char *buf, int len);
 static void sql_exec_async(void *async_command);
+static void sql_batch_async(void *async_command);
+static void sql_dbstat_async(void *async_command);
 static void sql_free_async(void *async_command);
+static void changes_hook(void *drv, sqlite3 *db, int op, const char *db_name,
+                         const char *table, sqlite3_int64 old_rowid, sqlite3_int64 new_rowid);
+static int authorizer(void *drv, int action, const char *arg1, const char *arg2,
+                      const char *db_name, const char *trigger);
+static void rollback_hook(void *drv);
+static void optimize_async(void *async_command);
 static void ready_async(ErlDrvData drv_data, ErlDrvThreadData thread_data);
+static void busy_timeout(ErlDrvData drv_data);
 static int unknown(sqlite3_drv_t *bdb_drv, char *buf, int len);
 static int enable_load_extension(sqlite3_drv_t *drv, char *buf, int len);
 static int changes(sqlite3_drv_t *drv, char *buf, int len);
 static int filename(sqlite3_drv_t *drv, char *buf, int len);
 static int table_exists(sqlite3_drv_t *drv, char *buf, int len);
+static int wal_archive(sqlite3_drv_t *drv, char *buf, int len);
+static int trace(sqlite3_drv_t *drv, char *buf, int len);
+static int statement_stats(sqlite3_drv_t *drv, char *buf, int len);
+static ErlDrvSInt64 stats_take_pending(sqlite3_drv_t *drv, sqlite3_stmt *statement);
+static int close_db(sqlite3_drv_t *drv, char *buf, int len);
+static void close_async(void *async_command);
+static int close_connection(sqlite3_drv_t *drv);
+static int recycle(sqlite3_drv_t *drv, char *buf, int len);
+static void save_settings(sqlite3_drv_t *drv, sqlite3 *db);
+static void recycle_async(void *async_command);
+static int register_queries(sqlite3_drv_t *drv, char *buf, int len);
+static int query(sqlite3_drv_t *drv, char *buf, int len);
+static void wal_archive_async(void *async_command);
+static int wal_archive_segment(sqlite3_drv_t *drv);
+static int wal_archive_hook(void *data, sqlite3 *db, const char *db_name, int pages);
 
 #if defined(_MSC_VER)
 #pragma warning(default: 4201)
@@ -0,0 +1,261 @@
+#include "sqlite3_memvfs.h"
+#include <erl_driver.h>
+#include <sqlite3.h>
+#include <string.h>
+
+// Files are kept in chunks of this many bytes, a multiple of every page size
+#define MEMVFS_CHUNK_SIZE 65536
+
+typedef struct memvfs_file {
+  sqlite3_file base;
+  // the arena of the file: chunk_count chunks, freed together by xClose
+  unsigned char **chunks;
+  int chunk_count;
+  int chunk_alloc;
+  sqlite3_int64 size;
+} memvfs_file;
+
+// The default VFS, for everything but files
+#define DEFAULT_VFS(vfs) ((sqlite3_vfs *) (vfs)->pAppData)
+
+static int memvfs_close(sqlite3_file *file) {
+  memvfs_file *f = (memvfs_file *) file;
+  int i;
+
+  for (i = 0; i < f->chunk_count; i++)
+    driver_free(f->chunks[i]);
+  if (f->chunks)
+    driver_free(f->chunks);
+  f->chunks = NULL;
+  f->chunk_count = f->chunk_alloc = 0;
+  f->size = 0;
+  return SQLITE_OK;
+}
+
+static int memvfs_read(sqlite3_file *file, void *buffer, int amount, sqlite3_int64 offset) {
+  memvfs_file *f = (memvfs_file *) file;
+  unsigned char *out = (unsigned char *) buffer;
+  int available, n;
+
+  available = offset >= f->size ? 0 :
+    (f->size - offset < amount ? (int) (f->size - offset) : amount);
+  while (available > 0) {
+    int in_chunk = (int) (offset % MEMVFS_CHUNK_SIZE);
+    n = MEMVFS_CHUNK_SIZE - in_chunk < available ? MEMVFS_CHUNK_SIZE - in_chunk : available;
+    memcpy(out, f->chunks[offset / MEMVFS_CHUNK_SIZE] + in_chunk, n);
+    out += n;
+    offset += n;
+    amount -= n;
+    available -= n;
+  }
+  if (amount > 0) {
+    // SQLite expects the rest of a short read to be zeroed
+    memset(out, 0, amount);
+    return SQLITE_IOERR_SHORT_READ;
+  }
+  return SQLITE_OK;
+}
+
+// Makes sure the chunks up to end exist, new ones are zeroed
+static int memvfs_grow(memvfs_file *f, sqlite3_int64 end) {
+  int needed = (int) ((end + MEMVFS_CHUNK_SIZE - 1) / MEMVFS_CHUNK_SIZE);
+
+  if (needed > f->chunk_alloc) {
+    int alloc = f->chunk_alloc ? f->chunk_alloc : 4;
+    unsigned char **chunks;
+    while (alloc < needed)
+      alloc *= 2;
+    chunks = driver_realloc(f->chunks, sizeof(unsigned char *) * alloc);
+    if (!chunks)
+      return SQLITE_IOERR_NOMEM;
+    f->chunks = chunks;
+    f->chunk_alloc = alloc;
+  }
+  while (f->chunk_count < needed) {
+    unsigned char *chunk = driver_alloc(MEMVFS_CHUNK_SIZE);
+    if (!chunk)
+      return SQLITE_IOERR_NOMEM;
+    memset(chunk, 0, MEMVFS_CHUNK_SIZE);
+    f->chunks[f->chunk_count++] = chunk;
+  }
+  return SQLITE_OK;
+}
+
+static int memvfs_write(sqlite3_file *file, const void *buffer, int amount,
+                        sqlite3_int64 offset) {
+  memvfs_file *f = (memvfs_file *) file;
+  const unsigned char *in = (const unsigned char *) buffer;
+  int result = memvfs_grow(f, offset + amount);
+
+  if (result != SQLITE_OK)
+    return result;
+  if (offset + amount > f->size)
+    f->size = offset + amount;
+  while (amount > 0) {
+    int in_chunk = (int) (offset % MEMVFS_CHUNK_SIZE);
+    int n = MEMVFS_CHUNK_SIZE - in_chunk < amount ? MEMVFS_CHUNK_SIZE - in_chunk : amount;
+    memcpy(f->chunks[offset / MEMVFS_CHUNK_SIZE] + in_chunk, in, n);
+    in += n;
+    offset += n;
+    amount -= n;
+  }
+  return SQLITE_OK;
+}
+
+// Frees the chunks past size and zeroes the end of the last one, so the
+// file reads as zeroes there if it grows again
+static int memvfs_truncate(sqlite3_file *file, sqlite3_int64 size) {
+  memvfs_file *f = (memvfs_file *) file;
+  int keep = (int) ((size + MEMVFS_CHUNK_SIZE - 1) / MEMVFS_CHUNK_SIZE);
+
+  if (size >= f->size)
+    return SQLITE_OK;
+  while (f->chunk_count > keep)
+    driver_free(f->chunks[--f->chunk_count]);
+  if (size % MEMVFS_CHUNK_SIZE)
+    memset(f->chunks[keep - 1] + size % MEMVFS_CHUNK_SIZE, 0,
+           MEMVFS_CHUNK_SIZE - size % MEMVFS_CHUNK_SIZE);
+  f->size = size;
+  return SQLITE_OK;
+}
+
+static int memvfs_sync(sqlite3_file *file, int flags) {
+  return SQLITE_OK;
+}
+
+static int memvfs_file_size(sqlite3_file *file, sqlite3_int64 *size) {
+  *size = ((memvfs_file *) file)->size;
+  return SQLITE_OK;
+}
+
+// Files are private to the connection which opened them
+static int memvfs_lock(sqlite3_file *file, int lock) {
+  return SQLITE_OK;
+}
+
+static int memvfs_check_reserved_lock(sqlite3_file *file, int *reserved) {
+  *reserved = 0;
+  return SQLITE_OK;
+}
+
+static int memvfs_file_control(sqlite3_file *file, int op, void *arg) {
+  return SQLITE_NOTFOUND;
+}
+
+static int memvfs_sector_size(sqlite3_file *file) {
+  return 512;
+}
+
+static int memvfs_device_characteristics(sqlite3_file *file) {
+  return SQLITE_IOCAP_ATOMIC | SQLITE_IOCAP_SAFE_APPEND | SQLITE_IOCAP_SEQUENTIAL |
+    SQLITE_IOCAP_POWERSAFE_OVERWRITE;
+}
+
+static const sqlite3_io_methods memvfs_io_methods = {
+  1,
+  memvfs_close,
+  memvfs_read,
+  memvfs_write,
+  memvfs_truncate,
+  memvfs_sync,
+  memvfs_file_size,
+  memvfs_lock,
+  memvfs_lock,
+  memvfs_check_reserved_lock,
+  memvfs_file_control,
+  memvfs_sector_size,
+  memvfs_device_characteristics,
+  NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+static int memvfs_open(sqlite3_vfs *vfs, const char *name, sqlite3_file *file,
+                       int flags, int *out_flags) {
+  memvfs_file *f = (memvfs_file *) file;
+
+  memset(f, 0, sizeof(memvfs_file));
+  f->base.pMethods = &memvfs_io_methods;
+  if (out_flags)
+    *out_flags = flags;
+  return SQLITE_OK;
+}
+
+static int memvfs_delete(sqlite3_vfs *vfs, const char *name, int sync_dir) {
+  return SQLITE_OK;
+}
+
+// Nothing outlives the file handle, so no file ever exists before it's opened
+static int memvfs_access(sqlite3_vfs *vfs, const char *name, int flags, int *result) {
+  *result = 0;
+  return SQLITE_OK;
+}
+
+static int memvfs_full_pathname(sqlite3_vfs *vfs, const char *name, int size, char *out) {
+  sqlite3_snprintf(size, out, "%s", name);
+  return SQLITE_OK;
+}
+
+static void *memvfs_dl_open(sqlite3_vfs *vfs, const char *path) {
+  return DEFAULT_VFS(vfs)->xDlOpen(DEFAULT_VFS(vfs), path);
+}
+
+static void memvfs_dl_error(sqlite3_vfs *vfs, int size, char *message) {
+  DEFAULT_VFS(vfs)->xDlError(DEFAULT_VFS(vfs), size, message);
+}
+
+static void (*memvfs_dl_sym(sqlite3_vfs *vfs, void *handle, const char *symbol))(void) {
+  return DEFAULT_VFS(vfs)->xDlSym(DEFAULT_VFS(vfs), handle, symbol);
+}
+
+static void memvfs_dl_close(sqlite3_vfs *vfs, void *handle) {
+  DEFAULT_VFS(vfs)->xDlClose(DEFAULT_VFS(vfs), handle);
+}
+
+static int memvfs_randomness(sqlite3_vfs *vfs, int size, char *out) {
+  return DEFAULT_VFS(vfs)->xRandomness(DEFAULT_VFS(vfs), size, out);
+}
+
+static int memvfs_sleep(sqlite3_vfs *vfs, int microseconds) {
+  return DEFAULT_VFS(vfs)->xSleep(DEFAULT_VFS(vfs), microseconds);
+}
+
+static int memvfs_current_time(sqlite3_vfs *vfs, double *now) {
+  return DEFAULT_VFS(vfs)->xCurrentTime(DEFAULT_VFS(vfs), now);
+}
+
+static int memvfs_get_last_error(sqlite3_vfs *vfs, int size, char *message) {
+  return DEFAULT_VFS(vfs)->xGetLastError(DEFAULT_VFS(vfs), size, message);
+}
+
+static sqlite3_vfs memvfs = {
+  1,
+  sizeof(memvfs_file),
+  1024,
+  NULL,
+  MEMVFS_NAME,
+  NULL, // the default VFS, set by memvfs_register
+  memvfs_open,
+  memvfs_delete,
+  memvfs_access,
+  memvfs_full_pathname,
+  memvfs_dl_open,
+  memvfs_dl_error,
+  memvfs_dl_sym,
+  memvfs_dl_close,
+  memvfs_randomness,
+  memvfs_sleep,
+  memvfs_current_time,
+  memvfs_get_last_error,
+  NULL, NULL, NULL, NULL
+};
+
+int memvfs_register(void) {
+  sqlite3_vfs *default_vfs;
+
+  if (sqlite3_vfs_find(MEMVFS_NAME))
+    return SQLITE_OK;
+  default_vfs = sqlite3_vfs_find(NULL);
+  if (!default_vfs)
+    return SQLITE_ERROR;
+  memvfs.pAppData = default_vfs;
+  return sqlite3_vfs_register(&memvfs, 0);
+}
@@ -0,0 +1,16 @@
+#ifndef SQLITE3_MEMVFS_H
+#define SQLITE3_MEMVFS_H
+
+// Name of the VFS registered by memvfs_register
+#define MEMVFS_NAME "erlang-memory"
+
+// Registers a VFS keeping every file it opens in memory allocated with
+// driver_alloc, for private scratch databases: each open creates a new
+// empty file, nothing is ever shared or written to disk and closing a
+// file frees all its memory at once. Files grow in 64 KiB chunks.
+// Databases on it should run with journal_mode=OFF, there is nothing to
+// recover after a crash anyway.
+// Registering again is harmless. Returns an SQLite result code.
+int memvfs_register(void);
+
+#endif
@@ -11,18 +11,21 @@
 -module(sqlite3).
 -include("sqlite3.hrl").
 -export_types([sql_value/0, sql_type/0, table_info/0, sqlite_error/0,
-               sql_params/0, sql_non_query_result/0, sql_result/0]).
+               sql_params/0, sql_non_query_result/0, sql_result/0, cache/0]).
 
 -behaviour(gen_server).
 
 %% API
 -export([open/1, open/2]).
 -export([start_link/1, start_link/2]).
--export([stop/0, close/1, close_timeout/2]).
+-export([stop/0, close/1, close_timeout/2, recycle/1]).
 -export([enable_load_extension/2]).
+-export([register_queries/2, q/2, q/3, exec_compiled/3]).
+-export([cache/1, cached_read/3, cache_stats/1]).
 -export([sql_exec/1, sql_exec/2, sql_exec_timeout/3,
          sql_exec_script/2, sql_exec_script_timeout/3,
          sql_exec/3, sql_exec_timeout/4]).
+-export([shared_query/3]).
 -export([prepare/2, bind/3, next/2, reset/2, clear_bindings/2, finalize/2,
          columns/2, prepare_timeout/3, bind_timeout/4, next_timeout/3,
          reset_timeout/3, clear_bindings_timeout/3, finalize_timeout/3,
@@ -43,6 +46,17 @@
 -export([vacuum/0, vacuum/1, vacuum_timeout/2]).
 -export([changes/1, changes/2]).
 -export([filename/1]).
+-export([create_fts_table/3, create_fts_table/4, fts_bulk_insert/3, fts_bulk_insert/4,
+         fts_bulk_insert_timeout/5, search/4]).
+-export([bulk_insert/3, bulk_insert/4, bulk_insert_timeout/5]).
+-export([upsert_many/4, upsert_many/5, upsert_many_timeout/6]).
+-export([create_rtree_table/4, create_rtree_table/5, rtree_bbox/3, rtree_nearest/4]).
+-export([archive_wal/1]).
+-export([trace/1, trace_on_error/2]).
+-export([statement_stats/1, reset_statement_stats/1]).
+-export([scan_status/2, profile/2, profile/3]).
+-export([storage_stats/1, storage_stats/2]).
+-export([request_metrics/1, subscribe_metrics/2, unsubscribe_metrics/2]).
 
 %% -export([create_function/3]).
 
@@ -53,7 +67,33 @@
          terminate/2, code_change/3]).
 
 -define('DRIVER_NAME', 'sqlite3_drv').
--record(state, {port, ops = [], refs = dict:new()}).
+-define(WAL_ARCHIVE_OPTIONS, [wal_archive, wal_archive_pages, wal_snapshot_every]).
+-define(TRACE_FIELDS, [id, kind, sql_hash, sql, queued_at, wait_us, exec_us, reply_us,
+                       rows, error_code]).
+-define(STATEMENT_STATS_FIELDS, [sql, calls, total_us, min_us, max_us, rows, changes,
+                                 fullscan_steps, sorts, autoindexes, vm_steps]).
+-define(SCAN_STATUS_FIELDS, [select_id, name, explain, loops, rows_visited, rows_estimated,
+                             cycles]).
+%% pages of the database file read by one driver command of storage_stats/2
+-define(STORAGE_SLICE_PAGES, 1000).
+%% bytes (by erlang:external_size/1) of the results of shared_query/3
+%% kept by an immutable connection
+-define(RESULT_CACHE_BYTES, 16777216).
+%% FTS5 merge settings changed by fts_bulk_insert/4, with the values
+%% FTS5 uses when they haven't been set
+-define(FTS_MERGE_DEFAULTS, [{automerge, 4}, {crisismerge, 16}]).
+%% CACHE_MAX_TABLES in sqlite3_drv.h
+-define(CACHE_MAX_TABLES, 32).
+-record(state, {port, ops = [], refs = dict:new(), metrics, queries = dict:new(), cache,
+                results}).
+%% the row cache of a connection opened with {cache, Tables}: its ETS
+%% table and the tuple of Tables, which the driver reports changes by
+%% the index of
+-record(cache, {db, ets, tables}).
+%% the results of shared_query/3 kept by an immutable connection: its ETS
+%% table of {{SQL, Params}, Result, Bytes}, the keys in insertion order
+%% (the oldest is evicted first) and the total of their Bytes
+-record(results, {ets, order = queue:new(), bytes = 0}).
 
 %%====================================================================
 %% API
@@ -65,7 +105,15 @@
 %% @end
 %%--------------------------------------------------------------------
 -type option() :: {file, string()} | temporary | in_memory | debug |
-                  open_db_option().
+                  {trace_size, non_neg_integer()} | {stats_size, non_neg_integer()} | instrument |
+                  {auto_parameterize, non_neg_integer()} | {busy_retry, non_neg_integer()} |
+                  {checkpoint_on_close, boolean()} | {queries, [{atom(), iodata()}]} |
+                  {admission, [{max_scan_rows, pos_integer()} | no_temp_btree]} |
+                  {cache, [table_id()]} | immutable | {mmap_size, non_neg_integer()} |
+                  memory_vfs | {page_size, pos_integer()} |
+                  {optimize, [on_close | {every, pos_integer()} | {analysis_limit, pos_integer()}]} |
+                  {wal_archive, file:filename()} | {wal_archive_pages, pos_integer()} |
+                  {wal_snapshot_every, pos_integer()} | open_db_option().
 
 %% See flags or sqlite3_open_v2()
 %% https://www.sqlite.org/c3ref/open.html
@@ -92,6 +140,8 @@
 
 -type result() :: {'ok', pid()} | 'ignore' | {'error', any()}.
 -type db() :: atom() | pid().
+-type upsert_counts() :: [{inserted | updated | unchanged, non_neg_integer()}].
+-opaque cache() :: #cache{}.
 
 -spec start_link(atom()) -> result().
 start_link(DbName) ->
@@ -144,6 +194,94 @@ open(DbName) ->
 %%     <dt>temporary</dt><dd>Create temp database without a filename</dd>
 %%     <dt>shared_cache</dt><dd>Enabled shared cache (see
 %%          https://www.sqlite.org/c3ref/enable_shared_cache.html)</dd>
+%%     <dt>{trace_size, N}</dt><dd>Number of recent commands kept for
+%%          trace/1 (default 32, 0 disables tracing)</dd>
+%%     <dt>{stats_size, N}</dt><dd>Number of distinct statements with
+%%          statistics kept for statement_stats/1 (default 256, 0 disables
+%%          them)</dd>
+%%     <dt>instrument</dt><dd>Time every request, see request_metrics/1</dd>
+%%     <dt>{auto_parameterize, N}</dt><dd>Run the SELECT, INSERT, UPDATE,
+%%          DELETE, REPLACE and WITH statements of sql_exec (and the
+%%          functions built on it) as cached prepared statements: literals
+%%          outside result columns, ORDER BY and GROUP BY are replaced by
+%%          parameters and bound, so statements differing only in values
+%%          share one of up to N cached statements (default 0, disabled)</dd>
+%%     <dt>{busy_retry, Ms}</dt><dd>Run a statement outside an explicit
+%%          transaction again when the database is locked by another
+%%          connection, with pauses doubling from 1 to 64 ms, for up to Ms
+%%          milliseconds before returning the SQLITE_BUSY error (default 0,
+%%          disabled). The connection waits for a timer between attempts,
+%%          so other connections can keep using the async threads.</dd>
+%%     <dt>immutable</dt><dd>Open a database file which is never
+%%          modified (by anyone) for the fastest reads: read-only, as a
+%%          URI with `immutable=1&amp;nolock=1', so SQLite neither locks
+%%          it nor checks whether it changed, with `PRAGMA query_only',
+%%          memory mapped (256 MiB unless `mmap_size' says otherwise) and
+%%          on an async thread of its own instead of the one of the file,
+%%          so connections to it read in parallel. The results of
+%%          shared_query/3 are kept, up to 16 MiB of them as measured by
+%%          `erlang:external_size/1', evicting the oldest first.</dd>
+%%     <dt>{mmap_size, Bytes}</dt><dd>Set `PRAGMA mmap_size'</dd>
+%%     <dt>memory_vfs</dt><dd>Keep the database in memory allocated by
+%%          the driver (so it shows up in `erlang:memory/0') for a scratch
+%%          database which is created, loaded, queried and dropped within
+%%          a request: the file name is only a label, every open starts
+%%          with an empty database of its own, there is no journal
+%%          (`journal_mode' is `off', so `ROLLBACK' can't undo changes)
+%%          and closing the connection frees all of it at once. Its page
+%%          cache is kept at 64 KiB, since the pages are in memory
+%%          already. Databases attached with `ATTACH' go through the
+%%          memory VFS as well, so they start empty whatever file they
+%%          name, and what is written to them is lost at close.</dd>
+%%     <dt>{page_size, Bytes}</dt><dd>Set `PRAGMA page_size' when
+%%          opening, which only matters for a new database</dd>
+%%     <dt>{checkpoint_on_close, Bool}</dt><dd>Whether closing the last
+%%          connection to a WAL database checkpoints the WAL into the
+%%          database (default true)</dd>
+%%     <dt>{admission, Rules}</dt><dd>Reject statements of sql_exec,
+%%          sql_exec/3, prepare and q/3 by their query plan before they read
+%%          anything, with `{error, query_rejected, Reason}': Rules are
+%%          `{max_scan_rows, N}' for a full scan of a table ANALYZE found
+%%          more than N rows in and `no_temp_btree' for sorting, grouping
+%%          or DISTINCT in a temporary b-tree. Meant for interactive
+%%          connections, the caller can run rejected statements on another
+%%          one. Scripts aren't checked. The verdict on a query of
+%%          register_queries/2 is kept until this connection changes the
+%%          schema or runs ANALYZE (also by `PRAGMA optimize'); statistics
+%%          other connections write are seen after that.</dd>
+%%     <dt>{cache, Tables}</dt><dd>Keep rows of Tables (at most 32, with
+%%          rowids) read by cached_read/3 in an ETS table other processes
+%%          read without calling the connection. The driver reports the
+%%          rows the connection inserts, updates or deletes in them before
+%%          the reply to the change, and their entries are removed, all
+%%          of them when the table is dropped or altered. Changes made by
+%%          other connections aren't seen.</dd>
+%%     <dt>{optimize, Policy}</dt><dd>Keep the statistics of the query
+%%          planner fresh with `PRAGMA optimize', which runs ANALYZE on
+%%          the tables that need it: `on_close' runs it when the
+%%          connection is closed and `{every, N}' on the async thread
+%%          once N rows have changed since the last run, as soon as the
+%%          connection has no commands queued, outside transactions.
+%%          Commands sent while it runs wait for it, and so do the ones
+%%          of every other connection to the same file (a pool's as well):
+%%          they share its async thread, and only this connection's queue
+%%          is looked at before starting it. `{analysis_limit, N}'
+%%          makes ANALYZE look at about N rows of each index; it requires
+%%          SQLite 3.32 or later and is ignored by older versions,
+%%          including the bundled one.</dd>
+%%     <dt>{queries, [{Name, SQL}]}</dt><dd>Named queries to prepare at
+%%          open, see register_queries/2. Opening fails if one of them
+%%          doesn't compile.</dd>
+%%     <dt>{wal_archive, Dir::string()}</dt><dd>Switch the database to WAL mode
+%%          and copy the WAL to the archive directory Dir before every
+%%          checkpoint, see sqlite3_archive for restoring. This connection
+%%          has to be the only one checkpointing the database: WAL frames
+%%          checkpointed by another connection (or its automatic
+%%          checkpoints) are missing from the archive</dd>
+%%     <dt>{wal_archive_pages, N}</dt><dd>Archive and checkpoint the WAL once it
+%%          has N pages (default 1000, the SQLite autocheckpoint default)</dd>
+%%     <dt>{wal_snapshot_every, N}</dt><dd>Write a base snapshot of the database
+%%          to the archive after every N WAL segments (default 100)</dd>
 %%   </dl>
 %% @end
 %%--------------------------------------------------------------------
@@ -180,7 +318,7 @@ open(DbName, Options) ->
 %%--------------------------------------------------------------------
 -spec close(db()) -> 'ok'.
 close(Db) ->
-    catch gen_server:call(Db, close),
+    catch call(Db, close),
     ok.
 
 %%--------------------------------------------------------------------
@@ -190,9 +328,26 @@ close(Db) ->
 %%--------------------------------------------------------------------
 -spec close_timeout(db(), timeout()) -> 'ok'.
 close_timeout(Db, Timeout) ->
-    catch gen_server:call(Db, close, Timeout),
+    catch call(Db, close, Timeout),
     ok.
 
+%%--------------------------------------------------------------------
+%% @doc
+%%   Prepares Db for reuse by another user: finalizes its prepared
+%%   statements, rolls back an open transaction, detaches attached
+%%   databases, drops TEMP tables, views and triggers and restores the
+%%   `foreign_keys', `defer_foreign_keys', `recursive_triggers',
+%%   `query_only', `busy_timeout', `synchronous', `cache_size',
+%%   `temp_store' and `journal_mode' settings to their values after
+%%   opening (but not a change of `journal_mode' to or from WAL, which is
+%%   a setting of the file). It keeps the loaded schema and the
+%%   auto-parameterized statements. See sqlite3_pool.
+%% @end
+%%--------------------------------------------------------------------
+-spec recycle(db()) -> ok | sqlite_error().
+recycle(Db) ->
+    call(Db, recycle).
+
 %%--------------------------------------------------------------------
 %% @doc
 %%   Closes the sqlite3 database.
@@ -203,7 +358,7 @@ stop() ->
     close(?MODULE).
 
 enable_load_extension(Db, Value) ->
-    gen_server:call(Db, {enable_load_extension, Value}).
+    call(Db, {enable_load_extension, Value}).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -212,10 +367,10 @@ enable_load_extension(Db, Value) ->
 %%--------------------------------------------------------------------
 
 changes(Db) ->
-    gen_server:call(Db, changes).
+    call(Db, changes).
 
 changes(Db, Timeout) ->
-    gen_server:call(Db, changes, Timeout).
+    call(Db, changes, Timeout).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -224,7 +379,91 @@ changes(Db, Timeout) ->
 %%--------------------------------------------------------------------
 
 filename(Db) ->
-    gen_server:call(Db, filename).
+    call(Db, filename).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Prepares the single-statement SQL of each {Name, SQL} once, to be run
+%%   by name with q/3 for as long as Db is open, replacing queries already
+%%   registered with the same names. Nothing is registered unless all of
+%%   them compile.
+%% @end
+%%--------------------------------------------------------------------
+-spec register_queries(db(), [{atom(), iodata()}]) -> ok | sqlite_error().
+register_queries(Db, Queries) ->
+    call(Db, {register_queries, [query_entry(Query) || Query <- Queries]}).
+
+-spec q(db(), atom()) -> sql_result().
+q(Db, Name) ->
+    q(Db, Name, []).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Runs the query registered as Name with parameters Params, as
+%%   sql_exec/3 would run its SQL, but without sending, parsing or
+%%   preparing SQL. Returns `{error, badarg}' for unknown names.
+%% @end
+%%--------------------------------------------------------------------
+-spec q(db(), atom(), [sql_value() | {atom() | string() | integer(), sql_value()}]) ->
+       sql_result().
+q(Db, Name, Params) ->
+    call(Db, {q, Name, Params}).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Runs a query compiled by sqlite3_query_pt like sql_exec/3: Prefix is
+%%   term_to_binary({SQL, []}) without its last byte, to which the driver
+%%   gets the encoded Params appended.
+%% @end
+%% @hidden
+%%--------------------------------------------------------------------
+-spec exec_compiled(db(), binary(), [sql_value()]) -> sql_result().
+exec_compiled(Db, Prefix, Params) ->
+    <<131, EncodedParams/binary>> = term_to_binary(Params),
+    call(Db, {sql_bind_and_exec_encoded, [Prefix | EncodedParams]}).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Returns the row cache of Db, opened with the `cache' option, for
+%%   cached_read/3 and cache_stats/1.
+%% @end
+%%--------------------------------------------------------------------
+-spec cache(db()) -> {ok, cache()} | {error, no_cache}.
+cache(Db) ->
+    call(Db, cache).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Reads the row of Tbl (one of the tables of the `cache' option) with
+%%   the given rowid (the INTEGER PRIMARY KEY column if there is one) from
+%%   the cache without a call to the connection, which reads it and
+%%   keeps it in the cache if it isn't there. Returns the result of
+%%   `SELECT * FROM Tbl WHERE rowid = Rowid'.
+%% @end
+%%--------------------------------------------------------------------
+-spec cached_read(cache(), table_id(), integer()) -> sql_result().
+cached_read(#cache{db = Db, ets = Ets}, Tbl, Rowid) ->
+    case ets:lookup(Ets, {Tbl, Rowid}) of
+        [{_, Result}] ->
+            ets:update_counter(Ets, hits, 1),
+            Result;
+        [] ->
+            ets:update_counter(Ets, misses, 1),
+            call(Db, {cached_read, Tbl, Rowid})
+    end.
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Returns the hits and misses of cached_read/3 so far, their hit rate
+%%   and the number of cached rows.
+%% @end
+%%--------------------------------------------------------------------
+-spec cache_stats(cache()) -> [{hits | misses | size, non_neg_integer()} | {hit_rate, float()}].
+cache_stats(#cache{ets = Ets}) ->
+    [{hits, Hits}] = ets:lookup(Ets, hits),
+    [{misses, Misses}] = ets:lookup(Ets, misses),
+    [{hits, Hits}, {misses, Misses}, {hit_rate, Hits / max(Hits + Misses, 1)},
+     {size, ets:info(Ets, size) - 2}].
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -243,7 +482,7 @@ sql_exec(SQL) ->
 %%--------------------------------------------------------------------
 -spec sql_exec(db(), iodata()) -> sql_result().
 sql_exec(Db, SQL) ->
-    gen_server:call(Db, {sql_exec, SQL}).
+    call(Db, {sql_exec, SQL}).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -254,7 +493,7 @@ sql_exec(Db, SQL) ->
 -spec sql_exec(db(), iodata(), [sql_value() | {atom() | string() | integer(), sql_value()}]) ->
        sql_result().
 sql_exec(Db, SQL, Params) ->
-    gen_server:call(Db, {sql_bind_and_exec, SQL, Params}).
+    call(Db, {sql_bind_and_exec, SQL, Params}).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -264,7 +503,7 @@ sql_exec(Db, SQL, Params) ->
 %%--------------------------------------------------------------------
 -spec sql_exec_timeout(db(), iodata(), timeout()) -> sql_result().
 sql_exec_timeout(Db, SQL, Timeout) ->
-    gen_server:call(Db, {sql_exec, SQL}, Timeout).
+    call(Db, {sql_exec, SQL}, Timeout).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -275,7 +514,26 @@ sql_exec_timeout(Db, SQL, Timeout) ->
 -spec sql_exec_timeout(db(), iodata(), [sql_value() | {atom() | string() | integer(), sql_value()}], timeout()) ->
        sql_result().
 sql_exec_timeout(Db, SQL, Params, Timeout) ->
-    gen_server:call(Db, {sql_bind_and_exec, SQL, Params}, Timeout).
+    call(Db, {sql_bind_and_exec, SQL, Params}, Timeout).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Runs the read-only query SQL with Params like sql_exec/3, but the
+%%   callers asking Db for the same SQL and Params while it runs get its
+%%   result too instead of running it again, so many processes asking for
+%%   the same expensive report at once cause one execution. The result is
+%%   shared as one binary and decoded by each caller. It isn't shared if
+%%   another connection committed (`PRAGMA data_version' changed) while
+%%   the query ran. Statements which may write are rejected with
+%%   SQLITE_READONLY without running.
+%% @end
+%%--------------------------------------------------------------------
+-spec shared_query(db(), iodata(), sql_params()) -> sql_result().
+shared_query(Db, SQL, Params) ->
+    case call(Db, {shared_query, iolist_to_binary(SQL), Params}) of
+        {shared, Result} -> binary_to_term(Result);
+        Error            -> Error
+    end.
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -289,7 +547,7 @@ sql_exec_timeout(Db, SQL, Params, Timeout) ->
 %%--------------------------------------------------------------------
 -spec sql_exec_script(db(), iodata()) -> [sql_result()].
 sql_exec_script(Db, SQL) ->
-    gen_server:call(Db, {sql_exec_script, SQL}).
+    call(Db, {sql_exec_script, SQL}).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -300,7 +558,7 @@ sql_exec_script(Db, SQL) ->
 -spec describe_table(db(), atom()) ->
   [{column_id(), Type::string(), NotNull::boolean(), term(), PrivKey::boolean()}].
 describe_table(Db, Table) when is_atom(Table) ->
-    case gen_server:call(Db, {describe_table, Table}) of
+    case call(Db, {describe_table, Table}) of
       ok -> not_found;
       [_, {rows, Rows}] ->
         ToBool = fun(1) -> true; (0) -> false end,
@@ -320,63 +578,63 @@ describe_table(Db, Table) when is_atom(Table) ->
 %%--------------------------------------------------------------------
 -spec sql_exec_script_timeout(db(), iodata(), timeout()) -> [sql_result()].
 sql_exec_script_timeout(Db, SQL, Timeout) ->
-    gen_server:call(Db, {sql_exec_script, SQL}, Timeout).
+    call(Db, {sql_exec_script, SQL}, Timeout).
 
 -spec prepare(db(), iodata()) -> {ok, reference()} | sqlite_error().
 prepare(Db, SQL) ->
-    gen_server:call(Db, {prepare, SQL}).
+    call(Db, {prepare, SQL}).
 
 -spec bind(db(), reference(), sql_params()) -> sql_non_query_result().
 bind(Db, Ref, Params) ->
-    gen_server:call(Db, {bind, Ref, Params}).
+    call(Db, {bind, Ref, Params}).
 
 -spec next(db(), reference()) -> tuple() | done | sqlite_error().
 next(Db, Ref) ->
-    gen_server:call(Db, {next, Ref}).
+    call(Db, {next, Ref}).
 
 -spec reset(db(), reference()) -> sql_non_query_result().
 reset(Db, Ref) ->
-    gen_server:call(Db, {reset, Ref}).
+    call(Db, {reset, Ref}).
 
 -spec clear_bindings(db(), reference()) -> sql_non_query_result().
 clear_bindings(Db, Ref) ->
-    gen_server:call(Db, {clear_bindings, Ref}).
+    call(Db, {clear_bindings, Ref}).
 
 -spec finalize(db(), reference()) -> sql_non_query_result().
 finalize(Db, Ref) ->
-    gen_server:call(Db, {finalize, Ref}).
+    call(Db, {finalize, Ref}).
 
 -spec columns(db(), reference()) -> sql_non_query_result().
 columns(Db, Ref) ->
-    gen_server:call(Db, {columns, Ref}).
+    call(Db, {columns, Ref}).
 
 -spec prepare_timeout(db(), iodata(), timeout()) -> {ok, reference()} | sqlite_error().
 prepare_timeout(Db, SQL, Timeout) ->
-    gen_server:call(Db, {prepare, SQL}, Timeout).
+    call(Db, {prepare, SQL}, Timeout).
 
 -spec bind_timeout(db(), reference(), sql_params(), timeout()) -> sql_non_query_result().
 bind_timeout(Db, Ref, Params, Timeout) ->
-    gen_server:call(Db, {bind, Ref, Params}, Timeout).
+    call(Db, {bind, Ref, Params}, Timeout).
 
 -spec next_timeout(db(), reference(), timeout()) -> tuple() | done | sqlite_error().
 next_timeout(Db, Ref, Timeout) ->
-    gen_server:call(Db, {next, Ref}, Timeout).
+    call(Db, {next, Ref}, Timeout).
 
 -spec reset_timeout(db(), reference(), timeout()) -> sql_non_query_result().
 reset_timeout(Db, Ref, Timeout) ->
-    gen_server:call(Db, {reset, Ref}, Timeout).
+    call(Db, {reset, Ref}, Timeout).
 
 -spec clear_bindings_timeout(db(), reference(), timeout()) -> sql_non_query_result().
 clear_bindings_timeout(Db, Ref, Timeout) ->
-    gen_server:call(Db, {clear_bindings, Ref}, Timeout).
+    call(Db, {clear_bindings, Ref}, Timeout).
 
 -spec finalize_timeout(db(), reference(), timeout()) -> sql_non_query_result().
 finalize_timeout(Db, Ref, Timeout) ->
-    gen_server:call(Db, {finalize, Ref}, Timeout).
+    call(Db, {finalize, Ref}, Timeout).
 
 -spec columns_timeout(db(), reference(), timeout()) -> sql_non_query_result().
 columns_timeout(Db, Ref, Timeout) ->
-    gen_server:call(Db, {columns, Ref}, Timeout).
+    call(Db, {columns, Ref}, Timeout).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -402,7 +660,7 @@ create_table(Tbl, Columns) ->
 %%--------------------------------------------------------------------
 -spec create_table(db(), table_id(), table_info()) -> sql_non_query_result().
 create_table(Db, Tbl, Columns) ->
-    gen_server:call(Db, {create_table, Tbl, Columns}).
+    call(Db, {create_table, Tbl, Columns}).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -415,7 +673,7 @@ create_table(Db, Tbl, Columns) ->
 %%--------------------------------------------------------------------
 -spec create_table_timeout(db(), table_id(), table_info(), timeout()) -> sql_non_query_result().
 create_table_timeout(Db, Tbl, Columns, Timeout) ->
-    gen_server:call(Db, {create_table, Tbl, Columns}, Timeout).
+    call(Db, {create_table, Tbl, Columns}, Timeout).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -430,7 +688,7 @@ create_table_timeout(Db, Tbl, Columns, Timeout) ->
 -spec create_table(db(), table_id(), table_info(), table_constraints()) ->
           sql_non_query_result().
 create_table(Db, Tbl, Columns, Constraints) ->
-    gen_server:call(Db, {create_table, Tbl, Columns, Constraints}).
+    call(Db, {create_table, Tbl, Columns, Constraints}).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -445,7 +703,7 @@ create_table(Db, Tbl, Columns, Constraints) ->
 -spec create_table_timeout(db(), table_id(), table_info(), table_constraints(), timeout()) ->
           sql_non_query_result().
 create_table_timeout(Db, Tbl, Columns, Constraints, Timeout) ->
-    gen_server:call(Db, {create_table, Tbl, Columns, Constraints}, Timeout).
+    call(Db, {create_table, Tbl, Columns, Constraints}, Timeout).
 
 
 %%--------------------------------------------------------------------
@@ -472,7 +730,7 @@ add_columns(Tbl, Columns) ->
 %%--------------------------------------------------------------------
 -spec add_columns(db(), table_id(), table_info()) -> sql_non_query_result().
 add_columns(Db, Tbl, Columns) ->
-    gen_server:call(Db, {add_columns, Tbl, Columns}).
+    call(Db, {add_columns, Tbl, Columns}).
 
 
 %%--------------------------------------------------------------------
@@ -491,7 +749,7 @@ list_tables() ->
 %%--------------------------------------------------------------------
 -spec list_tables(db()) -> [table_id()].
 list_tables(Db) ->
-    gen_server:call(Db, list_tables).
+    call(Db, list_tables).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -500,7 +758,7 @@ list_tables(Db) ->
 %%--------------------------------------------------------------------
 -spec list_tables_timeout(db(), timeout()) -> [table_id()].
 list_tables_timeout(Db, Timeout) ->
-    gen_server:call(Db, list_tables, Timeout).
+    call(Db, list_tables, Timeout).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -524,7 +782,7 @@ table_exists(Db, Tbl) when is_atom(Db), is_list(Tbl) ->
 
 -spec table_exists(db(), table_id(), timeout()) -> boolean().
 table_exists(Db, Tbl, Timeout) when is_atom(Db), is_list(Tbl) ->
-    gen_server:call(Db, {table_exists, Tbl}, Timeout).
+    call(Db, {table_exists, Tbl}, Timeout).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -542,7 +800,7 @@ table_info(Tbl) ->
 %%--------------------------------------------------------------------
 -spec table_info(db(), table_id()) -> table_info().
 table_info(Db, Tbl) ->
-    gen_server:call(Db, {table_info, Tbl}).
+    call(Db, {table_info, Tbl}).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -551,7 +809,7 @@ table_info(Db, Tbl) ->
 %%--------------------------------------------------------------------
 -spec table_info_timeout(db(), table_id(), timeout()) -> table_info().
 table_info_timeout(Db, Tbl, Timeout) ->
-    gen_server:call(Db, {table_info, Tbl}, Timeout).
+    call(Db, {table_info, Tbl}, Timeout).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -574,7 +832,7 @@ write(Tbl, KVs) ->
 %%--------------------------------------------------------------------
 -spec write(db(), table_id(), [{column_id(), sql_value()}]) -> sql_non_query_result().
 write(Db, Tbl, Data) ->
-    gen_server:call(Db, {write, Tbl, Data}).
+    call(Db, {write, Tbl, Data}).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -585,7 +843,7 @@ write(Db, Tbl, Data) ->
 -spec write_timeout(db(), table_id(), [{column_id(), sql_value()}], timeout()) ->
           sql_non_query_result().
 write_timeout(Db, Tbl, Data, Timeout) ->
-    gen_server:call(Db, {write, Tbl, Data}, Timeout).
+    call(Db, {write, Tbl, Data}, Timeout).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -605,7 +863,7 @@ write_many(Tbl, Data) ->
 %%--------------------------------------------------------------------
 -spec write_many(db(), table_id(), [[{column_id(), sql_value()}]]) -> [sql_result()].
 write_many(Db, Tbl, Data) ->
-    gen_server:call(Db, {write_many, Tbl, Data}).
+    call(Db, {write_many, Tbl, Data}).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -616,7 +874,7 @@ write_many(Db, Tbl, Data) ->
 -spec write_many_timeout(db(), table_id(), [[{column_id(), sql_value()}]], timeout()) ->
           [sql_result()].
 write_many_timeout(Db, Tbl, Data, Timeout) ->
-    gen_server:call(Db, {write_many, Tbl, Data}, Timeout).
+    call(Db, {write_many, Tbl, Data}, Timeout).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -645,7 +903,7 @@ update(Db, Tbl, {_Key, _Value}=KV, Data) ->
     update(Db, Tbl, [KV], Data);
 update(Db, Tbl, [KV|_]=KVs, Data) when is_tuple(KV) andalso
                                        (tuple_size(KV)==2 orelse tuple_size(KV)==3) ->
-    gen_server:call(Db, {update, Tbl, KVs, Data}).
+    call(Db, {update, Tbl, KVs, Data}).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -661,7 +919,7 @@ update_timeout(Db, Tbl, {Key, Value}, Data, Timeout) ->
 update_timeout(Db, Tbl, [KV|_]=KVs, Data, Timeout)
     when is_tuple(KV) andalso
         (tuple_size(KV)==2 orelse tuple_size(KV)==3) ->
-    gen_server:call(Db, {update, Tbl, KVs, Data}, Timeout).
+    call(Db, {update, Tbl, KVs, Data}, Timeout).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -670,7 +928,7 @@ update_timeout(Db, Tbl, [KV|_]=KVs, Data, Timeout)
 %%--------------------------------------------------------------------
 -spec read_all(db(), table_id()) -> sql_result().
 read_all(Db, Tbl) ->
-    gen_server:call(Db, {read, Tbl}).
+    call(Db, {read, Tbl}).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -679,7 +937,7 @@ read_all(Db, Tbl) ->
 %%--------------------------------------------------------------------
 -spec read_all_timeout(db(), table_id(), timeout()) -> sql_result().
 read_all_timeout(Db, Tbl, Timeout) ->
-    gen_server:call(Db, {read, Tbl}, Timeout).
+    call(Db, {read, Tbl}, Timeout).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -688,9 +946,9 @@ read_all_timeout(Db, Tbl, Timeout) ->
 %%--------------------------------------------------------------------
 -spec read_all(db(), table_id(), [column_id()]) -> sql_result().
 read_all(Db, Tbl, all) ->
-    gen_server:call(Db, {read, Tbl, all});
+    call(Db, {read, Tbl, all});
 read_all(Db, Tbl, [C|_] = Columns) when is_atom(C); is_list(C); is_binary(C) ->
-    gen_server:call(Db, {read, Tbl, Columns}).
+    call(Db, {read, Tbl, Columns}).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -699,7 +957,7 @@ read_all(Db, Tbl, [C|_] = Columns) when is_atom(C); is_list(C); is_binary(C) ->
 %%--------------------------------------------------------------------
 -spec read_all_timeout(db(), table_id(), all|[column_id()], timeout()) -> sql_result().
 read_all_timeout(Db, Tbl, Columns, Timeout) ->
-    gen_server:call(Db, {read, Tbl, Columns}, Timeout).
+    call(Db, {read, Tbl, Columns}, Timeout).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -735,7 +993,7 @@ read(Db, Tbl, KV) when is_tuple(KV) andalso
     read(Db, Tbl, [KV]);
 read(Db, Tbl, [KV|_]=CV) when is_tuple(KV) andalso
                               (tuple_size(KV)==2 orelse tuple_size(KV)==3) ->
-    gen_server:call(Db, {read, Tbl, CV, all}).
+    call(Db, {read, Tbl, CV, all}).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -754,7 +1012,7 @@ read(Db, Tbl, KV, Columns) when is_tuple(KV) andalso
     read(Db, Tbl, [KV], Columns);
 read(Db, Tbl, [KV|_]=CV, Columns) when is_tuple(KV) andalso
                                        (tuple_size(KV)==2 orelse tuple_size(KV)==3) ->
-    gen_server:call(Db, {read, Tbl, CV, Columns}).
+    call(Db, {read, Tbl, CV, Columns}).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -769,10 +1027,10 @@ read(Db, Tbl, [KV|_]=CV, Columns) when is_tuple(KV) andalso
                                     timeout()) ->
         sql_result().
 read_timeout(Db, Tbl, {_Column, _Value}=KV, Timeout) ->
-    gen_server:call(Db, {read, Tbl, [KV]}, Timeout);
+    call(Db, {read, Tbl, [KV]}, Timeout);
 read_timeout(Db, Tbl, [KV|_]=CV, Timeout) when is_tuple(KV) andalso
                                                (tuple_size(KV)==2 orelse tuple_size(KV)==3) ->
-    gen_server:call(Db, {read, Tbl, CV}, Timeout).
+    call(Db, {read, Tbl, CV}, Timeout).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -787,10 +1045,10 @@ read_timeout(Db, Tbl, [KV|_]=CV, Timeout) when is_tuple(KV) andalso
                                     all|[column_id()], timeout()) ->
         sql_result().
 read_timeout(Db, Tbl, {_Col, _Value}=CV, Columns, Timeout) ->
-    gen_server:call(Db, {read, Tbl, [CV], Columns}, Timeout);
+    call(Db, {read, Tbl, [CV], Columns}, Timeout);
 read_timeout(Db, Tbl, [KV|_]=CV, Columns, Timeout) when is_tuple(KV)
                                                       , (tuple_size(KV)==2 orelse tuple_size(KV)==3) ->
-    gen_server:call(Db, {read, Tbl, CV, Columns}, Timeout).
+    call(Db, {read, Tbl, CV, Columns}, Timeout).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -815,7 +1073,7 @@ delete(Tbl, Key) ->
                                       [{column_id(), sql_value()}],
                      timeout()) -> sql_non_query_result().
 delete_timeout(Db, Tbl, Key, Timeout) ->
-    gen_server:call(Db, {delete, Tbl, Key}, Timeout).
+    call(Db, {delete, Tbl, Key}, Timeout).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -829,7 +1087,7 @@ delete_timeout(Db, Tbl, Key, Timeout) ->
 delete(Db, Tbl, {_Key, _Value}=KV) ->
     delete(Db, Tbl, [KV]);
 delete(Db, Tbl, [{_,_}|_] = Key) ->
-    gen_server:call(Db, {delete, Tbl, Key}).
+    call(Db, {delete, Tbl, Key}).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -847,7 +1105,7 @@ drop_table(Tbl) ->
 %%--------------------------------------------------------------------
 -spec drop_table(db(), table_id()) -> sql_non_query_result().
 drop_table(Db, Tbl) ->
-    gen_server:call(Db, {drop_table, Tbl}).
+    call(Db, {drop_table, Tbl}).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -856,7 +1114,7 @@ drop_table(Db, Tbl) ->
 %%--------------------------------------------------------------------
 -spec drop_table_timeout(db(), table_id(), timeout()) -> sql_non_query_result().
 drop_table_timeout(Db, Tbl, Timeout) ->
-    gen_server:call(Db, {drop_table, Tbl}, Timeout).
+    call(Db, {drop_table, Tbl}, Timeout).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -865,7 +1123,7 @@ drop_table_timeout(Db, Tbl, Timeout) ->
 %%--------------------------------------------------------------------
 -spec vacuum() -> sql_non_query_result().
 vacuum() ->
-    gen_server:call(?MODULE, vacuum).
+    call(?MODULE, vacuum).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -874,7 +1132,7 @@ vacuum() ->
 %%--------------------------------------------------------------------
 -spec vacuum(db()) -> sql_non_query_result().
 vacuum(Db) ->
-    gen_server:call(Db, vacuum).
+    call(Db, vacuum).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -883,7 +1141,372 @@ vacuum(Db) ->
 %%--------------------------------------------------------------------
 -spec vacuum_timeout(db(), timeout()) -> sql_non_query_result().
 vacuum_timeout(Db, Timeout) ->
-    gen_server:call(Db, vacuum, Timeout).
+    call(Db, vacuum, Timeout).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Bulk loads Rows into Tbl. See bulk_insert/4.
+%% @end
+%%--------------------------------------------------------------------
+-spec bulk_insert(db(), table_id(), [[{column_id(), sql_value()}]]) ->
+          {ok, non_neg_integer()} | sqlite_error().
+bulk_insert(Db, Tbl, Rows) ->
+    bulk_insert(Db, Tbl, Rows, []).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Bulk loads Rows (which must all have the columns of the first row)
+%%   into Tbl using a prepared insert executed by the driver in batches
+%%   of `{batch_size, N}' rows (default 10000), one transaction per
+%%   batch. Returns the number of rows inserted.
+%% @end
+%%--------------------------------------------------------------------
+-spec bulk_insert(db(), table_id(), [[{column_id(), sql_value()}]], [term()]) ->
+          {ok, non_neg_integer()} | sqlite_error().
+bulk_insert(Db, Tbl, Rows, Options) ->
+    call(Db, {bulk_insert, Tbl, Rows, Options}).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Bulk loads Rows into Tbl. See bulk_insert/4.
+%% @end
+%%--------------------------------------------------------------------
+-spec bulk_insert_timeout(db(), table_id(), [[{column_id(), sql_value()}]], [term()],
+                          timeout()) -> {ok, non_neg_integer()} | sqlite_error().
+bulk_insert_timeout(Db, Tbl, Rows, Options, Timeout) ->
+    call(Db, {bulk_insert, Tbl, Rows, Options}, Timeout).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Inserts or updates Rows of Tbl by KeyCols. See upsert_many/5.
+%% @end
+%%--------------------------------------------------------------------
+-spec upsert_many(db(), table_id(), [column_id()], [[{column_id(), sql_value()}]]) ->
+          {ok, upsert_counts()} | sqlite_error().
+upsert_many(Db, Tbl, KeyCols, Rows) ->
+    upsert_many(Db, Tbl, KeyCols, Rows, []).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Inserts Rows (which must all have the columns of the first row,
+%%   KeyCols among them) into Tbl, updating the record with the same
+%%   KeyCols instead where there is one, which KeyCols must be the
+%%   primary key or a unique index of. The rows are sent to the driver
+%%   in batches of `{batch_size, N}' rows (default 10000) executing one
+%%   prepared `INSERT ... ON CONFLICT DO UPDATE', all in one transaction.
+%%   Returns how many rows were inserted, how many updated and how many
+%%   were left unchanged because all their values were the same already.
+%%   Inserts are told apart by the rowid they get, so a `WITHOUT ROWID'
+%%   table is refused with `{error, {without_rowid, Tbl}}'.
+%% @end
+%%--------------------------------------------------------------------
+-spec upsert_many(db(), table_id(), [column_id()], [[{column_id(), sql_value()}]], [term()]) ->
+          {ok, upsert_counts()} | sqlite_error().
+upsert_many(Db, Tbl, KeyCols, Rows, Options) ->
+    call(Db, {upsert_many, Tbl, KeyCols, Rows, Options}).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Inserts or updates Rows of Tbl by KeyCols. See upsert_many/5.
+%% @end
+%%--------------------------------------------------------------------
+-spec upsert_many_timeout(db(), table_id(), [column_id()], [[{column_id(), sql_value()}]],
+                          [term()], timeout()) -> {ok, upsert_counts()} | sqlite_error().
+upsert_many_timeout(Db, Tbl, KeyCols, Rows, Options, Timeout) ->
+    call(Db, {upsert_many, Tbl, KeyCols, Rows, Options}, Timeout).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Creates the R*Tree spatial index Tbl in Db with the integer key
+%%   IdCol and the `{MinCol, MaxCol}' coordinate columns Dims (1 to 5
+%%   dimensions). Entries are loaded with bulk_insert/4.
+%% @end
+%%--------------------------------------------------------------------
+-spec create_rtree_table(db(), table_id(), column_id(), [rtree_dim()]) ->
+          sql_non_query_result().
+create_rtree_table(Db, Tbl, IdCol, Dims) ->
+    create_rtree_table(Db, Tbl, IdCol, Dims, []).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Creates the R*Tree spatial index Tbl in Db. Options are `int32'
+%%   for integer coordinates and `{aux, Columns}' for extra columns
+%%   stored with every entry.
+%% @end
+%%--------------------------------------------------------------------
+-spec create_rtree_table(db(), table_id(), column_id(), [rtree_dim()], [rtree_option()]) ->
+          sql_non_query_result().
+create_rtree_table(Db, Tbl, IdCol, Dims, Options) ->
+    call(Db, {create_rtree_table, Tbl, IdCol, Dims, Options}).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Returns the entries of the R*Tree Tbl overlapping the bounding
+%%   box given as `{MinCol, MaxCol, Low, High}' for every dimension.
+%% @end
+%%--------------------------------------------------------------------
+-spec rtree_bbox(db(), table_id(), [{column_id(), column_id(), number(), number()}]) ->
+          sql_result().
+rtree_bbox(Db, Tbl, Box) ->
+    call(Db, {rtree_bbox, Tbl, Box}).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Returns the entries of the R*Tree Tbl nearest to the point given
+%%   as `{MinCol, MaxCol, Coordinate}' for every dimension, ordered by
+%%   the distance of their centers with the squared distance as the
+%%   last `distance_sq' column. The search box starts at `{radius, R}'
+%%   (default 1.0) around the point and doubles until `{limit, N}'
+%%   (default 10) entries are found or `{max_radius, M}' (default
+%%   1.0e6) is reached.
+%% @end
+%%--------------------------------------------------------------------
+-spec rtree_nearest(db(), table_id(), [{column_id(), column_id(), number()}], [term()]) ->
+          sql_result().
+rtree_nearest(Db, Tbl, Point, Options) ->
+    call(Db, {rtree_nearest, Tbl, Point, Options}).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Creates the FTS5 full-text index Tbl in Db with the given Columns.
+%% @end
+%%--------------------------------------------------------------------
+-spec create_fts_table(db(), table_id(), [fts_column()]) -> sql_non_query_result().
+create_fts_table(Db, Tbl, Columns) ->
+    create_fts_table(Db, Tbl, Columns, []).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Creates the FTS5 full-text index Tbl in Db with the given Columns
+%%   and table Options (`{tokenize, Tokenizer}', `{prefix, Lengths}',
+%%   `{content, Table}', `{content_rowid, Column}', `{detail, Detail}').
+%% @end
+%%--------------------------------------------------------------------
+-spec create_fts_table(db(), table_id(), [fts_column()], [fts_option()]) ->
+          sql_non_query_result().
+create_fts_table(Db, Tbl, Columns, Options) ->
+    call(Db, {create_fts_table, Tbl, Columns, Options}).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Bulk loads Rows into the FTS5 table Tbl. See fts_bulk_insert/4.
+%% @end
+%%--------------------------------------------------------------------
+-spec fts_bulk_insert(db(), table_id(), [[{column_id(), sql_value()}]]) ->
+          {ok, non_neg_integer()} | sqlite_error().
+fts_bulk_insert(Db, Tbl, Rows) ->
+    fts_bulk_insert(Db, Tbl, Rows, []).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Bulk loads Rows (which must all have the columns of the first row)
+%%   into the FTS5 table Tbl using a prepared insert executed by the
+%%   driver in batches, one transaction per batch. The index merge
+%%   settings are tuned for bulk loading beforehand and restored to their
+%%   previous values afterwards (also when loading fails).
+%%
+%%   Options:
+%%   <dl>
+%%     <dt>{batch_size, N}</dt><dd>Rows per transaction (default 10000)</dd>
+%%     <dt>{automerge, N}</dt><dd>FTS5 `automerge' setting (default 8)</dd>
+%%     <dt>{crisismerge, N}</dt><dd>FTS5 `crisismerge' setting (default 64)</dd>
+%%     <dt>optimize</dt><dd>Merge the index into a single b-tree after loading</dd>
+%%   </dl>
+%%
+%%   Returns the number of rows inserted.
+%% @end
+%%--------------------------------------------------------------------
+-spec fts_bulk_insert(db(), table_id(), [[{column_id(), sql_value()}]], [term()]) ->
+          {ok, non_neg_integer()} | sqlite_error().
+fts_bulk_insert(Db, Tbl, Rows, Options) ->
+    call(Db, {fts_bulk_insert, Tbl, Rows, Options}).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Bulk loads Rows into the FTS5 table Tbl. See fts_bulk_insert/4.
+%% @end
+%%--------------------------------------------------------------------
+-spec fts_bulk_insert_timeout(db(), table_id(), [[{column_id(), sql_value()}]], [term()],
+                              timeout()) -> {ok, non_neg_integer()} | sqlite_error().
+fts_bulk_insert_timeout(Db, Tbl, Rows, Options, Timeout) ->
+    call(Db, {fts_bulk_insert, Tbl, Rows, Options}, Timeout).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Searches the FTS5 table Tbl for rows matching Query (in FTS5 query
+%%   syntax). Rows are returned best match first with `rowid' as the
+%%   first column and `rank' (bm25) and `snippet' as the last ones.
+%%   Besides `{limit, N}' (default 10) and `{offset, N}' (default 0),
+%%   see sqlite3_lib:fts_search_sql/2 for the Options.
+%% @end
+%%--------------------------------------------------------------------
+-spec search(db(), table_id(), iodata(), [term()]) -> sql_result().
+search(Db, Tbl, Query, Options) ->
+    call(Db, {search, Tbl, Query, Options}).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Copies the WAL of Db (opened with the `wal_archive' option) to the
+%%   archive right away and checkpoints it, e.g. before taking the
+%%   archive off-site.
+%% @end
+%%--------------------------------------------------------------------
+-spec archive_wal(db()) -> ok | sqlite_error().
+archive_wal(Db) ->
+    call(Db, archive_wal).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Returns the most recent commands run by the driver for Db, oldest
+%%   first: the command id, its kind (`exec', `script', `step', `batch',
+%%   `wal_archive', `close' or `recycle'), a hash and the beginning of its SQL, the
+%%   monotonic time in microseconds it was queued at, the microseconds
+%%   it waited for the async thread, ran and waited for its reply to be
+%%   sent, the number of rows and the error code (0 on success).
+%% @end
+%%--------------------------------------------------------------------
+-spec trace(db()) -> [[{atom(), term()}]] | sqlite_error().
+trace(Db) ->
+    call(Db, trace).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Sets whether the recent commands of Db (see trace/1) are written to
+%%   the driver log or standard error when a command fails.
+%% @end
+%%--------------------------------------------------------------------
+-spec trace_on_error(db(), boolean()) -> ok | sqlite_error().
+trace_on_error(Db, Enable) ->
+    call(Db, {trace_on_error, Enable}).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Returns the statistics the driver aggregated for Db per statement
+%%   since it was opened or reset_statement_stats/1 was called, most
+%%   expensive first. Statements are grouped by their SQL with literals
+%%   replaced by `?' and for each the number of executions, their total,
+%%   minimum, maximum and mean time in microseconds, the rows returned
+%%   and changed and the `sqlite3_stmt_status' counters of full scan
+%%   steps, sorts, automatic indexes and VM steps are given. When the
+%%   table is full the statement with the fewest executions is dropped.
+%% @end
+%%--------------------------------------------------------------------
+-spec statement_stats(db()) -> [[{atom(), term()}]] | sqlite_error().
+statement_stats(Db) ->
+    call(Db, statement_stats).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Forgets the statement statistics of Db, see statement_stats/1.
+%% @end
+%%--------------------------------------------------------------------
+-spec reset_statement_stats(db()) -> ok | sqlite_error().
+reset_statement_stats(Db) ->
+    call(Db, reset_statement_stats).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Returns what every loop in the query plan of the prepared statement
+%%   Ref did since it was prepared or scan_status/2 was last called for
+%%   it: the id of its SELECT, the table or index scanned, the EXPLAIN
+%%   QUERY PLAN line, how many times the loop ran, the rows it visited,
+%%   the rows the planner estimated per run and the CPU cycles spent
+%%   (only reported by SQLite 3.42 and newer, 0 otherwise). The driver
+%%   has to be built with SQLITE_ENABLE_STMT_SCANSTATUS.
+%% @end
+%%--------------------------------------------------------------------
+-spec scan_status(db(), reference()) -> [[{atom(), term()}]] | sqlite_error().
+scan_status(Db, Ref) ->
+    call(Db, {scan_status, Ref}).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Runs SQL on Db and returns its result with the scan status of its
+%%   loops, see profile/3.
+%% @end
+%%--------------------------------------------------------------------
+-spec profile(db(), iodata()) -> {sql_result(), [[{atom(), term()}]]} | sqlite_error().
+profile(Db, SQL) ->
+    profile(Db, SQL, []).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Runs the single statement SQL with parameters Params on Db and
+%%   returns its result together with what every loop of its query plan
+%%   did, as scan_status/2 does for prepared statements.
+%% @end
+%%--------------------------------------------------------------------
+-spec profile(db(), iodata(), sql_params()) ->
+          {sql_result(), [[{atom(), term()}]]} | sqlite_error().
+profile(Db, SQL, Params) ->
+    call(Db, {profile, SQL, Params}, infinity).
+
+-spec storage_stats(db()) -> {ok, [{string(), [{atom(), number()}]}]} | sqlite_error().
+storage_stats(Db) ->
+    storage_stats(Db, []).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Returns the space every table and index of the main database takes,
+%%   largest first, from the dbstat virtual table (the driver has to be
+%%   built with SQLITE_ENABLE_DBSTAT_VTAB): its pages of each kind, the
+%%   cells on its leaf pages (rows of a table), its payload and unused
+%%   bytes and its fragmentation, the fraction of its pages not directly
+%%   following the previous one. Free pages are left to
+%%   `PRAGMA freelist_count'.
+%%
+%%   The pages are read on the driver's async thread in slices of
+%%   `{slice_pages, N}' (default 1000) pages, each a request of its own,
+%%   so requests of other processes run in between on large files. Writes
+%%   made by them meanwhile may or may not be counted. The scan is one
+%%   read transaction from the first slice to the last: until it ends,
+%%   other connections can't commit to a rollback journal database and
+%%   checkpoints of a WAL database can't get past it. The statement is
+%%   only finalized by the calling process, if it is killed during the
+%%   scan, the transaction stays open until Db is closed.
+%% @end
+%%--------------------------------------------------------------------
+-spec storage_stats(db(), [{slice_pages, pos_integer()}]) ->
+          {ok, [{string(), [{atom(), number()}]}]} | sqlite_error().
+storage_stats(Db, Options) ->
+    SlicePages = proplists:get_value(slice_pages, Options, ?STORAGE_SLICE_PAGES),
+    case prepare(Db, "SELECT name, pageno, pagetype, ncell, payload, unused FROM dbstat;") of
+        {ok, Ref} ->
+            try
+                storage_slices(Db, Ref, SlicePages, [])
+            after
+                finalize(Db, Ref)
+            end;
+        Error ->
+            Error
+    end.
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Returns the latency metrics of the requests Db got, if it was opened
+%%   with the `instrument' option: for every request name the number of
+%%   requests, the total microseconds they waited in the mailbox and took
+%%   to handle, the longest mailbox seen and histograms of both times.
+%%   See sqlite3_metrics.
+%% @end
+%%--------------------------------------------------------------------
+-spec request_metrics(db()) -> [{atom(), [{atom(), term()}]}] | {error, not_instrumented}.
+request_metrics(Db) ->
+    call(Db, request_metrics).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Makes Db, opened with the `instrument' option, send Pid a message
+%%   for every request it handles, see sqlite3_metrics.
+%% @end
+%%--------------------------------------------------------------------
+-spec subscribe_metrics(db(), pid()) -> ok | {error, not_instrumented}.
+subscribe_metrics(Db, Pid) ->
+    call(Db, {subscribe_metrics, Pid}).
+
+-spec unsubscribe_metrics(db(), pid()) -> ok | {error, not_instrumented}.
+unsubscribe_metrics(Db, Pid) ->
+    call(Db, {unsubscribe_metrics, Pid}).
 
 %% %%--------------------------------------------------------------------
 %% %% @doc
@@ -893,7 +1516,7 @@ vacuum_timeout(Db, Timeout) ->
 %% %%--------------------------------------------------------------------
 %% -spec create_function(db(), atom(), function()) -> any().
 %% create_function(Db, FunctionName, Function) ->
-%%     gen_server:call(Db, {create_function, FunctionName, Function}).
+%%     call(Db, {create_function, FunctionName, Function}).
 
 %%--------------------------------------------------------------------
 %% @doc
@@ -940,12 +1563,9 @@ value_to_sql(X) -> sqlite3_lib:value_to_sql(X).
 
 -spec init([any()]) -> {'ok', #state{}} | {'stop', string()}.
 init(Options) ->
-    PrivDir = get_priv_dir(),
-    Driver  = driver_name(),
-    case erl_ddll:load(PrivDir, Driver) of
+    Driver = driver_name(),
+    case load_driver(Driver) of
         ok ->
-            do_init(Driver, Options);
-        {error, permanent} -> %% already loaded!
             try
                 do_init(Driver, Options)
             catch throw:Reason ->
@@ -957,6 +1577,21 @@ init(Options) ->
             {stop, lists:flatten(Msg)}
     end.
 
+%% The driver locks itself in memory when it starts its first port, so
+%% only the first connection on the node loads it and none unloads it
+load_driver(Driver) ->
+    {ok, Loaded} = erl_ddll:loaded_drivers(),
+    case lists:member(Driver, Loaded) of
+        true ->
+            ok;
+        false ->
+            case erl_ddll:load(get_priv_dir(), Driver) of
+                ok                 -> ok;
+                {error, permanent} -> ok; %% already loaded!
+                Error              -> Error
+            end
+    end.
+
 -spec do_init(string(), [any()]) -> {'ok', #state{}} | {'stop', string()}.
 do_init(DriverName, Options) ->
     {DbFile, Opts} =
@@ -964,16 +1599,135 @@ do_init(DriverName, Options) ->
             {value, {file, F}, Rest} -> {F,  Rest};
             false                    -> {"", Options}
         end,
-    Port = open_port({spawn, create_port_cmd(DriverName, DbFile, Opts)}, [binary]),
+    {ArchiveOpts, OpenOpts} =
+        lists:partition(fun({K, _}) -> lists:member(K, ?WAL_ARCHIVE_OPTIONS);
+                           (_)      -> false
+                        end, Opts),
+    Metrics = case lists:member(instrument, OpenOpts) of
+                  true  -> sqlite3_metrics:new();
+                  false -> undefined
+              end,
+    Queries = [query_entry(Query) || Query <- proplists:get_value(queries, OpenOpts, [])],
+    PortOpts = [Opt || Opt <- proplists:delete(queries, OpenOpts), Opt =/= instrument],
+    Immutable = lists:member(immutable, OpenOpts),
+    PortCmd = case Immutable of
+                  true  -> create_port_cmd(DriverName, immutable_uri(DbFile),
+                                           [readonly, uri | PortOpts]);
+                  false -> create_port_cmd(DriverName, DbFile, PortOpts)
+              end,
+    Port = open_port({spawn, PortCmd}, [binary]),
     receive
         {Port, ok} ->
-            {ok, #state{port = Port, ops = Options}};
+            Cache = new_cache(proplists:get_value(cache, OpenOpts, [])),
+            Results = case Immutable of
+                          true  -> #results{ets = ets:new(sqlite3_results, [set, private])};
+                          false -> undefined
+                      end,
+            State = #state{port = Port, ops = Options, metrics = Metrics, cache = Cache,
+                           results = Results},
+            case start_wal_archive(Port, ArchiveOpts) of
+                ok ->
+                    case do_register_queries(Queries, State) of
+                        {ok, State1} ->
+                            {ok, State1};
+                        {{error, Code, Message}, _} ->
+                            port_close(Port),
+                            Msg = io_lib:format("Error preparing queries of DB file ~p: "
+                                                "code ~B, message '~s'",
+                                                [DbFile, Code, Message]),
+                            {stop, lists:flatten(Msg)}
+                    end;
+                {error, Code, Message} ->
+                    port_close(Port),
+                    Msg = io_lib:format("Error archiving WAL of DB file ~p: code ~B, message '~s'",
+                                        [DbFile, Code, Message]),
+                    {stop, lists:flatten(Msg)}
+            end;
         {Port, {error, Code, Message}} ->
             Msg = io_lib:format("Error opening DB file ~p: code ~B, message '~s'",
                                 [DbFile, Code, Message]),
             {stop, lists:flatten(Msg)}
     end.
 
+%% see https://www.sqlite.org/uri.html
+immutable_uri(File) ->
+    "file:" ++ lists:flatmap(fun(C) when C =:= $%; C =:= $?; C =:= $# ->
+                                     lists:flatten(io_lib:format("%~2.16.0B", [C]));
+                                (C) ->
+                                     [C]
+                             end, File) ++ "?immutable=1&nolock=1".
+
+%% Adds Result to the results kept, evicting the oldest ones to stay
+%% within ?RESULT_CACHE_BYTES; a result larger than that isn't kept
+keep_result(Key, Result, Results = #results{ets = Ets, order = Order, bytes = Bytes}) ->
+    Size = erlang:external_size(Result),
+    if
+        Size > ?RESULT_CACHE_BYTES ->
+            Results;
+        Bytes + Size > ?RESULT_CACHE_BYTES ->
+            {{value, Oldest}, Order1} = queue:out(Order),
+            [{_, _, OldestSize}] = ets:lookup(Ets, Oldest),
+            ets:delete(Ets, Oldest),
+            keep_result(Key, Result, Results#results{order = Order1,
+                                                     bytes = Bytes - OldestSize});
+        true ->
+            ets:insert(Ets, {Key, Result, Size}),
+            Results#results{order = queue:in(Key, Order), bytes = Bytes + Size}
+    end.
+
+new_cache([]) ->
+    undefined;
+new_cache(Tables) ->
+    Ets = ets:new(sqlite3_cache, [set, public, {read_concurrency, true},
+                                  {write_concurrency, true}]),
+    ets:insert(Ets, [{hits, 0}, {misses, 0}]),
+    Cache = #cache{db = self(), ets = Ets, tables = list_to_tuple(Tables)},
+    %% wait_result/1 invalidates the entries of the changes it receives
+    put(sqlite3_cache, Cache),
+    Cache.
+
+%% Table is an index into the tables of the cache option
+invalidate_cache(#cache{ets = Ets, tables = Tables}, Rows, WholeTables) ->
+    [ets:delete(Ets, {element(Table + 1, Tables), Rowid}) || {Table, Rowid} <- Rows],
+    [ets:match_delete(Ets, {{element(Table + 1, Tables), '_'}, '_'}) || Table <- WholeTables],
+    ok;
+invalidate_cache(undefined, _Rows, _WholeTables) ->
+    ok.
+
+query_entry({Name, SQL}) when is_atom(Name) ->
+    {Name, iolist_to_binary(SQL)}.
+
+%% Names keep their driver index when registered again, new ones are
+%% numbered on from the last
+do_register_queries([], State) ->
+    {ok, State};
+do_register_queries(Queries, State = #state{port = Port, queries = Known}) ->
+    {Entries, Known1} =
+        lists:mapfoldl(fun({Name, SQL}, Acc) ->
+                               Index = case dict:find(Name, Acc) of
+                                           {ok, Found} -> Found;
+                                           error       -> dict:size(Acc)
+                                       end,
+                               {{Index, Name, SQL}, dict:store(Name, Index, Acc)}
+                       end, Known, Queries),
+    case exec(Port, {register_queries, Entries}) of
+        ok    -> {ok, State#state{queries = Known1}};
+        Error -> {Error, State}
+    end.
+
+start_wal_archive(Port, Options) ->
+    case proplists:get_value(wal_archive, Options) of
+        undefined ->
+            ok;
+        Dir ->
+            AbsDir = filename:absname(Dir),
+            ok = filelib:ensure_dir(filename:join(AbsDir, "base")),
+            exec(Port, {wal_archive, {unicode:characters_to_binary(AbsDir),
+                                      proplists:get_value(wal_archive_pages, Options, 1000),
+                                      proplists:get_value(wal_snapshot_every, Options, 100),
+                                      sqlite3_archive:next_sequence(AbsDir)}})
+    end.
+
 %%--------------------------------------------------------------------
 %% @doc Handling call messages
 %% @end
@@ -985,6 +1739,35 @@ do_init(DriverName, Options) ->
 %%       {stop, any(), any(), tuple()} | {stop, any(), tuple()}.
 
 -spec handle_call(any(), pid(), #state{}) -> {'reply', any(), #state{}} | {'stop', 'normal', 'ok', #state{}}.
+handle_call({'$sqlite3_request', _Node, _CalledAt, Request}, From,
+            State = #state{metrics = undefined}) ->
+    handle_call(Request, From, State);
+handle_call({'$sqlite3_request', Node, CalledAt, Request}, From, State) ->
+    {message_queue_len, QueueLen} = process_info(self(), message_queue_len),
+    StartedAt = erlang:monotonic_time(),
+    Result = handle_call(Request, From, State),
+    % monotonic times of other nodes can't be compared
+    CalledAt1 = case Node =:= node() of
+                    true  -> CalledAt;
+                    false -> undefined
+                end,
+    NewState = element(tuple_size(Result), Result),
+    Metrics = sqlite3_metrics:record(request_name(Request), CalledAt1, StartedAt,
+                                     erlang:monotonic_time(), QueueLen,
+                                     NewState#state.metrics),
+    setelement(tuple_size(Result), Result, NewState#state{metrics = Metrics});
+handle_call(request_metrics, _From, State = #state{metrics = undefined}) ->
+    {reply, {error, not_instrumented}, State};
+handle_call(request_metrics, _From, State = #state{metrics = Metrics}) ->
+    {reply, sqlite3_metrics:to_list(Metrics), State};
+handle_call({subscribe_metrics, _Pid}, _From, State = #state{metrics = undefined}) ->
+    {reply, {error, not_instrumented}, State};
+handle_call({subscribe_metrics, Pid}, _From, State = #state{metrics = Metrics}) ->
+    {reply, ok, State#state{metrics = sqlite3_metrics:subscribe(Pid, Metrics)}};
+handle_call({unsubscribe_metrics, _Pid}, _From, State = #state{metrics = undefined}) ->
+    {reply, {error, not_instrumented}, State};
+handle_call({unsubscribe_metrics, Pid}, _From, State = #state{metrics = Metrics}) ->
+    {reply, ok, State#state{metrics = sqlite3_metrics:unsubscribe(Pid, Metrics)}};
 handle_call(close, _From, State) ->
     {stop, normal, _Reply = ok, State};
 handle_call(list_tables, _From, State) ->
@@ -1030,6 +1813,9 @@ handle_call({sql_exec, SQL}, _From, State) ->
 handle_call({sql_bind_and_exec, SQL, Params}, _From, State) ->
     Reply = do_sql_bind_and_exec(SQL, Params, State),
     {reply, Reply, State};
+handle_call({sql_bind_and_exec_encoded, Encoded}, _From, State = #state{port = Port}) ->
+    Reply = exec(Port, {sql_bind_and_exec_encoded, Encoded}),
+    {reply, Reply, State};
 handle_call({sql_exec_script, SQL}, _From, State) ->
     Reply = do_sql_exec_script(SQL, State),
     {reply, Reply, State};
@@ -1112,6 +1898,78 @@ handle_call({drop_table, Tbl}, _From, State) ->
         _:Exception ->
             {reply, {error, Exception}, State}
     end;
+handle_call({create_fts_table, Tbl, Columns, Options}, _From, State) ->
+    try sqlite3_lib:create_fts_table_sql(Tbl, Columns, Options) of
+        SQL -> do_handle_call_sql_exec(SQL, State)
+    catch
+        _:Exception ->
+            {reply, {error, Exception}, State}
+    end;
+handle_call({fts_bulk_insert, _Tbl, [], _Options}, _From, State) ->
+    {reply, {ok, 0}, State};
+handle_call({fts_bulk_insert, Tbl, Rows, Options}, _From, State) ->
+    try do_fts_bulk_insert(Tbl, Rows, Options, State) of
+        Reply -> {reply, Reply, State}
+    catch
+        _:Exception ->
+            {reply, {error, Exception}, State}
+    end;
+handle_call({upsert_many, _Tbl, _KeyCols, [], _Options}, _From, State) ->
+    {reply, {ok, [{inserted, 0}, {updated, 0}, {unchanged, 0}]}, State};
+handle_call({upsert_many, Tbl, KeyCols, Rows, Options}, _From, State) ->
+    try do_upsert_many(Tbl, KeyCols, Rows, Options, State) of
+        Reply -> {reply, Reply, State}
+    catch
+        _:Exception ->
+            {reply, {error, Exception}, State}
+    end;
+handle_call({bulk_insert, _Tbl, [], _Options}, _From, State) ->
+    {reply, {ok, 0}, State};
+handle_call({bulk_insert, Tbl, Rows, Options}, _From, State) ->
+    try do_bulk_insert(Tbl, Rows, Options, State) of
+        Reply -> {reply, Reply, State}
+    catch
+        _:Exception ->
+            {reply, {error, Exception}, State}
+    end;
+handle_call({create_rtree_table, Tbl, IdCol, Dims, Options}, _From, State) ->
+    try sqlite3_lib:create_rtree_table_sql(Tbl, IdCol, Dims, Options) of
+        SQL -> do_handle_call_sql_exec(SQL, State)
+    catch
+        _:Exception ->
+            {reply, {error, Exception}, State}
+    end;
+handle_call({rtree_bbox, Tbl, Box}, _From, State) ->
+    try sqlite3_lib:rtree_bbox_sql(Tbl, [{Min, Max} || {Min, Max, _, _} <- Box]) of
+        SQL ->
+            Params = lists:append([[Lo, Hi] || {_, _, Lo, Hi} <- Box]),
+            {reply, do_sql_bind_and_exec(SQL, Params, State), State}
+    catch
+        _:Exception ->
+            {reply, {error, Exception}, State}
+    end;
+handle_call({rtree_nearest, Tbl, Point, Options}, _From, State) ->
+    try sqlite3_lib:rtree_nearest_sql(Tbl, [{Min, Max} || {Min, Max, _} <- Point]) of
+        SQL ->
+            Reply = do_rtree_nearest(SQL, [Coord || {_, _, Coord} <- Point],
+                                     proplists:get_value(radius, Options, 1.0),
+                                     proplists:get_value(limit, Options, 10),
+                                     proplists:get_value(max_radius, Options, 1.0e6), State),
+            {reply, Reply, State}
+    catch
+        _:Exception ->
+            {reply, {error, Exception}, State}
+    end;
+handle_call({search, Tbl, Query, Options}, _From, State) ->
+    try sqlite3_lib:fts_search_sql(Tbl, Options) of
+        SQL ->
+            Params = [Query, proplists:get_value(limit, Options, 10),
+                      proplists:get_value(offset, Options, 0)],
+            {reply, do_sql_bind_and_exec(SQL, Params, State), State}
+    catch
+        _:Exception ->
+            {reply, {error, Exception}, State}
+    end;
 handle_call({prepare, SQL}, _From, State = #state{port = Port, refs = Refs}) ->
     case exec(Port, {prepare, SQL}) of
         Index when is_integer(Index) ->
@@ -1157,6 +2015,101 @@ handle_call(changes = Payload, _From, State = #state{port = Port, refs = _Refs})
 handle_call(filename = Payload, _From, State = #state{port = Port, refs = _Refs}) ->
     Reply = exec(Port, Payload),
     {reply, Reply, State};
+handle_call(trace, _From, State = #state{port = Port}) ->
+    Reply = case exec(Port, {trace, dump}) of
+                Entries when is_list(Entries) ->
+                    [lists:zip(?TRACE_FIELDS, tuple_to_list(Entry)) || Entry <- Entries];
+                Error ->
+                    Error
+            end,
+    {reply, Reply, State};
+handle_call({trace_on_error, Enable}, _From, State = #state{port = Port}) ->
+    Reply = exec(Port, {trace, {dump_on_error, Enable}}),
+    {reply, Reply, State};
+handle_call(statement_stats, _From, State = #state{port = Port}) ->
+    Reply = case exec(Port, {statement_stats, dump}) of
+                Entries when is_list(Entries) ->
+                    % element 3 is the total time
+                    [statement_stats_entry(Entry) ||
+                        Entry <- lists:reverse(lists:keysort(3, Entries))];
+                Error ->
+                    Error
+            end,
+    {reply, Reply, State};
+handle_call(reset_statement_stats, _From, State = #state{port = Port}) ->
+    Reply = exec(Port, {statement_stats, reset}),
+    {reply, Reply, State};
+handle_call({scan_status, Ref}, _From, State = #state{port = Port, refs = Refs}) ->
+    Reply = case dict:find(Ref, Refs) of
+                {ok, Index} ->
+                    scan_status_entries(exec(Port, {scan_status, Index}));
+                error ->
+                    {error, badarg}
+            end,
+    {reply, Reply, State};
+handle_call({profile, SQL, Params}, _From, State) ->
+    {reply, do_profile(SQL, Params, State), State};
+handle_call({register_queries, Queries}, _From, State) ->
+    {Reply, NewState} = do_register_queries(Queries, State),
+    {reply, Reply, NewState};
+handle_call({q, Name, Params}, _From, State = #state{port = Port, queries = Queries}) ->
+    Reply = case dict:find(Name, Queries) of
+                {ok, Index} ->
+                    exec(Port, {query, Index, Params});
+                error ->
+                    {error, badarg}
+            end,
+    {reply, Reply, State};
+handle_call({shared_query, SQL, Params}, _From, State = #state{results = undefined}) ->
+    {reply, do_shared_query(SQL, Params, State), State};
+handle_call({shared_query, SQL, Params}, _From,
+            State = #state{results = Results = #results{ets = Ets}}) ->
+    case ets:lookup(Ets, {SQL, Params}) of
+        [{_, Shared, _}] ->
+            {reply, Shared, State};
+        [] ->
+            case do_shared_query(SQL, Params, State) of
+                Shared = {shared, _} ->
+                    Results1 = keep_result({SQL, Params}, Shared, Results),
+                    {reply, Shared, State#state{results = Results1}};
+                Error ->
+                    {reply, Error, State}
+            end
+    end;
+handle_call({dbstat, Ref, SlicePages}, _From, State = #state{port = Port, refs = Refs}) ->
+    Reply = case dict:find(Ref, Refs) of
+                {ok, Index} ->
+                    exec(Port, {dbstat, Index, SlicePages});
+                error ->
+                    {error, badarg}
+            end,
+    {reply, Reply, State};
+handle_call(cache, _From, State = #state{cache = undefined}) ->
+    {reply, {error, no_cache}, State};
+handle_call(cache, _From, State = #state{cache = Cache}) ->
+    {reply, {ok, Cache}, State};
+handle_call({cached_read, Tbl, Rowid}, _From,
+            State = #state{cache = #cache{ets = Ets, tables = Tables}}) ->
+    Reply = case lists:member(Tbl, tuple_to_list(Tables)) of
+                true ->
+                    case do_sql_bind_and_exec(["SELECT * FROM ", sqlite3_lib:write_col_sql([Tbl]),
+                                               " WHERE rowid = ?;"], [Rowid], State) of
+                        [{columns, _}, {rows, [_]}] = Result ->
+                            ets:insert(Ets, {{Tbl, Rowid}, Result}),
+                            Result;
+                        Result ->
+                            Result
+                    end;
+                false ->
+                    {error, {not_cached, Tbl}}
+            end,
+    {reply, Reply, State};
+handle_call(recycle, _From, State = #state{port = Port}) ->
+    Reply = exec(Port, recycle),
+    {reply, Reply, State#state{refs = dict:new()}};
+handle_call(archive_wal, _From, State = #state{port = Port}) ->
+    Reply = exec(Port, {wal_archive, segment}),
+    {reply, Reply, State};
 handle_call({describe_table, Table}, _From, State) ->
     SQL = sqlite3_lib:describe_table(Table),
     do_handle_call_sql_exec(SQL, State);
@@ -1194,6 +2147,12 @@ handle_cast(_Msg, State) ->
 %% @hidden
 %%--------------------------------------------------------------------
 -spec handle_info(any(), #state{}) -> {'noreply', #state{}}.
+handle_info({'DOWN', MRef, process, _Pid, _Reason}, State = #state{metrics = Metrics})
+  when Metrics =/= undefined ->
+    {noreply, State#state{metrics = sqlite3_metrics:down(MRef, Metrics)}};
+handle_info({Port, {changed, Rows, Tables}}, State = #state{port = Port, cache = Cache}) ->
+    invalidate_cache(Cache, Rows, Tables),
+    {noreply, State};
 handle_info(_Info, State) ->
     {noreply, State}.
 
@@ -1211,20 +2170,9 @@ terminate(_Reason, #state{port = Port}) ->
         undefined ->
             pass;
         _ ->
-            port_close(Port)
-    end,
-    Driver = driver_name(),
-    case erl_ddll:unload(Driver) of
-        ok ->
-            ok;
-        {error, permanent} ->
-            %% Older Erlang versions mark any driver using driver_async
-            %% as permanent
-            ok;
-        {error, ErrorDesc} ->
-            error_logger:error_msg("Error unloading ~s driver: ~s~n",
-                                   [Driver, erl_ddll:format_error(ErrorDesc)])
+            close_port(Port)
     end,
+    %% the driver isn't unloaded, see load_driver/1
     ok.
 
 %%--------------------------------------------------------------------
@@ -1276,6 +2224,18 @@ driver_name() ->
 -define(CHANGES,                  14).
 -define(DB_FILENAME,              15).
 -define(TABLE_EXISTS,             16).
+-define(PREPARED_BATCH,           17).
+-define(WAL_ARCHIVE,              18).
+-define(TRACE,                    19).
+-define(STATEMENT_STATS,          20).
+-define(PREPARED_SCAN_STATUS,     21).
+-define(CLOSE,                    22).
+-define(RECYCLE,                  23).
+-define(REGISTER_QUERIES,         24).
+-define(QUERY,                    25).
+-define(PREPARED_UPSERT_BATCH,    26).
+-define(PREPARED_DBSTAT,          27).
+-define(SHARED_QUERY,             28).
 
 create_port_cmd(DriverName, DbFile, Options) ->
     Opts = case [readonly, readwrite] -- Options of
@@ -1306,10 +2266,49 @@ opts([full_mutex      | T]) -> [" -full-mutex"    | opts(T)];
 opts([shared_cache    | T]) -> [" -shared-cache"  | opts(T)];
 opts([private_cache   | T]) -> [" -private-cache" | opts(T)];
 opts([wal             | T]) -> [" -wal"           | opts(T)];
+opts([{trace_size, N} | T]) when is_integer(N), N >= 0 ->
+    [" -trace=" ++ integer_to_list(N) | opts(T)];
+opts([{stats_size, N} | T]) when is_integer(N), N >= 0 ->
+    [" -stats=" ++ integer_to_list(N) | opts(T)];
+opts([{auto_parameterize, N} | T]) when is_integer(N), N >= 0 ->
+    [" -auto-param=" ++ integer_to_list(N) | opts(T)];
+opts([{busy_retry, Ms} | T]) when is_integer(Ms), Ms >= 0 ->
+    [" -busy-retry=" ++ integer_to_list(Ms) | opts(T)];
+opts([{checkpoint_on_close, true} | T]) -> opts(T);
+opts([{checkpoint_on_close, false} | T]) -> [" -no-checkpoint-on-close" | opts(T)];
+opts([{cache, Tables} | T]) when is_list(Tables), length(Tables) =< ?CACHE_MAX_TABLES ->
+    [" -cache-tables=" ++ string:join([lists:flatten(sqlite3_lib:write_col_sql([Tbl])) ||
+                                          Tbl <- Tables], ",") | opts(T)];
+opts([immutable       | T]) -> [" -immutable"     | opts(T)];
+opts([{mmap_size, N} | T]) when is_integer(N), N >= 0 ->
+    [" -mmap-size=" ++ integer_to_list(N) | opts(T)];
+opts([memory_vfs      | T]) -> [" -memvfs"        | opts(T)];
+opts([{page_size, N} | T]) when is_integer(N), N > 0 ->
+    [" -page-size=" ++ integer_to_list(N) | opts(T)];
+opts([{optimize, Policy} | T]) when is_list(Policy) ->
+    optimize_opts(Policy) ++ opts(T);
+opts([{admission, Rules} | T]) when is_list(Rules) ->
+    admission_opts(Rules) ++ opts(T);
 opts([Other           | _]) -> throw({invalid_option, Other});
 opts([]) ->
     [].
 
+admission_opts([{max_scan_rows, N} | T]) when is_integer(N), N > 0 ->
+    [" -max-scan-rows=" ++ integer_to_list(N) | admission_opts(T)];
+admission_opts([no_temp_btree | T]) -> [" -no-temp-btree" | admission_opts(T)];
+admission_opts([Other | _]) -> throw({invalid_option, {admission, Other}});
+admission_opts([]) ->
+    [].
+
+optimize_opts([on_close | T]) -> [" -optimize-on-close" | optimize_opts(T)];
+optimize_opts([{every, N} | T]) when is_integer(N), N > 0 ->
+    [" -optimize-every=" ++ integer_to_list(N) | optimize_opts(T)];
+optimize_opts([{analysis_limit, N} | T]) when is_integer(N), N > 0 ->
+    [" -analysis-limit=" ++ integer_to_list(N) | optimize_opts(T)];
+optimize_opts([Other | _]) -> throw({invalid_option, {optimize, Other}});
+optimize_opts([]) ->
+    [].
+
 do_handle_call_sql_exec(SQL, State) ->
     Reply = do_sql_exec(SQL, State),
     {reply, Reply, State}.
@@ -1318,6 +2317,40 @@ do_sql_exec(SQL, #state{port = Port}) ->
     ?dbgF("SQL: ~s~n", [SQL]),
     exec(Port, {sql_exec, SQL}).
 
+%% Callers with the same request waiting in the mailbox asked while the
+%% query ran, so its result is one they could have got, unless another
+%% connection committed in the meantime, which the driver reports as
+%% unshared.
+do_shared_query(SQL, Params, #state{port = Port}) ->
+    ?dbgF("SQL: ~s; Parameters: ~p~n", [SQL, Params]),
+    case exec(Port, {shared_query, SQL, Params}) of
+        {shared, Result}   -> share_result(SQL, Params, Result, true);
+        {unshared, Result} -> share_result(SQL, Params, Result, false);
+        Error              -> Error
+    end.
+
+share_result(SQL, Params, Result, ShareWithWaiters) ->
+    case Result of
+        [{columns, _}, {rows, _}] ->
+            Shared = {shared, term_to_binary(Result)},
+            case ShareWithWaiters of
+                true  -> [gen_server:reply(From, Shared) || From <- shared_waiters(SQL, Params, [])];
+                false -> ok
+            end,
+            Shared;
+        _ ->
+            Result
+    end.
+
+%% takes the requests out of the mailbox, they get no request metrics
+shared_waiters(SQL, Params, Froms) ->
+    receive
+        {'$gen_call', From, {'$sqlite3_request', _Node, _CalledAt, {shared_query, SQL, Params}}} ->
+            shared_waiters(SQL, Params, [From | Froms])
+    after 0 ->
+            lists:reverse(Froms)
+    end.
+
 do_sql_bind_and_exec(SQL, Params, #state{port = Port}) ->
     ?dbgF("SQL: ~s; Parameters: ~p~n", [SQL, Params]),
     exec(Port, {sql_bind_and_exec, SQL, Params}).
@@ -1326,6 +2359,290 @@ do_sql_exec_script(SQL, #state{port = Port}) ->
     ?dbgF("SQL: ~s~n", [SQL]),
     exec(Port, {sql_exec_script, SQL}).
 
+%% Runs SQL once for every parameter list in ParamsList. Each batch of
+%% BatchSize parameter lists is sent to the driver at once and executed
+%% inside a savepoint, so a failing batch is rolled back.
+do_bulk_exec(SQL, ParamsList, BatchSize, #state{port = Port}) ->
+    ?dbgF("SQL: ~s; ~B rows~n", [SQL, length(ParamsList)]),
+    case exec(Port, {prepare, SQL}) of
+        Index when is_integer(Index) ->
+            try
+                bulk_exec_batches(Port, Index, ParamsList, BatchSize, 0)
+            after
+                exec(Port, {finalize, Index})
+            end;
+        Error ->
+            Error
+    end.
+
+bulk_exec_batches(_Port, _Index, [], _BatchSize, Count) ->
+    {ok, Count};
+bulk_exec_batches(Port, Index, ParamsList, BatchSize, Count) ->
+    {Batch, Rest} = split_batch(BatchSize, ParamsList),
+    case exec(Port, {sql_exec, "SAVEPOINT 'erlang-sqlite3-bulk';"}) of
+        ok ->
+            case exec(Port, {batch, Index, Batch}) of
+                {ok, N} ->
+                    case exec(Port, {sql_exec, "RELEASE SAVEPOINT 'erlang-sqlite3-bulk';"}) of
+                        ok    -> bulk_exec_batches(Port, Index, Rest, BatchSize, Count + N);
+                        Error -> Error
+                    end;
+                Error ->
+                    exec(Port, {sql_exec_script, "ROLLBACK TO SAVEPOINT 'erlang-sqlite3-bulk';"
+                                                 "RELEASE SAVEPOINT 'erlang-sqlite3-bulk';"}),
+                    Error
+            end;
+        Error ->
+            Error
+    end.
+
+%% Like do_bulk_exec, but all batches run in one savepoint and their
+%% counts of inserted, updated and unchanged rows are added up
+do_upsert_many(Tbl, KeyCols, Rows, Options, #state{port = Port}) ->
+    case without_rowid(Port, Tbl) of
+        false -> do_upsert_rows(Port, Tbl, KeyCols, Rows, Options);
+        true  -> {error, {without_rowid, Tbl}};
+        Error -> Error
+    end.
+
+%% PRAGMA index_info of a WITHOUT ROWID table lists its primary key, that
+%% of any other table nothing
+without_rowid(Port, Tbl) ->
+    Name = case is_atom(Tbl) of
+               true  -> atom_to_binary(Tbl, utf8);
+               false -> iolist_to_binary(Tbl)
+           end,
+    case exec(Port, {sql_bind_and_exec, "SELECT count(*) FROM pragma_index_info(?);", [Name]}) of
+        [{columns, _}, {rows, [{Count}]}] -> Count > 0;
+        Error -> Error
+    end.
+
+do_upsert_rows(Port, Tbl, KeyCols, [FirstRow | _] = Rows, Options) ->
+    Cols = [Col || {Col, _} <- FirstRow],
+    SQL = sqlite3_lib:upsert_params_sql(Tbl, KeyCols, Cols),
+    ParamsList = [[row_value(Col, Row) || Col <- Cols] || Row <- Rows],
+    ?dbgF("SQL: ~s; ~B rows~n", [SQL, length(ParamsList)]),
+    case exec(Port, {prepare, SQL}) of
+        Index when is_integer(Index) ->
+            try
+                upsert_in_savepoint(Port, Index, ParamsList,
+                                    proplists:get_value(batch_size, Options, 10000))
+            after
+                exec(Port, {finalize, Index})
+            end;
+        Error ->
+            Error
+    end.
+
+upsert_in_savepoint(Port, Index, ParamsList, BatchSize) ->
+    case exec(Port, {sql_exec, "SAVEPOINT 'erlang-sqlite3-upsert';"}) of
+        ok ->
+            case upsert_batches(Port, Index, ParamsList, BatchSize, {0, 0, 0}) of
+                {ok, _} = Result ->
+                    case exec(Port, {sql_exec, "RELEASE SAVEPOINT 'erlang-sqlite3-upsert';"}) of
+                        ok    -> Result;
+                        Error -> Error
+                    end;
+                Error ->
+                    exec(Port, {sql_exec_script, "ROLLBACK TO SAVEPOINT 'erlang-sqlite3-upsert';"
+                                                 "RELEASE SAVEPOINT 'erlang-sqlite3-upsert';"}),
+                    Error
+            end;
+        Error ->
+            Error
+    end.
+
+upsert_batches(_Port, _Index, [], _BatchSize, {Inserted, Updated, Unchanged}) ->
+    {ok, [{inserted, Inserted}, {updated, Updated}, {unchanged, Unchanged}]};
+upsert_batches(Port, Index, ParamsList, BatchSize, {Inserted, Updated, Unchanged}) ->
+    {Batch, Rest} = split_batch(BatchSize, ParamsList),
+    case exec(Port, {upsert_batch, Index, Batch}) of
+        {ok, I, U, N} ->
+            upsert_batches(Port, Index, Rest, BatchSize,
+                           {Inserted + I, Updated + U, Unchanged + N});
+        Error ->
+            Error
+    end.
+
+split_batch(N, List) -> split_batch(N, List, []).
+
+split_batch(0, Rest, Acc)     -> {lists:reverse(Acc), Rest};
+split_batch(_, [], Acc)       -> {lists:reverse(Acc), []};
+split_batch(N, [H | T], Acc)  -> split_batch(N - 1, T, [H | Acc]).
+
+do_fts_bulk_insert(Tbl, Rows, Options, State) ->
+    Keys = [Key || {Key, _} <- ?FTS_MERGE_DEFAULTS],
+    case do_sql_exec(sqlite3_lib:fts_config_get_sql(Tbl, Keys), State) of
+        [{columns, _}, {rows, Set}] ->
+            Previous = [{Key, fts_setting(Key, Set, Default)}
+                        || {Key, Default} <- ?FTS_MERGE_DEFAULTS],
+            Loading = [{Key, proplists:get_value(Key, Options, Default)}
+                       || {Key, Default} <- [{automerge, 8}, {crisismerge, 64}]],
+            Result = case fts_configure(Tbl, Loading, State) of
+                         ok    -> fts_load(Tbl, Rows, Options, State);
+                         Error -> Error
+                     end,
+            Restored = fts_configure(Tbl, Previous, State),
+            case Result of
+                {ok, _} when Restored =/= ok -> Restored;
+                _                            -> Result
+            end;
+        Error ->
+            Error
+    end.
+
+fts_setting(Key, Set, Default) ->
+    case lists:keyfind(atom_to_binary(Key, latin1), 1, Set) of
+        {_, Value} -> Value;
+        false      -> Default
+    end.
+
+%% FTS5 configuration and special commands are INSERTs, which the driver
+%% replies {rowid, _} to
+fts_configure(Tbl, Settings, State) ->
+    Config = [sqlite3_lib:fts_config_sql(Tbl, Key, Value) || {Key, Value} <- Settings],
+    case lists:dropwhile(fun fts_done/1, do_sql_exec_script(Config, State)) of
+        []          -> ok;
+        [Error | _] -> Error
+    end.
+
+fts_done(ok)         -> true;
+fts_done({rowid, _}) -> true;
+fts_done(_)          -> false.
+
+fts_load(Tbl, Rows, Options, State) ->
+    case do_bulk_insert(Tbl, Rows, Options, State) of
+        {ok, _} = Result ->
+            case proplists:get_bool(optimize, Options) of
+                true ->
+                    Optimized = do_sql_exec(sqlite3_lib:fts_command_sql(Tbl, optimize), State),
+                    case fts_done(Optimized) of
+                        true  -> Result;
+                        false -> Optimized
+                    end;
+                false ->
+                    Result
+            end;
+        Error ->
+            Error
+    end.
+
+do_bulk_insert(Tbl, [FirstRow | _] = Rows, Options, State) ->
+    Cols = [Col || {Col, _} <- FirstRow],
+    SQL = sqlite3_lib:write_params_sql(Tbl, Cols),
+    Params = [[row_value(Col, Row) || Col <- Cols] || Row <- Rows],
+    do_bulk_exec(SQL, Params, proplists:get_value(batch_size, Options, 10000), State).
+
+%% Doubles the search radius until Limit entries are found within it
+%% (or MaxRadius is reached). Entries in the box but outside the radius
+%% are not returned, since closer ones may lie outside the box.
+do_rtree_nearest(SQL, Coords, Radius, Limit, MaxRadius, State) ->
+    case do_sql_bind_and_exec(SQL, Coords ++ [Radius, Limit], State) of
+        [{columns, _}, {rows, Rows}] when length(Rows) < Limit, Radius < MaxRadius ->
+            do_rtree_nearest(SQL, Coords, min(Radius * 2, MaxRadius), Limit, MaxRadius, State);
+        Result ->
+            Result
+    end.
+
+%% Steps through the statement to profile, so its scan status can be
+%% read before it's finalized
+do_profile(SQL, Params, #state{port = Port}) ->
+    ?dbgF("SQL: ~s; Params: ~p~n", [SQL, Params]),
+    case exec(Port, {prepare, SQL}) of
+        Index when is_integer(Index) ->
+            try profile_run(Port, Index, Params) of
+                {error, _, _} = Error ->
+                    Error;
+                Result ->
+                    case scan_status_entries(exec(Port, {scan_status, Index})) of
+                        Loops when is_list(Loops) -> {Result, Loops};
+                        Error                     -> Error
+                    end
+            after
+                exec(Port, {finalize, Index})
+            end;
+        Error ->
+            Error
+    end.
+
+profile_run(Port, Index, []) ->
+    profile_rows(Port, Index, []);
+profile_run(Port, Index, Params) ->
+    case exec(Port, {bind, Index, Params}) of
+        ok    -> profile_rows(Port, Index, []);
+        Error -> Error
+    end.
+
+profile_rows(Port, Index, Rows) ->
+    case exec(Port, {next, Index}) of
+        {error, Code, _} = Error when is_integer(Code) ->
+            Error;
+        {rowid, _} = RowId ->
+            RowId;
+        done ->
+            case exec(Port, {columns, Index}) of
+                []      -> ok;
+                Columns -> [{columns, Columns}, {rows, lists:reverse(Rows)}]
+            end;
+        Row ->
+            profile_rows(Port, Index, [Row | Rows])
+    end.
+
+storage_slices(Db, Ref, SlicePages, Acc) ->
+    case call(Db, {dbstat, Ref, SlicePages}) of
+        {ok, Entries} ->
+            storage_slices(Db, Ref, SlicePages, merge_storage_entries(Entries, Acc));
+        {done, Entries} ->
+            Sorted = lists:reverse(lists:keysort(2, merge_storage_entries(Entries, Acc))),
+            {ok, [storage_stats_entry(Entry) || Entry <- Sorted]};
+        Error ->
+            Error
+    end.
+
+%% Acc has the entries of the previous slices reversed, its first one may
+%% continue in Entries
+merge_storage_entries([{Name, Pages2, Leaf2, Overflow2, Cells2, Payload2, Unused2, NonSeq2,
+                        First2, Last2} | Entries],
+                      [{Name, Pages1, Leaf1, Overflow1, Cells1, Payload1, Unused1, NonSeq1,
+                        First1, Last1} | Acc]) ->
+    NonSeq = NonSeq1 + NonSeq2 + case First2 =:= Last1 + 1 of
+                                     true  -> 0;
+                                     false -> 1
+                                 end,
+    Entry = {Name, Pages1 + Pages2, Leaf1 + Leaf2, Overflow1 + Overflow2, Cells1 + Cells2,
+             Payload1 + Payload2, Unused1 + Unused2, NonSeq, First1, Last2},
+    lists:reverse(Entries, [Entry | Acc]);
+merge_storage_entries(Entries, Acc) ->
+    lists:reverse(Entries, Acc).
+
+storage_stats_entry({Name, Pages, Leaf, Overflow, Cells, Payload, Unused, NonSeq, _, _}) ->
+    {binary_to_list(Name),
+     [{pages, Pages}, {leaf_pages, Leaf}, {interior_pages, Pages - Leaf - Overflow},
+      {overflow_pages, Overflow}, {leaf_cells, Cells}, {payload_bytes, Payload},
+      {unused_bytes, Unused}, {fragmentation, NonSeq / max(Pages - 1, 1)}]}.
+
+scan_status_entries(Loops) when is_list(Loops) ->
+    [lists:zip(?SCAN_STATUS_FIELDS, tuple_to_list(Loop)) || Loop <- Loops];
+scan_status_entries(Error) ->
+    Error.
+
+%% min_us is -1 until an execution is done
+statement_stats_entry(Entry) ->
+    [{sql, SQL}, {calls, Calls}, {total_us, Total}, {min_us, Min} | Rest] =
+        lists:zip(?STATEMENT_STATS_FIELDS, tuple_to_list(Entry)),
+    Mean = case Calls of
+               0 -> 0;
+               _ -> Total div Calls
+           end,
+    [{sql, SQL}, {calls, Calls}, {total_us, Total}, {min_us, max(Min, 0)} | Rest] ++
+        [{mean_us, Mean}].
+
+row_value(Col, Row) ->
+    case lists:keyfind(Col, 1, Row) of
+        {_, Value} -> Value;
+        false      -> null
+    end.
+
 exec(_Port, {create_function, _FunctionName, _Function}) ->
     error_logger:error_report([{application, sqlite3}, "NOT IMPL YET"]);
 %port_control(Port, ?SQL_CREATE_FUNCTION, list_to_binary(Cmd)),
@@ -1337,6 +2654,13 @@ exec(Port, {sql_bind_and_exec, SQL, Params}) ->
     Bin = term_to_binary({iolist_to_binary(SQL), Params}),
     port_control(Port, ?SQL_BIND_AND_EXEC_COMMAND, Bin),
     wait_result(Port);
+exec(Port, {shared_query, SQL, Params}) ->
+    Bin = term_to_binary({iolist_to_binary(SQL), Params}),
+    port_control(Port, ?SHARED_QUERY, Bin),
+    wait_result(Port);
+exec(Port, {sql_bind_and_exec_encoded, Encoded}) ->
+    port_control(Port, ?SQL_BIND_AND_EXEC_COMMAND, Encoded),
+    wait_result(Port);
 exec(Port, {sql_exec_script, SQL}) ->
     port_control(Port, ?SQL_EXEC_SCRIPT, SQL),
     wait_result(Port);
@@ -1347,6 +2671,26 @@ exec(Port, {bind, Index, Params}) ->
     Bin = term_to_binary({Index, Params}),
     port_control(Port, ?PREPARED_BIND, Bin),
     wait_result(Port);
+exec(Port, {trace, Term}) ->
+    port_control(Port, ?TRACE, term_to_binary(Term)),
+    wait_result(Port);
+exec(Port, {statement_stats, Term}) ->
+    port_control(Port, ?STATEMENT_STATS, term_to_binary(Term)),
+    wait_result(Port);
+exec(Port, {wal_archive, Term}) ->
+    port_control(Port, ?WAL_ARCHIVE, term_to_binary(Term)),
+    wait_result(Port);
+exec(Port, {batch, Index, ParamsList}) ->
+    Bin = term_to_binary({Index, ParamsList}),
+    port_control(Port, ?PREPARED_BATCH, Bin),
+    wait_result(Port);
+exec(Port, {upsert_batch, Index, ParamsList}) ->
+    Bin = term_to_binary({Index, ParamsList}),
+    port_control(Port, ?PREPARED_UPSERT_BATCH, Bin),
+    wait_result(Port);
+exec(Port, {dbstat, Index, SlicePages}) ->
+    port_control(Port, ?PREPARED_DBSTAT, term_to_binary({Index, SlicePages})),
+    wait_result(Port);
 exec(Port, {enable_load_extension, Value}) ->
     % Payload is 1 if enabling extension loading,
     % 0 if disabling
@@ -1367,25 +2711,71 @@ exec(Port, {table_exists, Tbl}) ->
 exec(Port, filename) ->
     port_control(Port, ?DB_FILENAME, <<"">>),
     wait_result(Port);
+exec(Port, {register_queries, Entries}) ->
+    port_control(Port, ?REGISTER_QUERIES, term_to_binary(Entries)),
+    wait_result(Port);
+exec(Port, {query, Index, Params}) ->
+    port_control(Port, ?QUERY, term_to_binary({Index, Params})),
+    wait_result(Port);
+exec(Port, recycle) ->
+    port_control(Port, ?RECYCLE, <<"">>),
+    wait_result(Port);
 exec(Port, {Cmd, Index}) when is_integer(Index) ->
     CmdCode = case Cmd of
                   next -> ?PREPARED_STEP;
                   reset -> ?PREPARED_RESET;
                   clear_bindings -> ?PREPARED_CLEAR_BINDINGS;
                   finalize -> ?PREPARED_FINALIZE;
-                  columns -> ?PREPARED_COLUMNS
+                  columns -> ?PREPARED_COLUMNS;
+                  scan_status -> ?PREPARED_SCAN_STATUS
               end,
     Bin = term_to_binary(Index),
     port_control(Port, CmdCode, Bin),
     wait_result(Port).
 
+%% Requests carry the time they were made at for the request metrics
+call(Db, Request) ->
+    gen_server:call(Db, {'$sqlite3_request', node(), erlang:monotonic_time(), Request}).
+
+call(Db, Request, Timeout) ->
+    gen_server:call(Db, {'$sqlite3_request', node(), erlang:monotonic_time(), Request},
+                    Timeout).
+
+request_name(Request) when is_tuple(Request) -> element(1, Request);
+request_name(Request)                        -> Request.
+
+%% The driver finalizes the statements and closes the database on its
+%% async thread, which can checkpoint for a while with a large WAL, so
+%% the port is only closed once that is done
+close_port(Port) ->
+    case catch port_control(Port, ?CLOSE, <<>>) of
+        {'EXIT', _} ->
+            pass;
+        _ ->
+            receive
+                {Port, {error, Code, Message}} ->
+                    error_logger:error_msg("Error closing sqlite3 DB: code ~B, message '~s'~n",
+                                           [Code, Message]);
+                {Port, ok} ->
+                    ok;
+                {'EXIT', Port, _Reason} ->
+                    ok
+            end
+    end,
+    catch port_close(Port).
+
 wait_result(Port) ->
     receive
+        {Port, {changed, Rows, Tables}} ->
+            invalidate_cache(get(sqlite3_cache), Rows, Tables),
+            wait_result(Port);
         {Port, Reply} ->
             Reply;
         {'EXIT', Port, Reason} ->
             {error, {port_exit, Reason}};
-        Other when is_tuple(Other), element(1, Other) =/= '$gen_call', element(1, Other) =/= '$gen_cast' ->
+        % monitors of metrics subscribers are left to handle_info
+        Other when is_tuple(Other), element(1, Other) =/= '$gen_call', element(1, Other) =/= '$gen_cast',
+                   element(1, Other) =/= 'DOWN' ->
             Other
     end.
 
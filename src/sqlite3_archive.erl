@@ -0,0 +1,128 @@
+%%%-------------------------------------------------------------------
+%%% File    : sqlite3_archive.erl
+%%% @doc Restoring databases from a WAL archive
+%%%
+%%% A database opened with the `{wal_archive, Dir}' option keeps an
+%%% archive in Dir made of base snapshots (`Seq-Time.base') and WAL
+%%% segments (`Seq-Time.wal'), where Seq orders the files and Time is
+%%% the Unix time the file was written. Base snapshot N holds everything
+%%% in the segments before N, so a database is rebuilt by copying a base
+%%% snapshot and replaying the following segments in order.
+%%% @end
+%%%-------------------------------------------------------------------
+-module(sqlite3_archive).
+
+-export([list/1, next_sequence/1, restore/2, restore/3]).
+
+-type entry() :: {Seq :: pos_integer(), base | wal, Time :: non_neg_integer(),
+                  file:filename()}.
+-type restore_option() :: {until, Seq :: pos_integer()} |
+                          {until_time, UnixSeconds :: non_neg_integer()}.
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Lists the base snapshots and WAL segments in the archive directory
+%%   Dir in the order they have to be applied.
+%% @end
+%%--------------------------------------------------------------------
+-spec list(file:filename()) -> [entry()].
+list(Dir) ->
+    lists:sort([Entry || File <- filelib:wildcard("*.{base,wal}", Dir),
+                         Entry <- parse_name(Dir, File)]).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Returns the sequence number the next file written to the archive
+%%   directory Dir should get.
+%% @end
+%%--------------------------------------------------------------------
+-spec next_sequence(file:filename()) -> pos_integer().
+next_sequence(Dir) ->
+    lists:max([0 | [Seq || {Seq, _, _, _} <- list(Dir)]]) + 1.
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Rebuilds the database file Target from the archive in Dir up to the
+%%   last archived WAL segment. See restore/3.
+%% @end
+%%--------------------------------------------------------------------
+-spec restore(file:filename(), file:filename()) -> ok | {error, term()}.
+restore(Dir, Target) ->
+    restore(Dir, Target, []).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Rebuilds the database file Target (which is overwritten) from the
+%%   archive in Dir: the latest usable base snapshot is copied and the
+%%   WAL segments following it are replayed one by one.
+%%
+%%   Options:
+%%   <dl>
+%%     <dt>{until, Seq}</dt><dd>Stop after the file with sequence number Seq</dd>
+%%     <dt>{until_time, UnixSeconds}</dt><dd>Only use files written at or
+%%          before the given time, i.e. restore the database as it was at
+%%          the end of the last segment archived by then</dd>
+%%   </dl>
+%% @end
+%%--------------------------------------------------------------------
+-spec restore(file:filename(), file:filename(), [restore_option()]) ->
+          ok | {error, term()}.
+restore(Dir, Target, Options) ->
+    Entries = [Entry || Entry = {Seq, _, Time, _} <- list(Dir),
+                        Seq =< proplists:get_value(until, Options, Seq),
+                        Time =< proplists:get_value(until_time, Options, Time)],
+    case [Entry || Entry = {_, base, _, _} <- Entries] of
+        [] ->
+            {error, no_base_snapshot};
+        Bases ->
+            {BaseSeq, base, _, BaseFile} = lists:last(Bases),
+            [file:delete(Target ++ Ext) || Ext <- ["-wal", "-shm", "-journal"]],
+            case file:copy(BaseFile, Target) of
+                {ok, _} ->
+                    replay([File || {Seq, wal, _, File} <- Entries, Seq >= BaseSeq], Target);
+                {error, Reason} ->
+                    {error, {BaseFile, Reason}}
+            end
+    end.
+
+%%--------------------------------------------------------------------
+%% Internal functions
+%%--------------------------------------------------------------------
+
+parse_name(Dir, File) ->
+    case re:run(File, "^([0-9]+)-([0-9]+)\\.(base|wal)$", [{capture, all_but_first, list}]) of
+        {match, [Seq, Time, Kind]} ->
+            [{list_to_integer(Seq), list_to_atom(Kind), list_to_integer(Time),
+              filename:join(Dir, File)}];
+        nomatch ->
+            []
+    end.
+
+%% Every segment is put in place as the WAL of Target, which SQLite
+%% recovers on open, and checkpointed into the database file.
+replay([], _Target) ->
+    ok;
+replay([Segment | Rest], Target) ->
+    file:delete(Target ++ "-shm"),
+    case file:copy(Segment, Target ++ "-wal") of
+        {ok, _} ->
+            case checkpoint(Target) of
+                ok    -> replay(Rest, Target);
+                Error -> {error, {Segment, Error}}
+            end;
+        {error, Reason} ->
+            {error, {Segment, Reason}}
+    end.
+
+checkpoint(File) ->
+    case sqlite3:open(anonymous, [{file, File}]) of
+        {ok, Db} ->
+            Result = sqlite3:sql_exec(Db, "PRAGMA wal_checkpoint(TRUNCATE);"),
+            sqlite3:close(Db),
+            case Result of
+                [{columns, _}, {rows, [{0, N, N}]}] when N >= 0 -> ok;
+                _                                               -> Result
+            end;
+        Error ->
+            Error
+    end.
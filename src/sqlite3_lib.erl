@@ -20,6 +20,10 @@
 -export([write_sql/2, update_sql/3]).
 -export([update_set_sql/1, delete_sql/2]).
 -export([read_sql/1, read_sql/2, read_sql/3, read_cols_sql/1]).
+-export([write_params_sql/2, update_params_sql/3, upsert_params_sql/3]).
+-export([create_fts_table_sql/3, fts_config_sql/3, fts_config_get_sql/2, fts_command_sql/2,
+         fts_search_sql/2]).
+-export([create_rtree_table_sql/4, rtree_bbox_sql/2, rtree_nearest_sql/2]).
 
 %%====================================================================
 %% API
@@ -253,6 +257,52 @@ write_sql(Tbl, Data) ->
     ["INSERT INTO ", to_iolist(Tbl), " (", write_col_sql(Cols),
      ") values (", write_value_sql(Values), ");"].
 
+%%--------------------------------------------------------------------
+%% @doc Creates an insertion SQL stmt for columns Cols with a `?'
+%%      parameter in place of every value.
+%% @end
+%%--------------------------------------------------------------------
+-spec write_params_sql(table_id(), [column_id()]) -> iolist().
+write_params_sql(Tbl, Cols) ->
+    ["INSERT INTO ", to_iolist(Tbl), " (", write_col_sql(Cols),
+     ") values (", map_intersperse(fun(_) -> "?" end, Cols, ", "), ");"].
+
+%%--------------------------------------------------------------------
+%% @doc Creates an update SQL stmt setting columns Cols of the records
+%%      with the given KeyCols, with a `?' parameter in place of every
+%%      value: the new values come first, then the keys.
+%% @end
+%%--------------------------------------------------------------------
+-spec update_params_sql(table_id(), [column_id()], [column_id()]) -> iolist().
+update_params_sql(Tbl, [_|_] = KeyCols, Cols) ->
+    ParamFun = fun(Col) -> [to_iolist(Col), " = ?"] end,
+    ["UPDATE ", to_iolist(Tbl), " SET ", map_intersperse(ParamFun, Cols, ", "),
+     " WHERE ", map_intersperse(ParamFun, KeyCols, " AND "), ";"].
+
+%%--------------------------------------------------------------------
+%% @doc Creates an insertion SQL stmt for columns Cols with a `?'
+%%      parameter in place of every value, which updates the other
+%%      columns of the record with the same KeyCols instead if there is
+%%      one and any of them differs.
+%% @end
+%%--------------------------------------------------------------------
+-spec upsert_params_sql(table_id(), [column_id()], [column_id()]) -> iolist().
+upsert_params_sql(Tbl, [_|_] = KeyCols, Cols) ->
+    Insert = ["INSERT INTO ", to_iolist(Tbl), " (", write_col_sql(Cols),
+              ") values (", map_intersperse(fun(_) -> "?" end, Cols, ", "),
+              ") ON CONFLICT (", write_col_sql(KeyCols), ") DO "],
+    case [Col || Col <- Cols, not lists:member(Col, KeyCols)] of
+        [] ->
+            [Insert, "NOTHING;"];
+        Updated ->
+            [Insert, "UPDATE SET ",
+             map_intersperse(fun(Col) -> C = to_iolist(Col), [C, " = excluded.", C] end,
+                             Updated, ", "),
+             " WHERE ",
+             map_intersperse(fun(Col) -> C = to_iolist(Col), [C, " IS NOT excluded.", C] end,
+                             Updated, " OR "), ";"]
+    end.
+
 %%--------------------------------------------------------------------
 %% @doc Returns all records from table Tbl.
 %% @end
@@ -304,6 +354,160 @@ delete_sql(Tbl, [{_,_}|_]=KeyValue) ->
 drop_table_sql(Tbl) ->
     ["DROP TABLE ", to_iolist(Tbl), ";"].
 
+%%--------------------------------------------------------------------
+%% @doc Generates an FTS5 virtual table create stmt in SQL.
+%%      A column given as `{Name, unindexed}' is stored but not indexed.
+%% @end
+%%--------------------------------------------------------------------
+-spec create_fts_table_sql(table_id(), [fts_column()], [fts_option()]) -> iolist().
+create_fts_table_sql(Tbl, Columns, Options) ->
+    ["CREATE VIRTUAL TABLE ", to_iolist(Tbl), " USING fts5(",
+     map_intersperse(fun fts_column_sql/1, Columns, ", "),
+     [[", ", fts_option_sql(Option)] || Option <- Options], ");"].
+
+%%--------------------------------------------------------------------
+%% @doc Sets an FTS5 configuration option (e.g. `automerge',
+%%      `crisismerge', `usermerge', `pgsz') of table Tbl.
+%% @end
+%%--------------------------------------------------------------------
+-spec fts_config_sql(table_id(), atom(), sql_value()) -> iolist().
+fts_config_sql(Tbl, Key, Value) ->
+    T = to_iolist(Tbl),
+    ["INSERT INTO ", T, "(", T, ", rank) VALUES (",
+     value_to_sql(atom_to_list(Key)), ", ", value_to_sql(Value), ");"].
+
+%%--------------------------------------------------------------------
+%% @doc Reads the FTS5 configuration options Keys of table Tbl which
+%%      have been set, as rows of key and value, from its `_config'
+%%      shadow table. Options which are not returned have their defaults.
+%% @end
+%%--------------------------------------------------------------------
+-spec fts_config_get_sql(table_id(), [atom()]) -> iolist().
+fts_config_get_sql(Tbl, Keys) ->
+    ["SELECT k, v FROM ", to_iolist(Tbl), "_config WHERE k IN (",
+     map_intersperse(fun(Key) -> value_to_sql(atom_to_list(Key)) end, Keys, ", "), ");"].
+
+%%--------------------------------------------------------------------
+%% @doc Runs an FTS5 special command (`optimize', `rebuild',
+%%      `integrity-check') on table Tbl.
+%% @end
+%%--------------------------------------------------------------------
+-spec fts_command_sql(table_id(), atom()) -> iolist().
+fts_command_sql(Tbl, Command) ->
+    T = to_iolist(Tbl),
+    ["INSERT INTO ", T, "(", T, ") VALUES (", value_to_sql(atom_to_list(Command)), ");"].
+
+%%--------------------------------------------------------------------
+%% @doc
+%%    Creates an FTS5 query returning rows of Tbl matching the first
+%%    parameter, ordered by their bm25 rank (best first), with the
+%%    limit and offset as second and third parameters.
+%%
+%%    Options:
+%%    <dl>
+%%      <dt>{columns, all | [column_id()]}</dt><dd>Columns to return (default all)</dd>
+%%      <dt>{weights, [number()]}</dt><dd>Per-column bm25 weights</dd>
+%%      <dt>{snippet, boolean()}</dt><dd>Add a `snippet' column (default true)</dd>
+%%      <dt>{snippet_column, integer()}</dt><dd>Column to take snippets from, -1 picks the best one</dd>
+%%      <dt>{highlight, {Open, Close}}</dt><dd>Markers around matched terms (default `[' and `]')</dd>
+%%      <dt>{ellipsis, string()}</dt><dd>Text marking omitted text (default `...')</dd>
+%%      <dt>{snippet_tokens, integer()}</dt><dd>Maximum number of tokens in a snippet (default 16)</dd>
+%%    </dl>
+%% @end
+%%--------------------------------------------------------------------
+-spec fts_search_sql(table_id(), [tuple()]) -> iolist().
+fts_search_sql(Tbl, Options) ->
+    T = to_iolist(Tbl),
+    Cols = case proplists:get_value(columns, Options, all) of
+               all     -> "*";
+               Columns -> read_cols_sql(Columns)
+           end,
+    Rank = case proplists:get_value(weights, Options, []) of
+               []      -> ["bm25(", T, ")"];
+               Weights -> ["bm25(", T, ", ", map_intersperse(fun value_to_sql/1, Weights, ", "), ")"]
+           end,
+    Snippet = case proplists:get_value(snippet, Options, true) of
+                  false ->
+                      [];
+                  true ->
+                      {Open, Close} = proplists:get_value(highlight, Options, {"[", "]"}),
+                      [", snippet(", T, ", ",
+                       integer_to_list(proplists:get_value(snippet_column, Options, -1)), ", ",
+                       value_to_sql(Open), ", ", value_to_sql(Close), ", ",
+                       value_to_sql(proplists:get_value(ellipsis, Options, "...")), ", ",
+                       integer_to_list(proplists:get_value(snippet_tokens, Options, 16)),
+                       ") AS snippet"]
+              end,
+    ["SELECT rowid, ", Cols, ", ", Rank, " AS rank", Snippet, " FROM ", T,
+     " WHERE ", T, " MATCH ? ORDER BY rank LIMIT ? OFFSET ?;"].
+
+%%--------------------------------------------------------------------
+%% @doc
+%%    Generates an R*Tree virtual table create stmt in SQL. Dims lists
+%%    the `{MinCol, MaxCol}' coordinate columns of every dimension.
+%%
+%%    Options:
+%%    <dl>
+%%      <dt>int32</dt><dd>Store coordinates as 32-bit integers (rtree_i32)</dd>
+%%      <dt>{aux, [column_id()]}</dt><dd>Auxiliary (non-indexed) columns</dd>
+%%    </dl>
+%% @end
+%%--------------------------------------------------------------------
+-spec create_rtree_table_sql(table_id(), column_id(), [rtree_dim()], [rtree_option()]) -> iolist().
+create_rtree_table_sql(Tbl, IdCol, Dims, Options) ->
+    Module = case proplists:get_bool(int32, Options) of
+                 true  -> "rtree_i32";
+                 false -> "rtree"
+             end,
+    ["CREATE VIRTUAL TABLE ", to_iolist(Tbl), " USING ", Module, "(", to_iolist(IdCol),
+     [[", ", to_iolist(Min), ", ", to_iolist(Max)] || {Min, Max} <- Dims],
+     [[", +", to_iolist(Col)] || Col <- proplists:get_value(aux, Options, [])], ");"].
+
+%%--------------------------------------------------------------------
+%% @doc
+%%    Creates a query returning the entries of R*Tree Tbl whose boxes
+%%    overlap the query box. The parameters are the low and high bound
+%%    of each dimension in Dims, in order.
+%% @end
+%%--------------------------------------------------------------------
+-spec rtree_bbox_sql(table_id(), [rtree_dim()]) -> iolist().
+rtree_bbox_sql(Tbl, Dims) ->
+    ["SELECT * FROM ", to_iolist(Tbl), " WHERE ",
+     map_intersperse(fun({Min, Max}) -> [to_iolist(Max), " >= ? AND ", to_iolist(Min), " <= ?"] end,
+                     Dims, " AND "), ";"].
+
+%%--------------------------------------------------------------------
+%% @doc
+%%    Creates a query returning the entries of R*Tree Tbl whose centers
+%%    lie within a radius of a point, nearest first, with their squared
+%%    distance as the last `distance_sq' column. The parameters are the
+%%    point coordinates for each dimension in Dims followed by the
+%%    radius and the limit. Only the box around the point is searched,
+%%    so the lookup goes through the R*Tree index.
+%% @end
+%%--------------------------------------------------------------------
+-spec rtree_nearest_sql(table_id(), [rtree_dim()]) -> iolist().
+rtree_nearest_sql(Tbl, Dims) ->
+    N = length(Dims),
+    Radius = ["?", integer_to_list(N + 1)],
+    Limit = ["?", integer_to_list(N + 2)],
+    Numbered = lists:zip(lists:seq(1, N), Dims),
+    Distance = map_intersperse(
+                 fun({I, {Min, Max}}) ->
+                         D = ["((", to_iolist(Min), " + ", to_iolist(Max), ") / 2.0 - ?",
+                              integer_to_list(I), ")"],
+                         [D, " * ", D]
+                 end, Numbered, " + "),
+    Box = map_intersperse(
+            fun({I, {Min, Max}}) ->
+                    P = ["?", integer_to_list(I)],
+                    [to_iolist(Max), " >= ", P, " - ", Radius, " AND ",
+                     to_iolist(Min), " <= ", P, " + ", Radius]
+            end, Numbered, " AND "),
+    ["SELECT * FROM (SELECT *, ", Distance, " AS distance_sq FROM ", to_iolist(Tbl),
+     " WHERE ", Box, ") WHERE distance_sq <= ", Radius, " * ", Radius,
+     " ORDER BY distance_sq LIMIT ", Limit, ";"].
+
 %%--------------------------------------------------------------------
 %% @doc Describe table structure
 %% @end
@@ -398,6 +602,16 @@ table_constraint_sql(TableConstraint) ->
             map_intersperse(fun table_constraint_sql/1, TableConstraint, ", ")
     end.
 
+fts_column_sql({Name, unindexed}) -> [to_iolist(Name), " UNINDEXED"];
+fts_column_sql(Name)              -> to_iolist(Name).
+
+fts_option_sql({tokenize, Tokenizer})  -> ["tokenize = ", value_to_sql(Tokenizer)];
+fts_option_sql({prefix, Lengths})      -> ["prefix = '", string:join([integer_to_list(L) || L <- Lengths], " "), "'"];
+fts_option_sql({content, Table})       -> ["content = ", value_to_sql(to_iolist(Table))];
+fts_option_sql({content_rowid, Col})   -> ["content_rowid = ", value_to_sql(to_iolist(Col))];
+fts_option_sql({detail, Detail}) when Detail == full; Detail == column; Detail == none ->
+    ["detail = ", atom_to_list(Detail)].
+
 indexed_column_sql({ColumnName, asc})  -> [atom_to_list(ColumnName), " ASC"];
 indexed_column_sql({ColumnName, desc}) -> [atom_to_list(ColumnName), " DESC"];
 indexed_column_sql(ColumnName)         -> atom_to_list(ColumnName).
@@ -514,6 +728,66 @@ delete_sql_test() ->
         "DELETE FROM user WHERE id = 1;",
         delete_sql(user, [{"id", 1}])).
 
+write_params_sql_test() ->
+    ?assertFlat(
+        "INSERT INTO user (id, name) values (?, ?);",
+        write_params_sql(user, [id, name])).
+
+update_params_sql_test() ->
+    ?assertFlat(
+        "UPDATE user SET name = ?, age = ? WHERE id = ? AND org = ?;",
+        update_params_sql(user, [id, "org"], [name, <<"age">>])).
+
+upsert_params_sql_test() ->
+    ?assertFlat(
+        "INSERT INTO user (id, name, age) values (?, ?, ?) ON CONFLICT (id) DO UPDATE SET "
+        "name = excluded.name, age = excluded.age WHERE name IS NOT excluded.name OR "
+        "age IS NOT excluded.age;",
+        upsert_params_sql(user, [id], [id, name, age])),
+    ?assertFlat(
+        "INSERT INTO tag (a, b) values (?, ?) ON CONFLICT (a, b) DO NOTHING;",
+        upsert_params_sql(tag, [a, b], [a, b])).
+
+fts_sql_test() ->
+    ?assertFlat(
+        "CREATE VIRTUAL TABLE docs USING fts5(title, body, lang UNINDEXED, "
+        "tokenize = 'porter unicode61', prefix = '2 3');",
+        create_fts_table_sql(docs, [title, body, {lang, unindexed}],
+                             [{tokenize, "porter unicode61"}, {prefix, [2, 3]}])),
+    ?assertFlat(
+        "INSERT INTO docs(docs, rank) VALUES ('automerge', 8);",
+        fts_config_sql(docs, automerge, 8)),
+    ?assertFlat(
+        "SELECT k, v FROM docs_config WHERE k IN ('automerge', 'crisismerge');",
+        fts_config_get_sql(docs, [automerge, crisismerge])),
+    ?assertFlat(
+        "INSERT INTO docs(docs) VALUES ('optimize');",
+        fts_command_sql(docs, optimize)),
+    ?assertFlat(
+        "SELECT rowid, *, bm25(docs) AS rank, snippet(docs, -1, '[', ']', '...', 16) AS snippet "
+        "FROM docs WHERE docs MATCH ? ORDER BY rank LIMIT ? OFFSET ?;",
+        fts_search_sql(docs, [])),
+    ?assertFlat(
+        "SELECT rowid, title, bm25(docs, 10, 1) AS rank "
+        "FROM docs WHERE docs MATCH ? ORDER BY rank LIMIT ? OFFSET ?;",
+        fts_search_sql(docs, [{columns, [title]}, {weights, [10, 1]}, {snippet, false}])).
+
+rtree_sql_test() ->
+    ?assertFlat(
+        "CREATE VIRTUAL TABLE geo USING rtree(id, min_x, max_x, min_y, max_y, +name);",
+        create_rtree_table_sql(geo, id, [{min_x, max_x}, {min_y, max_y}], [{aux, [name]}])),
+    ?assertFlat(
+        "CREATE VIRTUAL TABLE geo USING rtree_i32(id, x0, x1);",
+        create_rtree_table_sql(geo, id, [{x0, x1}], [int32])),
+    ?assertFlat(
+        "SELECT * FROM geo WHERE max_x >= ? AND min_x <= ? AND max_y >= ? AND min_y <= ?;",
+        rtree_bbox_sql(geo, [{min_x, max_x}, {min_y, max_y}])),
+    ?assertFlat(
+        "SELECT * FROM (SELECT *, ((x0 + x1) / 2.0 - ?1) * ((x0 + x1) / 2.0 - ?1) AS distance_sq "
+        "FROM geo WHERE x1 >= ?1 - ?2 AND x0 <= ?1 + ?2) WHERE distance_sq <= ?2 * ?2 "
+        "ORDER BY distance_sq LIMIT ?3;",
+        rtree_nearest_sql(geo, [{x0, x1}])).
+
 drop_table_sql_test() ->
     ?assertFlat(
         "DROP TABLE user;",
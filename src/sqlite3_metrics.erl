@@ -0,0 +1,149 @@
+%%%-------------------------------------------------------------------
+%%% File    : sqlite3_metrics.erl
+%%% @doc Request latency metrics of a sqlite3 connection
+%%%
+%%% A connection opened with the `instrument' option times every request
+%%% it gets: how long the request waited in the mailbox of the connection
+%%% (from the call to the start of handle_call) and how long handling it
+%%% took, which is mostly waiting for the driver. Both are counted in
+%%% histograms per request name (`sql_exec', `write', `next', ...) with
+%%% power of two microsecond buckets, together with the deepest mailbox
+%%% seen.
+%%%
+%%% Every process subscribed with sqlite3:subscribe_metrics/2 also gets a
+%%% `{sqlite3_request, Db, Name, QueueUs, ExecUs, QueueLen}' message per
+%%% request, where QueueLen is the number of messages left behind in the
+%%% mailbox and QueueUs is `undefined' for requests from other nodes.
+%%% @end
+%%%-------------------------------------------------------------------
+-module(sqlite3_metrics).
+
+-export([new/0, record/6, subscribe/2, unsubscribe/2, down/2, to_list/1]).
+
+%% bucket I counts times up to 2^(I-1) microseconds, the last one the rest
+-define(BUCKETS, 27).
+
+-record(request, {count = 0, queue_us = 0, exec_us = 0, max_queue_len = 0,
+                  queue_histogram = erlang:make_tuple(?BUCKETS, 0),
+                  exec_histogram = erlang:make_tuple(?BUCKETS, 0)}).
+-record(metrics, {requests = dict:new(), subscribers = []}).
+
+-opaque metrics() :: #metrics{}.
+-export_type([metrics/0]).
+
+-spec new() -> metrics().
+new() ->
+    #metrics{}.
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Records a request Name called at CalledAt and handled from
+%%   StartedAt to FinishedAt (all monotonic times in native units,
+%%   CalledAt is `undefined' when it isn't comparable) with QueueLen
+%%   messages waiting, and notifies the subscribers.
+%% @end
+%%--------------------------------------------------------------------
+-spec record(atom(), integer() | undefined, integer(), integer(), non_neg_integer(),
+             metrics()) -> metrics().
+record(Name, CalledAt, StartedAt, FinishedAt, QueueLen,
+       Metrics = #metrics{requests = Requests, subscribers = Subscribers}) ->
+    ExecUs = to_us(FinishedAt - StartedAt),
+    QueueUs = case CalledAt of
+                  undefined -> undefined;
+                  _         -> to_us(StartedAt - CalledAt)
+              end,
+    Request = case dict:find(Name, Requests) of
+                  {ok, Found} -> Found;
+                  error       -> #request{}
+              end,
+    [Pid ! {sqlite3_request, self(), Name, QueueUs, ExecUs, QueueLen} ||
+        {Pid, _} <- Subscribers],
+    Metrics#metrics{requests = dict:store(Name, add(QueueUs, ExecUs, QueueLen, Request),
+                                          Requests)}.
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Adds Pid to the subscribers, until it exits or unsubscribes.
+%% @end
+%%--------------------------------------------------------------------
+-spec subscribe(pid(), metrics()) -> metrics().
+subscribe(Pid, Metrics = #metrics{subscribers = Subscribers}) ->
+    case lists:keymember(Pid, 1, Subscribers) of
+        true ->
+            Metrics;
+        false ->
+            MRef = erlang:monitor(process, Pid),
+            Metrics#metrics{subscribers = [{Pid, MRef} | Subscribers]}
+    end.
+
+-spec unsubscribe(pid(), metrics()) -> metrics().
+unsubscribe(Pid, Metrics = #metrics{subscribers = Subscribers}) ->
+    case lists:keytake(Pid, 1, Subscribers) of
+        {value, {Pid, MRef}, Rest} ->
+            erlang:demonitor(MRef, [flush]),
+            Metrics#metrics{subscribers = Rest};
+        false ->
+            Metrics
+    end.
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Forgets the subscriber whose monitor MRef went down.
+%% @end
+%%--------------------------------------------------------------------
+-spec down(reference(), metrics()) -> metrics().
+down(MRef, Metrics = #metrics{subscribers = Subscribers}) ->
+    Metrics#metrics{subscribers = lists:keydelete(MRef, 2, Subscribers)}.
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Returns the metrics of every request name seen. Histograms list
+%%   `{UpToUs, Count}' for the non-empty buckets, the last bound is
+%%   `infinity'.
+%% @end
+%%--------------------------------------------------------------------
+-spec to_list(metrics()) -> [{atom(), [{atom(), term()}]}].
+to_list(#metrics{requests = Requests}) ->
+    [{Name, [{count, Count}, {queue_us, QueueUs}, {exec_us, ExecUs},
+             {max_queue_len, MaxQueueLen},
+             {queue_histogram, histogram_to_list(QueueHistogram)},
+             {exec_histogram, histogram_to_list(ExecHistogram)}]} ||
+        {Name, #request{count = Count, queue_us = QueueUs, exec_us = ExecUs,
+                        max_queue_len = MaxQueueLen, queue_histogram = QueueHistogram,
+                        exec_histogram = ExecHistogram}} <- lists:sort(dict:to_list(Requests))].
+
+%%--------------------------------------------------------------------
+%% Internal functions
+%%--------------------------------------------------------------------
+
+add(QueueUs, ExecUs, QueueLen, Request = #request{count = Count, exec_us = TotalExecUs,
+                                                  max_queue_len = MaxQueueLen,
+                                                  exec_histogram = ExecHistogram}) ->
+    Added = Request#request{count = Count + 1, exec_us = TotalExecUs + ExecUs,
+                            max_queue_len = max(QueueLen, MaxQueueLen),
+                            exec_histogram = increment(ExecUs, ExecHistogram)},
+    case QueueUs of
+        undefined ->
+            Added;
+        _ ->
+            Added#request{queue_us = Request#request.queue_us + QueueUs,
+                          queue_histogram = increment(QueueUs, Request#request.queue_histogram)}
+    end.
+
+increment(Us, Histogram) ->
+    I = bucket(Us, 1),
+    setelement(I, Histogram, element(I, Histogram) + 1).
+
+bucket(Us, I) when I =:= ?BUCKETS; Us =< 1 bsl (I - 1) -> I;
+bucket(Us, I) -> bucket(Us, I + 1).
+
+histogram_to_list(Histogram) ->
+    [{bound(I), Count} || {I, Count} <- lists:zip(lists:seq(1, ?BUCKETS),
+                                                  tuple_to_list(Histogram)),
+                          Count > 0].
+
+bound(?BUCKETS) -> infinity;
+bound(I)        -> 1 bsl (I - 1).
+
+to_us(Native) ->
+    erlang:convert_time_unit(Native, native, microsecond).
@@ -0,0 +1,275 @@
+%%%-------------------------------------------------------------------
+%%% File    : sqlite3_partition.erl
+%%% @doc Tables partitioned by time into attached database files
+%%%
+%%% A partitioned table keeps the rows of every period (a day by
+%%% default) in its own database file `Table-Start.db' in a directory,
+%%% where Start is the Unix time the period starts at, taken from the
+%%% integer time column of the rows. Partitions are attached to the
+%%% connection as `Table_Start' when written or read. Expiring old rows
+%%% detaches and deletes whole files instead of deleting rows, which
+%%% would leave free pages behind.
+%%%
+%%% A connection can have at most 10 databases attached (the SQLite
+%%% default of SQLITE_MAX_ATTACHED), so a partition written to stays
+%%% attached until another one of the table is written to or it expires,
+%%% while read/4 reads the partitions in groups which fit into the free
+%%% attachments and detaches those it attached itself. Attaching and
+%%% detaching isn't possible inside a transaction.
+%%% @end
+%%%-------------------------------------------------------------------
+-module(sqlite3_partition).
+
+-include("sqlite3.hrl").
+
+-export([new/3, write/3, read/4, partitions/1, expire/3]).
+
+-record(partitioning, {table, columns, dir, period, time_column}).
+
+%% SQLITE_MAX_ATTACHED
+-define(MAX_ATTACHED, 10).
+
+-opaque partitioning() :: #partitioning{}.
+-type db() :: atom() | pid().
+-type option() :: {dir, file:filename()} | {period, day | hour | pos_integer()} |
+                  {time_column, column_id()}.
+
+-export_type([partitioning/0]).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Describes Table, created with Columns (as for sqlite3:create_table/3)
+%%   in every partition. Options:
+%%   <dl>
+%%     <dt>{dir, Dir}</dt><dd>Directory of the partition files (default
+%%          the working directory)</dd>
+%%     <dt>{period, day | hour | Seconds}</dt><dd>Time covered by a
+%%          partition (default day)</dd>
+%%     <dt>{time_column, Column}</dt><dd>Column of the Unix time rows
+%%          are partitioned by (default `time')</dd>
+%%   </dl>
+%% @end
+%%--------------------------------------------------------------------
+-spec new(atom() | string(), table_info(), [option()]) -> partitioning().
+new(Table, Columns, Options) ->
+    Period = case proplists:get_value(period, Options, day) of
+                 day  -> 86400;
+                 hour -> 3600;
+                 N when is_integer(N), N > 0 -> N
+             end,
+    #partitioning{table = to_list(Table), columns = Columns,
+                  dir = proplists:get_value(dir, Options, "."), period = Period,
+                  time_column = proplists:get_value(time_column, Options, time)}.
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Inserts Row into the partition of its time column, creating the
+%%   partition if it doesn't exist yet. The partition of the table
+%%   attached by an earlier write is detached when another one is
+%%   attached, whichever order the times come in.
+%% @end
+%%--------------------------------------------------------------------
+-spec write(db(), partitioning(), [{column_id(), sql_value()}]) ->
+          sql_non_query_result().
+write(Db, P = #partitioning{time_column = TimeColumn}, Row) ->
+    case proplists:get_value(TimeColumn, Row) of
+        Time when is_integer(Time) ->
+            Start = period_start(P, Time),
+            Attached = attached(Db),
+            Result = case lists:member(schema(P, Start), Attached) of
+                         true ->
+                             {ok, false};
+                         false ->
+                             detach_others(Db, P, Start, Attached),
+                             attach(Db, P, Start, true)
+                     end,
+            case Result of
+                {ok, _} -> sqlite3:write(Db, qualified_table(P, Start), Row);
+                Error   -> Error
+            end;
+        _ ->
+            {error, {bad_time, TimeColumn}}
+    end.
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Returns the rows with From =&lt; time &lt; To from the partitions
+%%   covering that range, read as UNION ALL queries over as many of them
+%%   as can be attached at once.
+%% @end
+%%--------------------------------------------------------------------
+-spec read(db(), partitioning(), integer(), integer()) -> sql_result().
+read(Db, P = #partitioning{period = Period, time_column = TimeColumn}, From, To) ->
+    Starts = [Start || {Start, _File} <- partitions(P), Start + Period > From, Start < To],
+    Attached = attached(Db),
+    % at least one, so attaching fails with the SQLite error when none is free
+    Free = max(?MAX_ATTACHED - length([S || S <- Attached, S =/= "main", S =/= "temp"]), 1),
+    read_groups(Db, P, Starts, Attached, Free, to_list(TimeColumn), From, To, []).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Lists the partition files, oldest first, with the time they start at.
+%% @end
+%%--------------------------------------------------------------------
+-spec partitions(partitioning()) -> [{integer(), file:filename()}].
+partitions(#partitioning{table = Table, dir = Dir}) ->
+    lists:sort([{list_to_integer(Start), filename:join(Dir, File)} ||
+                   File <- filelib:wildcard(Table ++ "-*.db", Dir),
+                   {match, [Start]} <- [re:run(File, "-(-?[0-9]+)\\.db$",
+                                               [{capture, all_but_first, list}])]]).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Removes the partitions holding only rows older than Before,
+%%   detaching them first, and returns their files.
+%% @end
+%%--------------------------------------------------------------------
+-spec expire(db(), partitioning(), integer()) ->
+          {ok, [file:filename()]} | sqlite_error().
+expire(Db, P = #partitioning{period = Period}, Before) ->
+    Attached = attached(Db),
+    Expired = [Partition || Partition = {Start, _File} <- partitions(P),
+                            Start + Period =< Before],
+    expire_partitions(Db, P, Expired, Attached, []).
+
+%%--------------------------------------------------------------------
+%% Internal functions
+%%--------------------------------------------------------------------
+
+expire_partitions(_Db, _P, [], _Attached, Files) ->
+    {ok, lists:reverse(Files)};
+expire_partitions(Db, P, [{Start, File} | Rest], Attached, Files) ->
+    Schema = schema(P, Start),
+    Detached = case lists:member(Schema, Attached) of
+                   true  -> sqlite3:sql_exec(Db, ["DETACH DATABASE ", Schema, ";"]);
+                   false -> ok
+               end,
+    case Detached of
+        ok ->
+            [file:delete(F) || F <- [File, File ++ "-wal", File ++ "-shm", File ++ "-journal"]],
+            expire_partitions(Db, P, Rest, Attached, [File | Files]);
+        Error ->
+            Error
+    end.
+
+%% reads the partitions in Starts in order, in groups with at most Free
+%% partitions which aren't Attached
+read_groups(Db, P, Starts, Attached, Free, TimeColumn, From, To, Rows) ->
+    {Group, ToAttach, Rest} = group(P, Starts, Attached, Free, [], []),
+    case read_group(Db, P, Group, ToAttach, TimeColumn, From, To) of
+        [{columns, Columns}, {rows, GroupRows}] when Rest =:= [] ->
+            [{columns, Columns}, {rows, lists:append(lists:reverse([GroupRows | Rows]))}];
+        [{columns, _}, {rows, GroupRows}] ->
+            read_groups(Db, P, Rest, Attached, Free, TimeColumn, From, To, [GroupRows | Rows]);
+        Error ->
+            Error
+    end.
+
+group(_P, [], _Attached, _Free, Group, ToAttach) ->
+    {lists:reverse(Group), ToAttach, []};
+group(P, [Start | Rest] = Starts, Attached, Free, Group, ToAttach) ->
+    case lists:member(schema(P, Start), Attached) of
+        true ->
+            group(P, Rest, Attached, Free, [Start | Group], ToAttach);
+        false when length(ToAttach) < Free ->
+            group(P, Rest, Attached, Free, [Start | Group], [Start | ToAttach]);
+        false ->
+            {lists:reverse(Group), ToAttach, Starts}
+    end.
+
+read_group(Db, P, Starts, ToAttach, TimeColumn, From, To) ->
+    case attach_all(Db, P, ToAttach, []) of
+        {ok, Attached} ->
+            try
+                select(Db, P, Starts, TimeColumn, From, To)
+            after
+                [sqlite3:sql_exec(Db, ["DETACH DATABASE ", schema(P, Start), ";"]) ||
+                    Start <- Attached]
+            end;
+        Error ->
+            Error
+    end.
+
+%% detaches the partitions other than Start which writes left attached
+detach_others(Db, P, Start, Attached) ->
+    [sqlite3:sql_exec(Db, ["DETACH DATABASE ", schema(P, S), ";"]) ||
+        {S, _File} <- partitions(P), S =/= Start, lists:member(schema(P, S), Attached)],
+    ok.
+
+%% attaches the partitions in Starts which aren't, returns those it did
+attach_all(_Db, _P, [], Attached) ->
+    {ok, Attached};
+attach_all(Db, P, [Start | Rest], Attached) ->
+    case attach(Db, P, Start, false) of
+        {ok, true} ->
+            attach_all(Db, P, Rest, [Start | Attached]);
+        {ok, false} ->
+            attach_all(Db, P, Rest, Attached);
+        Error ->
+            [sqlite3:sql_exec(Db, ["DETACH DATABASE ", schema(P, S), ";"]) || S <- Attached],
+            Error
+    end.
+
+%% {ok, true} if the partition had to be attached
+attach(Db, P = #partitioning{table = Table, columns = Columns}, Start, Create) ->
+    Schema = schema(P, Start),
+    case lists:member(Schema, attached(Db)) of
+        true ->
+            {ok, false};
+        false ->
+            case sqlite3:sql_exec(Db, ["ATTACH DATABASE ? AS ", Schema, ";"],
+                                  [file_name(P, Start)]) of
+                ok when Create ->
+                    case sqlite3:sql_exec(Db, ["SELECT count(*) FROM ", Schema, ".sqlite_master "
+                                               "WHERE type = 'table' AND name = ?;"], [Table]) of
+                        [{columns, _}, {rows, [{0}]}] ->
+                            case sqlite3:sql_exec(Db, sqlite3_lib:create_table_sql(
+                                                        qualified_table(P, Start), Columns)) of
+                                ok    -> {ok, true};
+                                Error -> Error
+                            end;
+                        [{columns, _}, {rows, [{1}]}] ->
+                            {ok, true};
+                        Error ->
+                            Error
+                    end;
+                ok ->
+                    {ok, true};
+                Error ->
+                    Error
+            end
+    end.
+
+%% schema names of the attached databases
+attached(Db) ->
+    case sqlite3:sql_exec(Db, "PRAGMA database_list;") of
+        [{columns, _}, {rows, Rows}] -> [binary_to_list(Name) || {_Seq, Name, _File} <- Rows];
+        _                            -> []
+    end.
+
+select(_Db, #partitioning{columns = Columns}, [], _TimeColumn, _From, _To) ->
+    [{columns, [to_list(element(1, C)) || C <- Columns]}, {rows, []}];
+select(Db, P, Starts, TimeColumn, From, To) ->
+    Selects = [["SELECT * FROM ", qualified_table(P, Start),
+                " WHERE ", TimeColumn, " >= ?1 AND ", TimeColumn, " < ?2"] || Start <- Starts],
+    sqlite3:sql_exec(Db, [string:join(Selects, " UNION ALL "), ";"], [From, To]).
+
+%% rounded down, also for times before 1970
+period_start(#partitioning{period = Period}, Time) ->
+    Time - ((Time rem Period) + Period) rem Period.
+
+qualified_table(P = #partitioning{table = Table}, Start) ->
+    schema(P, Start) ++ "." ++ Table.
+
+schema(#partitioning{table = Table}, Start) ->
+    Table ++ "_" ++ partition_id(Start).
+
+file_name(#partitioning{table = Table, dir = Dir}, Start) ->
+    filename:join(Dir, Table ++ "-" ++ integer_to_list(Start) ++ ".db").
+
+%% schema names can't have a minus sign
+partition_id(Start) when Start < 0 -> "m" ++ integer_to_list(-Start);
+partition_id(Start)                -> integer_to_list(Start).
+
+to_list(A) when is_atom(A) -> atom_to_list(A);
+to_list(L) when is_list(L) -> L.
@@ -0,0 +1,179 @@
+%%%-------------------------------------------------------------------
+%%% File    : sqlite3_pool.erl
+%%% @doc Pool of idle sqlite3 connections for short-lived users
+%%%
+%%% Opening a connection costs a port, sqlite3_open_v2() and parsing the
+%%% schema on first use. A process that needs a connection only for a
+%%% request can check one out instead and check it back in when done:
+%%% checked in connections are recycled (see sqlite3:recycle/1) and kept
+%%% idle per database file and open options, up to `max_idle' of each,
+%%% for the next checkout. Connections whose user exits without checking
+%%% them in are closed.
+%%% @end
+%%%-------------------------------------------------------------------
+-module(sqlite3_pool).
+
+-behaviour(gen_server).
+
+-export([start_link/0, start_link/1, stop/0, checkout/2, checkin/1, info/0]).
+-export([init/1, handle_call/3, handle_cast/2, handle_info/2,
+         terminate/2, code_change/3]).
+
+-define(SERVER, ?MODULE).
+-define(DEFAULT_MAX_IDLE, 8).
+
+%% idle: {File, Options} -> [Db], busy: Db -> {{File, Options}, MRef}
+-record(state, {idle = dict:new(), busy = dict:new(), max_idle}).
+
+%%====================================================================
+%% API
+%%====================================================================
+
+-spec start_link() -> {ok, pid()} | {error, term()}.
+start_link() ->
+    start_link([]).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Starts the pool, registered as `sqlite3_pool'. The only option is
+%%   `{max_idle, N}', the number of idle connections kept per database
+%%   file and open options (default 8).
+%% @end
+%%--------------------------------------------------------------------
+-spec start_link([{max_idle, non_neg_integer()}]) -> {ok, pid()} | {error, term()}.
+start_link(Options) ->
+    gen_server:start_link({local, ?SERVER}, ?MODULE, Options, []).
+
+-spec stop() -> ok.
+stop() ->
+    gen_server:call(?SERVER, stop).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Returns an idle connection to File opened with Options (as for
+%%   sqlite3:open/2, without `file') or opens a new one. The connection
+%%   belongs to the caller until checkin/1.
+%% @end
+%%--------------------------------------------------------------------
+-spec checkout(string(), [term()]) -> {ok, pid()} | {error, term()}.
+checkout(File, Options) ->
+    gen_server:call(?SERVER, {checkout, {File, lists:sort(Options)}, self()}, infinity).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Recycles Db, checked out before, and gives it back to the pool.
+%% @end
+%%--------------------------------------------------------------------
+-spec checkin(pid()) -> ok.
+checkin(Db) ->
+    Recycled = sqlite3:recycle(Db) =:= ok,
+    gen_server:call(?SERVER, {checkin, Db, Recycled}).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Returns the number of idle and checked out connections.
+%% @end
+%%--------------------------------------------------------------------
+-spec info() -> [{idle | busy, non_neg_integer()}].
+info() ->
+    gen_server:call(?SERVER, info).
+
+%%====================================================================
+%% gen_server callbacks
+%%====================================================================
+
+%% @hidden
+init(Options) ->
+    process_flag(trap_exit, true),
+    {ok, #state{max_idle = proplists:get_value(max_idle, Options, ?DEFAULT_MAX_IDLE)}}.
+
+%% @hidden
+handle_call({checkout, Key, Pid}, _From, State = #state{idle = Idle, busy = Busy}) ->
+    Found = case dict:find(Key, Idle) of
+                {ok, [Db | Rest]} -> {ok, Db, dict:store(Key, Rest, Idle)};
+                _                 -> open(Key, Idle)
+            end,
+    case Found of
+        {ok, Db1, Idle1} ->
+            MRef = erlang:monitor(process, Pid),
+            {reply, {ok, Db1}, State#state{idle = Idle1,
+                                           busy = dict:store(Db1, {Key, MRef}, Busy)}};
+        Error ->
+            {reply, Error, State}
+    end;
+handle_call({checkin, Db, Recycled}, _From,
+            State = #state{idle = Idle, busy = Busy, max_idle = MaxIdle}) ->
+    case dict:find(Db, Busy) of
+        {ok, {Key, MRef}} ->
+            erlang:demonitor(MRef, [flush]),
+            Dbs = case dict:find(Key, Idle) of
+                      {ok, Found} -> Found;
+                      error       -> []
+                  end,
+            Idle1 = case Recycled andalso length(Dbs) < MaxIdle of
+                        true ->
+                            dict:store(Key, [Db | Dbs], Idle);
+                        false ->
+                            close(Db),
+                            Idle
+                    end,
+            {reply, ok, State#state{idle = Idle1, busy = dict:erase(Db, Busy)}};
+        error ->
+            {reply, ok, State}
+    end;
+handle_call(info, _From, State = #state{idle = Idle, busy = Busy}) ->
+    IdleCount = dict:fold(fun(_Key, Dbs, Count) -> Count + length(Dbs) end, 0, Idle),
+    {reply, [{idle, IdleCount}, {busy, dict:size(Busy)}], State};
+handle_call(stop, _From, State) ->
+    {stop, normal, ok, State};
+handle_call(_Request, _From, State) ->
+    {reply, unknown_request, State}.
+
+%% @hidden
+handle_cast(_Msg, State) ->
+    {noreply, State}.
+
+%% @hidden
+handle_info({'DOWN', MRef, process, _Pid, _Reason}, State = #state{busy = Busy}) ->
+    %% the user may have left it in any state
+    Busy1 = dict:filter(fun(Db, {_Key, Ref}) when Ref =:= MRef ->
+                                close(Db),
+                                false;
+                           (_Db, _) ->
+                                true
+                        end, Busy),
+    {noreply, State#state{busy = Busy1}};
+handle_info({'EXIT', Db, _Reason}, State = #state{idle = Idle, busy = Busy}) ->
+    Idle1 = dict:map(fun(_Key, Dbs) -> lists:delete(Db, Dbs) end, Idle),
+    case dict:find(Db, Busy) of
+        {ok, {_Key, MRef}} -> erlang:demonitor(MRef, [flush]);
+        error              -> ok
+    end,
+    {noreply, State#state{idle = Idle1, busy = dict:erase(Db, Busy)}};
+handle_info(_Info, State) ->
+    {noreply, State}.
+
+%% @hidden
+terminate(_Reason, #state{idle = Idle, busy = Busy}) ->
+    [sqlite3:close(Db) || {_Key, Dbs} <- dict:to_list(Idle), Db <- Dbs],
+    [sqlite3:close(Db) || Db <- dict:fetch_keys(Busy)],
+    ok.
+
+%% @hidden
+code_change(_OldVsn, State, _Extra) ->
+    {ok, State}.
+
+%%--------------------------------------------------------------------
+%% Internal functions
+%%--------------------------------------------------------------------
+
+%% the connection is linked to the pool
+open({File, Options}, Idle) ->
+    case sqlite3:open(anonymous, [{file, File} | Options]) of
+        {ok, Db} -> {ok, Db, Idle};
+        Error    -> Error
+    end.
+
+%% closing can checkpoint the WAL for a while, the pool doesn't wait
+close(Db) ->
+    spawn(fun() -> sqlite3:close(Db) end).
@@ -0,0 +1,110 @@
+%%%-------------------------------------------------------------------
+%%% File    : sqlite3_query_pt.erl
+%%% @doc Parse transform compiling declared queries into functions
+%%%
+%%% A module compiled with `-compile({parse_transform, sqlite3_query_pt})'
+%%% can declare queries as attributes:
+%%%
+%%% ```
+%%% -sqlite3_query({user_by_age, "SELECT name FROM user WHERE age > ?", [age]}).
+%%% -sqlite3_query({insert_user, {write, user, [name, age]}}).
+%%% -sqlite3_query({set_age, {update, user, [id], [age]}}).
+%%% '''
+%%%
+%%% Each one becomes a function of the database and one argument per
+%%% parameter, in order, e.g. `user_by_age(Db, Age)' and
+%%% `set_age(Db, Age, Id)' (the new values come before the keys). The
+%%% SQL, built by sqlite3_lib for `write' and `update', is encoded into a
+%%% binary at compile time in the format the driver expects for
+%%% sqlite3:sql_exec/3, so a call only encodes the parameter values. The
+%%% functions aren't exported unless the module does it.
+%%% @end
+%%%-------------------------------------------------------------------
+-module(sqlite3_query_pt).
+
+-export([parse_transform/2, format_error/1]).
+
+-define(DB_VAR, 'Sqlite3Db').
+
+parse_transform(Forms, _Options) ->
+    File = case [F || {attribute, _, file, {F, _}} <- Forms] of
+               [F | _] -> F;
+               []      -> ""
+           end,
+    {Functions, Errors} =
+        lists:foldr(fun({attribute, Line, sqlite3_query, Query}, {Fs, Es}) ->
+                            try
+                                {[query_function(Line, Query) | Fs], Es}
+                            catch throw:Reason ->
+                                {Fs, [{Line, ?MODULE, Reason} | Es]}
+                            end;
+                       (_, Acc) ->
+                            Acc
+                    end, {[], []}, Forms),
+    case Errors of
+        [] ->
+            {Before, Eof} = lists:splitwith(fun({eof, _}) -> false;
+                                               (_)        -> true
+                                            end, Forms),
+            Before ++ Functions ++ Eof;
+        _ ->
+            {error, [{File, Errors}], []}
+    end.
+
+format_error({bad_query, Query}) ->
+    io_lib:format("bad sqlite3_query ~p, expected {Name, SQL, Params}, "
+                  "{Name, {write, Table, Columns}} or {Name, {update, Table, Keys, Columns}}",
+                  [Query]);
+format_error({bad_sql, Name}) ->
+    io_lib:format("the SQL of sqlite3_query ~p isn't a string", [Name]).
+
+%%--------------------------------------------------------------------
+%% Internal functions
+%%--------------------------------------------------------------------
+
+query_function(Line, {Name, {write, Table, Columns}}) when is_atom(Name), is_list(Columns) ->
+    query_function(Line, Name, sqlite3_lib:write_params_sql(Table, Columns), Columns);
+query_function(Line, {Name, {update, Table, [_|_] = Keys, [_|_] = Columns}})
+  when is_atom(Name), is_list(Keys), is_list(Columns) ->
+    query_function(Line, Name, sqlite3_lib:update_params_sql(Table, Keys, Columns),
+                   Columns ++ Keys);
+query_function(Line, {Name, SQL, Params}) when is_atom(Name), is_list(Params) ->
+    query_function(Line, Name, SQL, Params);
+query_function(_Line, Query) ->
+    throw({bad_query, Query}).
+
+query_function(Line, Name, SQL, Params) ->
+    SQLBin = try iolist_to_binary(SQL)
+             catch error:badarg -> throw({bad_sql, Name})
+             end,
+    Vars = [{var, Line, param_var(Param, I)} ||
+               {Param, I} <- lists:zip(Params, lists:seq(1, length(Params)))],
+    ParamList = lists:foldr(fun(Var, Acc) -> {cons, Line, Var, Acc} end, {nil, Line}, Vars),
+    Call = {call, Line, {remote, Line, {atom, Line, sqlite3}, {atom, Line, exec_compiled}},
+            [{var, Line, ?DB_VAR}, erl_parse:abstract(encoded_prefix(SQLBin), Line), ParamList]},
+    {function, Line, Name, length(Vars) + 1,
+     [{clause, Line, [{var, Line, ?DB_VAR} | Vars], [], [Call]}]}.
+
+%% term_to_binary({SQL, Params}) is the prefix followed by the encoded
+%% Params without its version byte, see sqlite3:exec_compiled/3
+encoded_prefix(SQLBin) ->
+    Encoded = term_to_binary({SQLBin, []}),
+    binary_part(Encoded, 0, byte_size(Encoded) - 1).
+
+%% age -> 'Age', named parameters like ':age' -> 'Age' too
+param_var(Param, I) ->
+    Chars = [C || C <- to_list(Param), (C >= $a andalso C =< $z) orelse (C >= $A andalso C =< $Z)
+                                           orelse (C >= $0 andalso C =< $9) orelse C =:= $_],
+    case Chars of
+        [C | Rest] when C >= $a, C =< $z -> list_to_atom([C - $a + $A | Rest] ++ suffix(I));
+        [C | _] = Name when C >= $A, C =< $Z -> list_to_atom(Name ++ suffix(I));
+        _ -> list_to_atom("Param" ++ integer_to_list(I))
+    end.
+
+%% keeps variables of parameters with the same name apart
+suffix(I) ->
+    "_" ++ integer_to_list(I).
+
+to_list(A) when is_atom(A)   -> atom_to_list(A);
+to_list(B) when is_binary(B) -> binary_to_list(B);
+to_list(L) when is_list(L)   -> L.
@@ -0,0 +1,175 @@
+%%%-------------------------------------------------------------------
+%%% File    : sqlite3_queue.erl
+%%% @doc Durable job queues in a table
+%%%
+%%% A queue is a table of jobs with a binary payload, the time they
+%%% become visible and the lease of their last claim. claim/4 leases up
+%%% to N visible jobs for a visibility timeout inside BEGIN IMMEDIATE, so
+%%% concurrent consumers never get the same job; jobs that aren't
+%%% acknowledged with ack/3 before their lease runs out become visible
+%%% again. Enqueueing, claiming and acknowledging go through named
+%%% queries (see sqlite3:register_queries/2) prepared by install/2.
+%%% @end
+%%%-------------------------------------------------------------------
+-module(sqlite3_queue).
+
+-include("sqlite3.hrl").
+
+-export([install/2, enqueue/3, enqueue/4, enqueue_many/3, claim/4, ack/3]).
+
+-type db() :: atom() | pid().
+-type job() :: {Id :: integer(), Lease :: integer(), Payload :: binary()}.
+
+-export_type([job/0]).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Creates the table of Queue unless it exists and registers its
+%%   queries on the connection Db.
+%% @end
+%%--------------------------------------------------------------------
+-spec install(db(), atom()) -> ok | sqlite_error().
+install(Db, Queue) ->
+    Table = atom_to_list(Queue),
+    Script = ["CREATE TABLE IF NOT EXISTS ", Table, " (id INTEGER PRIMARY KEY, "
+              "payload BLOB NOT NULL, visible_at INTEGER NOT NULL, "
+              "lease INTEGER NOT NULL DEFAULT 0, attempts INTEGER NOT NULL DEFAULT 0);"
+              "CREATE INDEX IF NOT EXISTS ", Table, "_visible_at ON ", Table, " (visible_at);"
+              "CREATE INDEX IF NOT EXISTS ", Table, "_lease ON ", Table, " (lease);"],
+    case first_error(sqlite3:sql_exec_script(Db, Script)) of
+        none ->
+            sqlite3:register_queries(
+              Db, [{query_name(Queue, enqueue),
+                    ["INSERT INTO ", Table, " (payload, visible_at) VALUES (?, ?);"]},
+                   {query_name(Queue, claim),
+                    ["UPDATE ", Table, " SET lease = ?1, visible_at = ?2, attempts = attempts + 1 "
+                     "WHERE id IN (SELECT id FROM ", Table, " WHERE visible_at <= ?3 "
+                     "ORDER BY visible_at, id LIMIT ?4);"]},
+                   {query_name(Queue, claimed),
+                    ["SELECT id, lease, payload FROM ", Table, " WHERE lease = ? ORDER BY id;"]},
+                   {query_name(Queue, ack),
+                    ["DELETE FROM ", Table, " WHERE id = ? AND lease = ?;"]}]);
+        Error ->
+            Error
+    end.
+
+-spec enqueue(db(), atom(), binary()) -> {ok, integer()} | sqlite_error().
+enqueue(Db, Queue, Payload) ->
+    enqueue(Db, Queue, Payload, 0).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Adds a job with Payload to Queue, visible after DelayMs, and
+%%   returns its id.
+%% @end
+%%--------------------------------------------------------------------
+-spec enqueue(db(), atom(), binary(), non_neg_integer()) -> {ok, integer()} | sqlite_error().
+enqueue(Db, Queue, Payload, DelayMs) ->
+    case sqlite3:q(Db, query_name(Queue, enqueue), [{blob, Payload}, now_ms() + DelayMs]) of
+        {rowid, Id} -> {ok, Id};
+        Error       -> Error
+    end.
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Adds a job for every payload, see sqlite3:bulk_insert/3.
+%% @end
+%%--------------------------------------------------------------------
+-spec enqueue_many(db(), atom(), [binary()]) -> {ok, non_neg_integer()} | sqlite_error().
+enqueue_many(Db, Queue, Payloads) ->
+    Now = now_ms(),
+    sqlite3:bulk_insert(Db, Queue, [[{payload, {blob, Payload}}, {visible_at, Now}] ||
+                                       Payload <- Payloads]).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Leases up to N visible jobs of Queue, oldest first, for
+%%   VisibilityMs milliseconds. Must not be called inside a transaction.
+%% @end
+%%--------------------------------------------------------------------
+-spec claim(db(), atom(), pos_integer(), pos_integer()) -> {ok, [job()]} | sqlite_error().
+claim(Db, Queue, N, VisibilityMs) ->
+    Now = now_ms(),
+    Lease = new_lease(),
+    immediate(Db, fun() ->
+                          case sqlite3:q(Db, query_name(Queue, claim),
+                                         [Lease, Now + VisibilityMs, Now, N]) of
+                              ok ->
+                                  case sqlite3:q(Db, query_name(Queue, claimed), [Lease]) of
+                                      [{columns, _}, {rows, Rows}] ->
+                                          {ok, [{Id, Lease, Payload} ||
+                                                   {Id, _, {blob, Payload}} <- Rows]};
+                                      Error ->
+                                          Error
+                                  end;
+                              Error ->
+                                  Error
+                          end
+                  end).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Removes Jobs, as returned by claim/4, from Queue in one
+%%   transaction. Jobs whose lease has run out and which have been
+%%   claimed again are kept. Must not be called inside a transaction.
+%% @end
+%%--------------------------------------------------------------------
+-spec ack(db(), atom(), [job() | {integer(), integer()}]) -> ok | sqlite_error().
+ack(_Db, _Queue, []) ->
+    ok;
+ack(Db, Queue, Jobs) ->
+    case immediate(Db, fun() -> ack_jobs(Db, query_name(Queue, ack), Jobs) end) of
+        {ok, done} -> ok;
+        Error      -> Error
+    end.
+
+%%--------------------------------------------------------------------
+%% Internal functions
+%%--------------------------------------------------------------------
+
+query_name(Queue, Query) ->
+    list_to_atom(atom_to_list(Queue) ++ "_" ++ atom_to_list(Query)).
+
+ack_jobs(_Db, _Query, []) ->
+    {ok, done};
+ack_jobs(Db, Query, [Job | Jobs]) ->
+    case sqlite3:q(Db, Query, [element(1, Job), element(2, Job)]) of
+        ok    -> ack_jobs(Db, Query, Jobs);
+        Error -> Error
+    end.
+
+%% runs Fun inside BEGIN IMMEDIATE, committed if it returns {ok, _} and
+%% rolled back otherwise
+immediate(Db, Fun) ->
+    case sqlite3:sql_exec(Db, "BEGIN IMMEDIATE;") of
+        ok ->
+            case Fun() of
+                {ok, _} = Ok ->
+                    case sqlite3:sql_exec(Db, "COMMIT;") of
+                        ok ->
+                            Ok;
+                        Error ->
+                            sqlite3:sql_exec(Db, "ROLLBACK;"),
+                            Error
+                    end;
+                Error ->
+                    sqlite3:sql_exec(Db, "ROLLBACK;"),
+                    Error
+            end;
+        Error ->
+            % no transaction to roll back
+            Error
+    end.
+
+%% leases only need to differ between claims, 0 is never claimed
+new_lease() ->
+    rand:uniform(1 bsl 62).
+
+now_ms() ->
+    erlang:system_time(millisecond).
+
+first_error(Results) ->
+    case [Error || Error <- Results, is_tuple(Error), element(1, Error) =:= error] of
+        [Error | _] -> Error;
+        []          -> none
+    end.
@@ -0,0 +1,212 @@
+%%%-------------------------------------------------------------------
+%%% File    : sqlite3_shard.erl
+%%% @doc Logical tables spread over several database files by key hash
+%%%
+%%% SQLite lets one connection write to a database file at a time. A
+%%% sharded database is N files `Base-1.db' to `Base-N.db', each with
+%%% its own connection, and every row lives in the shard its key hashes
+%%% to. Reads are sent to all shards at once and their results merged.
+%%%
+%%% The driver runs the commands of a file on the async thread picked by
+%%% a hash of its name modulo the size of the async thread pool, so
+%%% shards only run in parallel when they land on different threads:
+%%% start the emulator with an async pool (`+A') several times larger
+%%% than the number of shards, and with a small one expect some shards,
+%%% or all of them, to be written one after another.
+%%% @end
+%%%-------------------------------------------------------------------
+-module(sqlite3_shard).
+
+-include("sqlite3.hrl").
+
+-export([open/3, close/1, shard/2, create_table/3, write/4, write_many/4, select/4]).
+
+-record(shards, {dbs}).
+
+-opaque shards() :: #shards{}.
+-type db() :: atom() | pid().
+-type select_option() :: {order_by, [column_id() | {column_id(), asc | desc}]} |
+                         {limit, pos_integer()}.
+
+-export_type([shards/0]).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Opens the N shards `Base-1.db' to `Base-N.db' with Options (as for
+%%   sqlite3:open/2, without `file'). The connections are linked to the
+%%   caller.
+%% @end
+%%--------------------------------------------------------------------
+-spec open(string(), pos_integer(), [term()]) -> {ok, shards()} | {error, term()}.
+open(Base, N, Options) ->
+    open_shards(Base, Options, lists:seq(1, N), []).
+
+-spec close(shards()) -> ok.
+close(#shards{dbs = Dbs}) ->
+    parallel(fun sqlite3:close/1, tuple_to_list(Dbs)),
+    ok.
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Returns the connection of the shard Key belongs to.
+%% @end
+%%--------------------------------------------------------------------
+-spec shard(shards(), term()) -> db().
+shard(#shards{dbs = Dbs}, Key) ->
+    element(erlang:phash2(Key, tuple_size(Dbs)) + 1, Dbs).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Creates Tbl in every shard, see sqlite3:create_table/3.
+%% @end
+%%--------------------------------------------------------------------
+-spec create_table(shards(), table_id(), table_info()) -> sql_non_query_result().
+create_table(#shards{dbs = Dbs}, Tbl, Columns) ->
+    Results = parallel(fun(Db) -> sqlite3:create_table(Db, Tbl, Columns) end,
+                       tuple_to_list(Dbs)),
+    case first_error(Results) of
+        none  -> ok;
+        Error -> Error
+    end.
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Inserts Row into the shard of its KeyColumn value.
+%% @end
+%%--------------------------------------------------------------------
+-spec write(shards(), table_id(), column_id(), [{column_id(), sql_value()}]) ->
+          sql_non_query_result().
+write(Shards, Tbl, KeyColumn, Row) ->
+    sqlite3:write(shard(Shards, proplists:get_value(KeyColumn, Row)), Tbl, Row).
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Groups Rows by the shard of their KeyColumn value and bulk inserts
+%%   every group (see sqlite3:bulk_insert/3) in parallel. Returns the
+%%   number of rows inserted, or the first error, in which case the
+%%   other shards may still have inserted their rows.
+%% @end
+%%--------------------------------------------------------------------
+-spec write_many(shards(), table_id(), column_id(), [[{column_id(), sql_value()}]]) ->
+          {ok, non_neg_integer()} | sqlite_error().
+write_many(Shards, Tbl, KeyColumn, Rows) ->
+    Groups = lists:foldl(fun(Row, Acc) ->
+                                 Db = shard(Shards, proplists:get_value(KeyColumn, Row)),
+                                 dict:update(Db, fun(DbRows) -> [Row | DbRows] end, [Row], Acc)
+                         end, dict:new(), Rows),
+    Results = parallel(fun({Db, DbRows}) ->
+                               sqlite3:bulk_insert(Db, Tbl, lists:reverse(DbRows))
+                       end, dict:to_list(Groups)),
+    case first_error(Results) of
+        none  -> {ok, lists:sum([Count || {ok, Count} <- Results])};
+        Error -> Error
+    end.
+
+%%--------------------------------------------------------------------
+%% @doc
+%%   Runs the query SQL with Params on all shards at once and merges the
+%%   rows. With `{order_by, Columns}' and `{limit, N}' the ORDER BY and
+%%   LIMIT clauses are appended to SQL, so every shard returns at most N
+%%   rows already sorted, and the sorted results are merged and cut to N
+%%   rows. Columns in order_by must be among the result columns and SQL
+%%   mustn't have ORDER BY or LIMIT of its own.
+%% @end
+%%--------------------------------------------------------------------
+-spec select(shards(), iodata(), sql_params(), [select_option()]) -> sql_result().
+select(#shards{dbs = Dbs}, SQL, Params, Options) ->
+    OrderBy = [case C of
+                   {Column, Dir} -> {to_list(Column), Dir};
+                   Column        -> {to_list(Column), asc}
+               end || C <- proplists:get_value(order_by, Options, [])],
+    Limit = proplists:get_value(limit, Options),
+    ShardSQL = [SQL, order_by_sql(OrderBy), limit_sql(Limit)],
+    Results = parallel(fun(Db) -> sqlite3:sql_exec(Db, ShardSQL, Params) end,
+                       tuple_to_list(Dbs)),
+    case first_error(Results) of
+        none ->
+            [[{columns, Columns}, _] | _] = Results,
+            Less = less_fun(Columns, OrderBy),
+            Rows = lists:foldl(fun([_, {rows, ShardRows}], Acc) ->
+                                       lists:merge(Less, Acc, ShardRows)
+                               end,
+                               [], Results),
+            [{columns, Columns}, {rows, take(Limit, Rows)}];
+        Error ->
+            Error
+    end.
+
+%%--------------------------------------------------------------------
+%% Internal functions
+%%--------------------------------------------------------------------
+
+open_shards(_Base, _Options, [], Dbs) ->
+    {ok, #shards{dbs = list_to_tuple(lists:reverse(Dbs))}};
+open_shards(Base, Options, [I | Rest], Dbs) ->
+    File = Base ++ "-" ++ integer_to_list(I) ++ ".db",
+    case sqlite3:open(anonymous, [{file, File} | Options]) of
+        {ok, Db} ->
+            open_shards(Base, Options, Rest, [Db | Dbs]);
+        Error ->
+            [sqlite3:close(Db) || Db <- Dbs],
+            Error
+    end.
+
+%% applies F to every element of List in its own process, the results
+%% are in the order of List
+parallel(F, List) ->
+    Self = self(),
+    Pids = [spawn_link(fun() -> Self ! {self(), F(X)} end) || X <- List],
+    [receive {Pid, Result} -> Result end || Pid <- Pids].
+
+first_error(Results) ->
+    case [Error || Error <- Results, is_tuple(Error), element(1, Error) =:= error] of
+        [Error | _] -> Error;
+        []          -> none
+    end.
+
+order_by_sql([]) ->
+    [];
+order_by_sql(OrderBy) ->
+    [" ORDER BY ", string:join([[Column, " ", dir_sql(Dir)] || {Column, Dir} <- OrderBy], ", ")].
+
+dir_sql(asc)  -> "ASC";
+dir_sql(desc) -> "DESC".
+
+limit_sql(undefined) -> [];
+limit_sql(N) when is_integer(N), N > 0 -> [" LIMIT ", integer_to_list(N)].
+
+%% without ORDER BY the rows are simply concatenated
+less_fun(_Columns, []) ->
+    fun(_, _) -> true end;
+less_fun(Columns, OrderBy) ->
+    Keys = [{index_of(Column, Columns, 1), Dir} || {Column, Dir} <- OrderBy],
+    fun(A, B) -> less_or_equal(Keys, A, B) end.
+
+less_or_equal([], _A, _B) ->
+    true;
+less_or_equal([{I, Dir} | Keys], A, B) ->
+    X = sort_key(element(I, A)),
+    Y = sort_key(element(I, B)),
+    case Dir of
+        _ when X == Y -> less_or_equal(Keys, A, B);
+        asc           -> X < Y;
+        desc          -> Y < X
+    end.
+
+%% SQLite sorts NULL first, then numbers, text and blobs last, which
+%% the Erlang term order of null, numbers, binaries and {blob, _} isn't
+sort_key(null)                -> {0};
+sort_key(N) when is_number(N) -> {1, N};
+sort_key({blob, B})           -> {3, B};
+sort_key(Text)                -> {2, Text}.
+
+index_of(Column, [Column | _], I) -> I;
+index_of(Column, [_ | Columns], I) -> index_of(Column, Columns, I + 1);
+index_of(Column, [], _I) -> erlang:error({badarg, {order_by, Column}}).
+
+take(undefined, Rows) -> Rows;
+take(N, Rows)         -> lists:sublist(Rows, N).
+
+to_list(A) when is_atom(A) -> atom_to_list(A);
+to_list(B) when is_binary(B) -> binary_to_list(B);
+to_list(L) when is_list(L) -> L.
@@ -0,0 +1,107 @@
+%%%-------------------------------------------------------------------
+%%% File    : sqlite3_bench.erl
+%%% @doc Benchmarks of connection churn and job queues
+%%%
+%%% open_close/1 opens a connection, runs a query and closes it N times
+%%% in a row, first with sqlite3:open/2 and sqlite3:close/1 and then by
+%%% checking connections out of and into sqlite3_pool, and prints the
+%%% number of cycles per second of each:
+%%%
+%%%   erl -pa ebin -pa .eunit -eval 'sqlite3_bench:open_close(10000), halt().'
+%%%
+%%% queue/1 enqueues N jobs into a sqlite3_queue one by one and in bulk,
+%%% then claims and acknowledges them in batches of 100, and prints the
+%%% jobs per second of each.
+%%%
+%%% scratch/1 runs N cycles of opening a scratch database, loading 1000
+%%% rows into it, querying it and closing it, once with `in_memory' and
+%%% once with `memory_vfs', and prints the cycles per second of each.
+%%% @end
+%%%-------------------------------------------------------------------
+-module(sqlite3_bench).
+
+-export([open_close/0, open_close/1, queue/0, queue/1, scratch/0, scratch/1]).
+
+-define(FILE, "sqlite3_bench.db").
+
+open_close() ->
+    open_close(1000).
+
+-spec open_close(pos_integer()) -> [{open_close | pool, float()}].
+open_close(N) ->
+    [file:delete(F) || F <- filelib:wildcard(?FILE ++ "*")],
+    {ok, Db} = sqlite3:open(anonymous, [{file, ?FILE}]),
+    ok = sqlite3:create_table(Db, t, [{x, integer}]),
+    {rowid, _} = sqlite3:write(Db, t, [{x, 1}]),
+    sqlite3:close(Db),
+    OpenClose = rate(N, fun() ->
+                                {ok, Db1} = sqlite3:open(anonymous, [{file, ?FILE}]),
+                                query(Db1),
+                                sqlite3:close(Db1)
+                        end),
+    {ok, Pool} = sqlite3_pool:start_link(),
+    unlink(Pool),
+    Pooled = rate(N, fun() ->
+                             {ok, Db1} = sqlite3_pool:checkout(?FILE, []),
+                             query(Db1),
+                             ok = sqlite3_pool:checkin(Db1)
+                     end),
+    sqlite3_pool:stop(),
+    [file:delete(F) || F <- filelib:wildcard(?FILE ++ "*")],
+    io:format("open/close: ~.1f/s, pool checkout/checkin: ~.1f/s~n", [OpenClose, Pooled]),
+    [{open_close, OpenClose}, {pool, Pooled}].
+
+queue() ->
+    queue(10000).
+
+-spec queue(pos_integer()) -> [{enqueue | enqueue_many | claim_ack, float()}].
+queue(N) ->
+    [file:delete(F) || F <- filelib:wildcard(?FILE ++ "*")],
+    {ok, Db} = sqlite3:open(anonymous, [{file, ?FILE}]),
+    [{columns, _}, {rows, [{<<"wal">>}]}] = sqlite3:sql_exec(Db, "PRAGMA journal_mode=WAL;"),
+    ok = sqlite3_queue:install(Db, jobs),
+    Payload = <<0:1024>>,
+    Enqueue = rate(N, fun() -> {ok, _} = sqlite3_queue:enqueue(Db, jobs, Payload) end),
+    Start = erlang:monotonic_time(),
+    {ok, N} = sqlite3_queue:enqueue_many(Db, jobs, lists:duplicate(N, Payload)),
+    EnqueueMany = N * 1000000 / max(erlang:convert_time_unit(erlang:monotonic_time() - Start,
+                                                             native, microsecond), 1),
+    ClaimAck = rate(2 * N div 100, fun() ->
+                                           {ok, Jobs} = sqlite3_queue:claim(Db, jobs, 100, 60000),
+                                           ok = sqlite3_queue:ack(Db, jobs, Jobs)
+                                   end) * 100,
+    sqlite3:close(Db),
+    [file:delete(F) || F <- filelib:wildcard(?FILE ++ "*")],
+    io:format("enqueue: ~.1f/s, enqueue_many: ~.1f/s, claim/ack: ~.1f/s~n",
+              [Enqueue, EnqueueMany, ClaimAck]),
+    [{enqueue, Enqueue}, {enqueue_many, EnqueueMany}, {claim_ack, ClaimAck}].
+
+scratch() ->
+    scratch(1000).
+
+-spec scratch(pos_integer()) -> [{in_memory | memory_vfs, float()}].
+scratch(N) ->
+    Rows = [[{x, I}, {y, integer_to_list(I)}] || I <- lists:seq(1, 1000)],
+    Cycle = fun(Opts) ->
+                    fun() ->
+                            {ok, Db} = sqlite3:open(anonymous, Opts),
+                            ok = sqlite3:create_table(Db, t, [{x, integer}, {y, text}]),
+                            {ok, 1000} = sqlite3:bulk_insert(Db, t, Rows),
+                            [{columns, _}, {rows, [{500500}]}] =
+                                sqlite3:sql_exec(Db, "SELECT sum(x) FROM t"),
+                            sqlite3:close(Db)
+                    end
+            end,
+    InMemory = rate(N, Cycle([in_memory])),
+    MemoryVfs = rate(N, Cycle([{file, "scratch"}, memory_vfs])),
+    io:format("in_memory: ~.1f/s, memory_vfs: ~.1f/s~n", [InMemory, MemoryVfs]),
+    [{in_memory, InMemory}, {memory_vfs, MemoryVfs}].
+
+query(Db) ->
+    [{columns, ["x"]}, {rows, [{1}]}] = sqlite3:read_all(Db, t).
+
+rate(N, Fun) ->
+    Start = erlang:monotonic_time(),
+    [Fun() || _ <- lists:seq(1, N)],
+    Us = erlang:convert_time_unit(erlang:monotonic_time() - Start, native, microsecond),
+    N * 1000000 / max(Us, 1).
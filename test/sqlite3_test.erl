@@ -16,6 +16,11 @@
 %% --------------------------------------------------------------------
 -include_lib("eunit/include/eunit.hrl").
 
+-compile({parse_transform, sqlite3_query_pt}).
+-sqlite3_query({insert_compiled, {write, compiled, [x, y]}}).
+-sqlite3_query({update_compiled, {update, compiled, [x], [y]}}).
+-sqlite3_query({select_compiled, "SELECT x, y FROM compiled WHERE x > ? ORDER BY x", [min_x]}).
+
 -define(FuncTest(Name), {??Name, fun Name/0}).
 
 drop_all_tables(Db) ->
@@ -387,6 +392,650 @@ issue23() ->
     ?assertEqual([SingleStmtResult, SingleStmtResult], ScriptResult),
     sqlite3:close(issue23).
 
+fts_test() ->
+    sqlite3:open(fts, [in_memory]),
+    ok = sqlite3:create_fts_table(fts, docs, [title, body]),
+    ?assertEqual(
+        {ok, 3},
+        sqlite3:fts_bulk_insert(fts, docs,
+                                [[{title, "one"}, {body, "the quick brown fox"}],
+                                 [{title, "two"}, {body, "fox fox fox"}],
+                                 [{title, "three"}, {body, "lazy dog"}]],
+                                [{batch_size, 2}])),
+    [{columns, Columns}, {rows, Rows}] = sqlite3:search(fts, docs, "fox", []),
+    ?assertEqual(["rowid", "title", "body", "rank", "snippet"], Columns),
+    ?assertMatch([{2, <<"two">>, _, _, <<"[fox] [fox] [fox]">>},
+                  {1, <<"one">>, _, _, <<"the quick brown [fox]">>}], Rows),
+    ?assertMatch([{columns, _}, {rows, [{1, _, _, _, _}]}],
+                 sqlite3:search(fts, docs, "fox", [{limit, 1}, {offset, 1}])),
+    % the merge settings are restored after loading
+    ConfigSQL = "SELECT k, v FROM docs_config WHERE k IN ('automerge', 'crisismerge') ORDER BY k",
+    ?assertEqual([{columns, ["k", "v"]}, {rows, [{<<"automerge">>, 4}, {<<"crisismerge">>, 16}]}],
+                 sqlite3:sql_exec(fts, ConfigSQL)),
+    {rowid, _} = sqlite3:sql_exec(fts, "INSERT INTO docs(docs, rank) VALUES ('automerge', 2);"),
+    ?assertEqual({ok, 1},
+                 sqlite3:fts_bulk_insert(fts, docs, [[{title, "four"}, {body, "fox"}]],
+                                         [{automerge, 16}, optimize])),
+    ?assertMatch([{columns, _}, {rows, [_, _, _]}], sqlite3:search(fts, docs, "fox", [])),
+    ?assertEqual([{columns, ["k", "v"]}, {rows, [{<<"automerge">>, 2}, {<<"crisismerge">>, 16}]}],
+                 sqlite3:sql_exec(fts, ConfigSQL)),
+    sqlite3:close(fts).
+
+rtree_test() ->
+    sqlite3:open(rtree, [in_memory]),
+    ok = sqlite3:create_rtree_table(rtree, geo, id, [{min_x, max_x}, {min_y, max_y}],
+                                    [{aux, [name]}]),
+    ?assertEqual(
+        {ok, 3},
+        sqlite3:bulk_insert(rtree, geo,
+                            [[{id, 1}, {min_x, 0}, {max_x, 1}, {min_y, 0}, {max_y, 1}, {name, "a"}],
+                             [{id, 2}, {min_x, 5}, {max_x, 6}, {min_y, 5}, {max_y, 6}, {name, "b"}],
+                             [{id, 3}, {min_x, 2}, {max_x, 2}, {min_y, 2}, {max_y, 2}, {name, "c"}]])),
+    % in no particular order
+    [{columns, ["id", "min_x", "max_x", "min_y", "max_y", "name"]}, {rows, BboxRows}] =
+        sqlite3:rtree_bbox(rtree, geo, [{min_x, max_x, 1.5, 5.5}, {min_y, max_y, 1.5, 5.5}]),
+    ?assertMatch([{2, _, _, _, _, <<"b">>}, {3, _, _, _, _, <<"c">>}], lists:sort(BboxRows)),
+    ?assertMatch(
+        [{columns, ["id", "min_x", "max_x", "min_y", "max_y", "name", "distance_sq"]},
+         {rows, [{3, _, _, _, _, <<"c">>, 0.5}, {1, _, _, _, _, <<"a">>, 8.0}]}],
+        sqlite3:rtree_nearest(rtree, geo, [{min_x, max_x, 2.5}, {min_y, max_y, 2.5}],
+                              [{limit, 2}, {radius, 0.5}])),
+    sqlite3:close(rtree).
+
+wal_archive_test() ->
+    Dir = "wal_archive_test.archive",
+    [file:delete(F) || F <- filelib:wildcard(Dir ++ "/*") ++
+                           filelib:wildcard("wal_archive_test*.db*")],
+    {ok, _} = sqlite3:open(wal_archive, [{file, "wal_archive_test.db"},
+                                         {wal_archive, Dir}, {wal_archive_pages, 1}]),
+    ok = sqlite3:create_table(wal_archive, t, [{x, integer}]),
+    {rowid, 1} = sqlite3:write(wal_archive, t, [{x, 1}]),
+    {rowid, 2} = sqlite3:write(wal_archive, t, [{x, 2}]),
+    ?assertEqual(ok, sqlite3:archive_wal(wal_archive)),
+    sqlite3:close(wal_archive),
+    ?assertMatch([{1, base, _, _}, {1, wal, _, _}, {2, wal, _, _}, {3, wal, _, _}],
+                 sqlite3_archive:list(Dir)),
+    ?assertEqual(4, sqlite3_archive:next_sequence(Dir)),
+    ?assertEqual(ok, sqlite3_archive:restore(Dir, "wal_archive_test_restored.db")),
+    ?assertEqual(ok, sqlite3_archive:restore(Dir, "wal_archive_test_until.db", [{until, 2}])),
+    {ok, _} = sqlite3:open(restored, [{file, "wal_archive_test_restored.db"}]),
+    ?assertEqual([{1}, {2}], rows(sqlite3:read_all(restored, t))),
+    sqlite3:close(restored),
+    {ok, _} = sqlite3:open(until, [{file, "wal_archive_test_until.db"}]),
+    ?assertEqual([{1}], rows(sqlite3:read_all(until, t))),
+    sqlite3:close(until),
+    process_flag(trap_exit, true),
+    ?assertMatch({error, _}, sqlite3:open(anonymous, [in_memory, {wal_archive, Dir}])),
+    receive
+        {'EXIT', _, _} -> ok
+    end.
+
+trace_test() ->
+    sqlite3:open(trace, [in_memory, {trace_size, 2}]),
+    ok = sqlite3:create_table(trace, t, [{x, integer}]),
+    {rowid, 1} = sqlite3:write(trace, t, [{x, 1}]),
+    [_, _, {error, 1, _}] = sqlite3:sql_exec(trace, "SELECT abs(-9223372036854775808)"),
+    ?assertEqual(ok, sqlite3:trace_on_error(trace, false)),
+    ?assertMatch(
+        [[{id, _}, {kind, exec}, {sql_hash, _}, {sql, <<"INSERT INTO t (x) values (1);">>},
+          {queued_at, _}, {wait_us, _}, {exec_us, _}, {reply_us, _}, {rows, 0}, {error_code, 0}],
+         [{id, _}, {kind, exec}, {sql_hash, _}, {sql, <<"SELECT abs(-9223372036854775808)">>},
+          {queued_at, _}, {wait_us, _}, {exec_us, _}, {reply_us, _}, {rows, 0}, {error_code, 1}]],
+        sqlite3:trace(trace)),
+    sqlite3:close(trace).
+
+trace_on_error_test() ->
+    sqlite3:open(trace_on_error, [in_memory, {trace_size, 2}]),
+    ?assertEqual(ok, sqlite3:trace_on_error(trace_on_error, true)),
+    ok = sqlite3:create_table(trace_on_error, t, [{x, integer}]),
+    {rowid, 1} = sqlite3:write(trace_on_error, t, [{x, 1}]),
+    {rowid, 2} = sqlite3:write(trace_on_error, t, [{x, 2}]),
+    % the ring has wrapped around when the failing command dumps it
+    [_, _, {error, 1, _}] = sqlite3:sql_exec(trace_on_error, "SELECT abs(-9223372036854775808)"),
+    ?assertMatch(
+        [[{id, _}, {kind, exec}, {sql_hash, _}, {sql, <<"INSERT INTO t (x) values (2);">>},
+          {queued_at, _}, {wait_us, _}, {exec_us, _}, {reply_us, _}, {rows, 0}, {error_code, 0}],
+         [{id, _}, {kind, exec}, {sql_hash, _}, {sql, <<"SELECT abs(-9223372036854775808)">>},
+          {queued_at, _}, {wait_us, _}, {exec_us, _}, {reply_us, _}, {rows, 0}, {error_code, 1}]],
+        sqlite3:trace(trace_on_error)),
+    % the connection is still usable after dumping
+    ?assertEqual([{columns, ["x"]}, {rows, [{1}, {2}]}], sqlite3:read_all(trace_on_error, t)),
+    sqlite3:close(trace_on_error).
+
+statement_stats_test() ->
+    sqlite3:open(stats, [in_memory, {stats_size, 8}]),
+    ok = sqlite3:create_table(stats, t, [{x, integer}]),
+    {rowid, 1} = sqlite3:write(stats, t, [{x, 1}]),
+    {rowid, 2} = sqlite3:write(stats, t, [{x, 2}]),
+    [{columns, ["x"]}, {rows, [{2}]}] = sqlite3:sql_exec(stats, "SELECT x FROM t WHERE x > 1"),
+    Stats = sqlite3:statement_stats(stats),
+    ?assertMatch([[{sql, _}, {calls, 2}, {total_us, _}, {min_us, _}, {max_us, _},
+                   {rows, 0}, {changes, 2}, {fullscan_steps, 0}, {sorts, 0},
+                   {autoindexes, 0}, {vm_steps, _}, {mean_us, _}]],
+                 [S || S = [{sql, <<"INSERT INTO t (x) values (?);">>} | _] <- Stats]),
+    ?assertMatch([[{sql, _}, {calls, 1}, {total_us, _}, {min_us, _}, {max_us, _},
+                   {rows, 1}, {changes, 0}, {fullscan_steps, 1} | _]],
+                 [S || S = [{sql, <<"SELECT x FROM t WHERE x > ?">>} | _] <- Stats]),
+    ?assertEqual(ok, sqlite3:reset_statement_stats(stats)),
+    ?assertEqual([], sqlite3:statement_stats(stats)),
+    % interleaved executions of the same SQL are timed per statement
+    {ok, Ref1} = sqlite3:prepare(stats, "SELECT x FROM t ORDER BY x"),
+    {ok, Ref2} = sqlite3:prepare(stats, "SELECT x FROM t ORDER BY x"),
+    {1} = sqlite3:next(stats, Ref1),
+    {1} = sqlite3:next(stats, Ref2),
+    {2} = sqlite3:next(stats, Ref1),
+    done = sqlite3:next(stats, Ref1),
+    {2} = sqlite3:next(stats, Ref2),
+    done = sqlite3:next(stats, Ref2),
+    ?assertMatch([[{sql, <<"SELECT x FROM t ORDER BY x">>}, {calls, 2}, {total_us, _},
+                   {min_us, _}, {max_us, _}, {rows, 4} | _]],
+                 sqlite3:statement_stats(stats)),
+    ok = sqlite3:finalize(stats, Ref1),
+    ok = sqlite3:finalize(stats, Ref2),
+    ?assertEqual(ok, sqlite3:reset_statement_stats(stats)),
+    sqlite3:close(stats).
+
+shared_query_test() ->
+    {ok, Db} = sqlite3:open(shared, [in_memory]),
+    ok = sqlite3:create_table(shared, t, [{x, integer}]),
+    {ok, 100} = sqlite3:bulk_insert(shared, t, [[{x, I}] || I <- lists:seq(1, 100)]),
+    SQL = "SELECT count(*) FROM t WHERE x > ?",
+    Expected = [{columns, ["count(*)"]}, {rows, [{90}]}],
+    % the requests queue up while the connection is suspended
+    ok = sys:suspend(Db),
+    Self = self(),
+    Pids = [spawn_link(fun() -> Self ! {self(), sqlite3:shared_query(shared, SQL, [10])} end)
+            || _ <- lists:seq(1, 5)],
+    timer:sleep(100),
+    ok = sys:resume(Db),
+    ?assertEqual([Expected || _ <- Pids], [receive {Pid, Result} -> Result end || Pid <- Pids]),
+    ?assertMatch([[{sql, _}, {calls, 1} | _]],
+                 [S || S = [{sql, <<"SELECT count(*) FROM t WHERE x > ?">>} | _]
+                           <- sqlite3:statement_stats(shared)]),
+    ?assertMatch({error, _, _}, sqlite3:shared_query(shared, "DELETE FROM t WHERE x > ?", [10])),
+    ?assertEqual(Expected, sqlite3:shared_query(shared, SQL, [10])),
+    % the query_only setting of the connection is left alone
+    ok = sqlite3:sql_exec(shared, "PRAGMA query_only = 1;"),
+    ?assertEqual(Expected, sqlite3:shared_query(shared, SQL, [10])),
+    ?assertEqual([{columns, ["query_only"]}, {rows, [{1}]}],
+                 sqlite3:sql_exec(shared, "PRAGMA query_only;")),
+    ok = sqlite3:sql_exec(shared, "PRAGMA query_only = 0;"),
+    ?assertEqual(Expected, sqlite3:shared_query(shared, SQL, [10])),
+    ?assertEqual([{columns, ["query_only"]}, {rows, [{0}]}],
+                 sqlite3:sql_exec(shared, "PRAGMA query_only;")),
+    sqlite3:close(shared).
+
+immutable_test() ->
+    file:delete("immutable_test.db"),
+    {ok, _} = sqlite3:open(immutable, [{file, "immutable_test.db"}]),
+    ok = sqlite3:create_table(immutable, t, [{x, integer}]),
+    {ok, 3} = sqlite3:bulk_insert(immutable, t, [[{x, I}] || I <- [1, 2, 3]]),
+    sqlite3:close(immutable),
+    {ok, _} = sqlite3:open(immutable, [{file, "immutable_test.db"}, immutable]),
+    ?assertEqual([{columns, ["x"]}, {rows, [{1}, {2}, {3}]}], sqlite3:read_all(immutable, t)),
+    ?assertMatch({error, _, _}, sqlite3:write(immutable, t, [{x, 4}])),
+    ?assertEqual([{columns, ["query_only"]}, {rows, [{1}]}],
+                 sqlite3:sql_exec(immutable, "PRAGMA query_only;")),
+    SQL = "SELECT sum(x) FROM t WHERE x > ?",
+    Expected = [{columns, ["sum(x)"]}, {rows, [{5}]}],
+    ?assertEqual(Expected, sqlite3:shared_query(immutable, SQL, [1])),
+    % from the result cache
+    ?assertEqual(Expected, sqlite3:shared_query(immutable, SQL, [1])),
+    ?assertMatch([[{sql, _}, {calls, 1} | _]],
+                 [S || S = [{sql, <<"SELECT sum(x) FROM t WHERE x > ?">>} | _]
+                           <- sqlite3:statement_stats(immutable)]),
+    sqlite3:close(immutable).
+
+memory_vfs_test() ->
+    file:delete("memory_vfs_test.db"),
+    {ok, Db} = sqlite3:open(anonymous, [{file, "memory_vfs_test.db"}, memory_vfs,
+                                        {page_size, 8192}]),
+    ok = sqlite3:create_table(Db, t, [{x, integer}, {y, text}]),
+    {ok, 1000} = sqlite3:bulk_insert(Db, t, [[{x, I}, {y, integer_to_list(I)}] ||
+                                                I <- lists:seq(1, 1000)]),
+    ok = sqlite3:sql_exec(Db, "CREATE INDEX t_y ON t (y)"),
+    ?assertEqual([{columns, ["count(*)", "sum(x)"]}, {rows, [{1000, 500500}]}],
+                 sqlite3:sql_exec(Db, "SELECT count(*), sum(x) FROM t")),
+    ?assertEqual([{columns, ["x"]}, {rows, [{500}]}],
+                 sqlite3:sql_exec(Db, "SELECT x FROM t WHERE y = '500'")),
+    ?assertEqual([{columns, ["page_size"]}, {rows, [{8192}]}],
+                 sqlite3:sql_exec(Db, "PRAGMA page_size;")),
+    ?assertEqual([{columns, ["journal_mode"]}, {rows, [{<<"off">>}]}],
+                 sqlite3:sql_exec(Db, "PRAGMA journal_mode;")),
+    ?assertEqual(false, filelib:is_file("memory_vfs_test.db")),
+    sqlite3:close(Db),
+    % every open starts from an empty database
+    {ok, Db1} = sqlite3:open(anonymous, [{file, "memory_vfs_test.db"}, memory_vfs]),
+    ?assertEqual([], sqlite3:list_tables(Db1)),
+    sqlite3:close(Db1).
+
+scan_status_test() ->
+    sqlite3:open(scan_status, [in_memory]),
+    ok = sqlite3:create_table(scan_status, t, [{x, integer}]),
+    {rowid, 1} = sqlite3:write(scan_status, t, [{x, 1}]),
+    {rowid, 2} = sqlite3:write(scan_status, t, [{x, 2}]),
+    {ok, Ref} = sqlite3:prepare(scan_status, "SELECT x FROM t WHERE x > 1"),
+    {2} = sqlite3:next(scan_status, Ref),
+    done = sqlite3:next(scan_status, Ref),
+    ?assertMatch([[{select_id, _}, {name, <<"t">>}, {explain, <<"SCAN TABLE t">>},
+                   {loops, 1}, {rows_visited, 2}, {rows_estimated, _}, {cycles, _}]],
+                 sqlite3:scan_status(scan_status, Ref)),
+    ?assertMatch([[{select_id, _}, {name, <<"t">>}, {explain, _}, {loops, 0} | _]],
+                 sqlite3:scan_status(scan_status, Ref)),
+    ok = sqlite3:finalize(scan_status, Ref),
+    ?assertMatch({[{columns, ["x"]}, {rows, [{2}]}],
+                  [[{select_id, _}, {name, <<"t">>}, {explain, _}, {loops, 1},
+                    {rows_visited, 2} | _]]},
+                 sqlite3:profile(scan_status, "SELECT x FROM t WHERE x > ?", [1])),
+    sqlite3:close(scan_status).
+
+request_metrics_test() ->
+    sqlite3:open(metrics, [in_memory, instrument]),
+    ok = sqlite3:subscribe_metrics(metrics, self()),
+    ok = sqlite3:sql_exec(metrics, "CREATE TABLE t (x INTEGER)"),
+    Pid = whereis(metrics),
+    receive
+        {sqlite3_request, Pid, sql_exec, QueueUs, ExecUs, 0} ->
+            ?assert(is_integer(QueueUs) andalso is_integer(ExecUs))
+    after 1000 ->
+        ?assert(false)
+    end,
+    ok = sqlite3:unsubscribe_metrics(metrics, self()),
+    ?assertMatch([{count, 1}, {queue_us, _}, {exec_us, _}, {max_queue_len, 0},
+                  {queue_histogram, [{_, 1}]}, {exec_histogram, [{_, 1}]}],
+                 proplists:get_value(sql_exec, sqlite3:request_metrics(metrics))),
+    sqlite3:close(metrics),
+    sqlite3:open(not_instrumented, [in_memory]),
+    ?assertEqual({error, not_instrumented}, sqlite3:request_metrics(not_instrumented)),
+    sqlite3:close(not_instrumented).
+
+auto_parameterize_test() ->
+    sqlite3:open(auto_param, [in_memory, {auto_parameterize, 2}, {trace_size, 1}]),
+    ok = sqlite3:create_table(auto_param, t, [{x, integer}, {y, text}]),
+    {rowid, 1} = sqlite3:write(auto_param, t, [{x, 1}, {y, "it's"}]),
+    ?assertMatch([[_, _, _, {sql, <<"INSERT INTO t (x, y) values (?, ?)">>} | _]],
+                 sqlite3:trace(auto_param)),
+    {rowid, 2} = sqlite3:write(auto_param, t, [{x, 2}, {y, "b"}]),
+    ?assertEqual([{columns, ["x", "1"]}, {rows, [{2, 1}, {1, 1}]}],
+                 sqlite3:sql_exec(auto_param, "SELECT x, 1 FROM t WHERE y <> 'a' ORDER BY 1 DESC")),
+    ?assertEqual([{columns, ["y"]}, {rows, [{<<"it's">>}]}],
+                 sqlite3:sql_exec(auto_param, "SELECT y FROM t WHERE x = 1")),
+    ?assertEqual([{columns, ["y"]}, {rows, [{<<"b">>}]}],
+                 sqlite3:sql_exec(auto_param, "SELECT y FROM t WHERE x = 2")),
+    ?assertMatch([[_, _, _, {sql, <<"SELECT y FROM t WHERE x = ?">>} | _]],
+                 sqlite3:trace(auto_param)),
+    ?assertMatch({error, _, _}, sqlite3:sql_exec(auto_param, "SELECT y FROM t WHERE x = 'a")),
+    % statements that don't compile aren't cached
+    ?assertMatch({error, _, _}, sqlite3:sql_exec(auto_param, "SELECT z FROM t WHERE x = 1")),
+    ok = sqlite3:sql_exec(auto_param, "ALTER TABLE t ADD COLUMN z INTEGER;"),
+    ?assertEqual([{columns, ["z"]}, {rows, [{null}]}],
+                 sqlite3:sql_exec(auto_param, "SELECT z FROM t WHERE x = 1")),
+    ?assertMatch([[_, _, _, {sql, <<"SELECT z FROM t WHERE x = ?">>} | _]],
+                 sqlite3:trace(auto_param)),
+    % result columns are named as without the option
+    SQL = "SELECT x\n  + 1, (SELECT y FROM t WHERE x = 1) FROM t WHERE x = 2",
+    sqlite3:open(no_auto_param, [in_memory]),
+    ok = sqlite3:create_table(no_auto_param, t, [{x, integer}, {y, text}]),
+    {rowid, 1} = sqlite3:write(no_auto_param, t, [{x, 1}, {y, "it's"}]),
+    {rowid, 2} = sqlite3:write(no_auto_param, t, [{x, 2}, {y, "b"}]),
+    Expected = sqlite3:sql_exec(no_auto_param, SQL),
+    ?assertMatch([{columns, ["x\n  + 1", "(SELECT y FROM t WHERE x = 1)"]}, {rows, [{3, <<"it's">>}]}],
+                 Expected),
+    ?assertEqual(Expected, sqlite3:sql_exec(auto_param, SQL)),
+    ?assertEqual(Expected, sqlite3:sql_exec(auto_param, SQL)),
+    sqlite3:close(no_auto_param),
+    sqlite3:close(auto_param).
+
+busy_retry_test() ->
+    [file:delete(F) || F <- filelib:wildcard("busy_retry.db*")],
+    {ok, _} = sqlite3:open(busy_a, [{file, "busy_retry.db"}]),
+    {ok, _} = sqlite3:open(busy_b, [{file, "busy_retry.db"}, {busy_retry, 5000}]),
+    ok = sqlite3:create_table(busy_a, t, [{x, integer}]),
+    [{columns, ["x"]}, {rows, []}] = sqlite3:read_all(busy_b, t),
+    ok = sqlite3:sql_exec(busy_a, "BEGIN IMMEDIATE;"),
+    Self = self(),
+    spawn_link(fun() -> Self ! {busy_b, sqlite3:write(busy_b, t, [{x, 1}])} end),
+    timer:sleep(100),
+    ok = sqlite3:sql_exec(busy_a, "COMMIT;"),
+    ?assertEqual({rowid, 1}, receive {busy_b, Result} -> Result after 5000 -> timeout end),
+    sqlite3:close(busy_b),
+    sqlite3:close(busy_a),
+    [file:delete(F) || F <- filelib:wildcard("busy_retry.db*")].
+
+close_test() ->
+    [file:delete(F) || F <- filelib:wildcard("close_test.db*")],
+    {ok, _} = sqlite3:open(close_a, [{file, "close_test.db"}, {checkpoint_on_close, false}]),
+    ?assertMatch([{columns, _}, {rows, [{<<"wal">>}]}],
+                 sqlite3:sql_exec(close_a, "PRAGMA journal_mode=WAL;")),
+    ok = sqlite3:create_table(close_a, t, [{x, integer}]),
+    {rowid, 1} = sqlite3:write(close_a, t, [{x, 1}]),
+    ok = sqlite3:close(close_a),
+    ?assert(filelib:file_size("close_test.db-wal") > 0),
+    {ok, _} = sqlite3:open(close_b, [{file, "close_test.db"}]),
+    ?assertEqual([{columns, ["x"]}, {rows, [{1}]}], sqlite3:read_all(close_b, t)),
+    ok = sqlite3:close(close_b),
+    ?assertNot(filelib:is_file("close_test.db-wal")),
+    [file:delete(F) || F <- filelib:wildcard("close_test.db*")].
+
+admission_test() ->
+    {ok, _} = sqlite3:open(admission, [in_memory, {admission, [{max_scan_rows, 100}, no_temp_btree]}]),
+    ok = sqlite3:sql_exec(admission, "CREATE TABLE t (id INTEGER PRIMARY KEY, x INTEGER, y INTEGER);"),
+    ok = sqlite3:sql_exec(admission, "CREATE INDEX t_x ON t (x);"),
+    {ok, 500} = sqlite3:bulk_insert(admission, t, [[{x, I}, {y, I}] || I <- lists:seq(1, 500)]),
+    % not analyzed yet
+    ?assertMatch([{columns, _}, {rows, [{500}]}],
+                 sqlite3:sql_exec(admission, "SELECT count(*) FROM t WHERE y > 0;")),
+    ok = sqlite3:register_queries(admission, [{by_x, "SELECT y FROM t WHERE x = ?"},
+                                              {by_y, "SELECT x FROM t WHERE y = ?"}]),
+    ?assertEqual([{columns, ["x"]}, {rows, [{7}]}], sqlite3:q(admission, by_y, [7])),
+    ok = sqlite3:sql_exec(admission, "ANALYZE;"),
+    % named queries are checked when they run, not when they are registered,
+    % and again once the schema or the statistics changed
+    ?assertMatch({error, query_rejected, _}, sqlite3:q(admission, by_y, [7])),
+    ?assertEqual([{columns, ["y"]}, {rows, [{7}]}], sqlite3:q(admission, by_x, [7])),
+    ?assertMatch({error, query_rejected, "full scan of t " ++ _},
+                 sqlite3:sql_exec(admission, "SELECT * FROM t WHERE y = 1;")),
+    ?assertMatch({error, query_rejected, _},
+                 sqlite3:sql_exec(admission, "SELECT * FROM t WHERE y = ?", [1])),
+    ?assertMatch({error, query_rejected, _}, sqlite3:prepare(admission, "SELECT * FROM t WHERE y = 1")),
+    ?assertEqual([{columns, ["y"]}, {rows, [{7}]}],
+                 sqlite3:sql_exec(admission, "SELECT y FROM t WHERE x = 7;")),
+    ?assertEqual([{columns, ["y"]}, {rows, [{7}]}],
+                 sqlite3:sql_exec(admission, "SELECT y FROM t WHERE id = 7;")),
+    ?assertMatch({error, query_rejected, "USE TEMP B-TREE FOR ORDER BY"},
+                 sqlite3:sql_exec(admission, "SELECT y FROM t WHERE x < 3 ORDER BY y;")),
+    ok = sqlite3:sql_exec(admission, "CREATE INDEX t_y ON t (y);"),
+    ?assertEqual([{columns, ["x"]}, {rows, [{7}]}], sqlite3:q(admission, by_y, [7])),
+    ok = sqlite3:sql_exec(admission, "DROP INDEX t_y;"),
+    ?assertMatch({error, query_rejected, "full scan of t " ++ _}, sqlite3:q(admission, by_y, [7])),
+    ?assertEqual([{columns, ["y"]}, {rows, [{7}]}], sqlite3:q(admission, by_x, [7])),
+    sqlite3:close(admission).
+
+optimize_test() ->
+    {ok, _} = sqlite3:open(optimize, [in_memory, {optimize, [{every, 100}, {analysis_limit, 400}]}]),
+    ok = sqlite3:sql_exec(optimize, "CREATE TABLE t (id INTEGER PRIMARY KEY, x INTEGER, y INTEGER);"),
+    ok = sqlite3:sql_exec(optimize, "CREATE INDEX t_x ON t (x);"),
+    {ok, 500} = sqlite3:bulk_insert(optimize, t, [[{x, I}, {y, I}] || I <- lists:seq(1, 500)]),
+    % PRAGMA optimize only analyzes tables whose indexes were used
+    ?assertEqual([{columns, ["y"]}, {rows, [{7}]}],
+                 sqlite3:sql_exec(optimize, "SELECT y FROM t WHERE x = 7;")),
+    ?assertEqual([{columns, ["name"]}, {rows, []}],
+                 sqlite3:sql_exec(optimize, "SELECT name FROM sqlite_master "
+                                            "WHERE name = 'sqlite_stat1';")),
+    {ok, 100} = sqlite3:bulk_insert(optimize, t, [[{x, I}, {y, I}] || I <- lists:seq(1, 100)]),
+    % queued behind PRAGMA optimize
+    ?assertMatch([{columns, _}, {rows, [{<<"t">>, <<"t_x">>, _}]}],
+                 sqlite3:sql_exec(optimize, "SELECT * FROM sqlite_stat1;")),
+    sqlite3:close(optimize).
+
+partition_test() ->
+    Dir = "partition_test",
+    [file:delete(F) || F <- filelib:wildcard(Dir ++ "/*")],
+    ok = filelib:ensure_dir(Dir ++ "/"),
+    {ok, _} = sqlite3:open(partition, [in_memory]),
+    P = sqlite3_partition:new(events, [{id, integer}, {time, integer}, {msg, text}], [{dir, Dir}]),
+    Day = 86400,
+    {rowid, 1} = sqlite3_partition:write(partition, P, [{id, 1}, {time, Day + 10}, {msg, "a"}]),
+    {rowid, 2} = sqlite3_partition:write(partition, P, [{id, 2}, {time, Day + 20}, {msg, "b"}]),
+    {rowid, 1} = sqlite3_partition:write(partition, P, [{id, 3}, {time, 2 * Day + 5}, {msg, "c"}]),
+    ?assertEqual([{Day, filename:join(Dir, "events-86400.db")},
+                  {2 * Day, filename:join(Dir, "events-172800.db")}],
+                 sqlite3_partition:partitions(P)),
+    ?assertEqual([{columns, ["id", "time", "msg"]},
+                  {rows, [{2, Day + 20, <<"b">>}, {3, 2 * Day + 5, <<"c">>}]}],
+                 sqlite3_partition:read(partition, P, Day + 15, 3 * Day)),
+    ?assertEqual([{columns, ["id", "time", "msg"]}, {rows, []}],
+                 sqlite3_partition:read(partition, P, 5 * Day, 6 * Day)),
+    ?assertEqual({ok, [filename:join(Dir, "events-86400.db")]},
+                 sqlite3_partition:expire(partition, P, 2 * Day + 100)),
+    ?assertNot(filelib:is_file(filename:join(Dir, "events-86400.db"))),
+    ?assertMatch([{columns, _}, {rows, [{3, _, _}]}],
+                 sqlite3_partition:read(partition, P, 0, 3 * Day)),
+    % before 1970, in the partition starting a day before
+    {rowid, 1} = sqlite3_partition:write(partition, P, [{id, 4}, {time, -5}, {msg, "d"}]),
+    ?assert(filelib:is_file(filename:join(Dir, "events--86400.db"))),
+    ?assertMatch([{columns, _}, {rows, [{4, -5, _}]}],
+                 sqlite3_partition:read(partition, P, -10, 0)),
+    % more partitions than can be attached at once
+    Hours = sqlite3_partition:new(hours, [{id, integer}, {time, integer}], [{dir, Dir},
+                                                                              {period, 3600}]),
+    [{rowid, 1} = sqlite3_partition:write(partition, Hours, [{id, I}, {time, I * 3600}]) ||
+        I <- lists:seq(1, 15)],
+    ?assertEqual([{columns, ["id", "time"]}, {rows, [{I, I * 3600} || I <- lists:seq(1, 15)]}],
+                 sqlite3_partition:read(partition, Hours, 0, 16 * 3600)),
+    % and written going back in time, like a backfill
+    Backfill = sqlite3_partition:new(backfill, [{id, integer}, {time, integer}],
+                                     [{dir, Dir}, {period, 3600}]),
+    [{rowid, 1} = sqlite3_partition:write(partition, Backfill, [{id, I}, {time, I * 3600}]) ||
+        I <- lists:seq(15, 1, -1)],
+    ?assertEqual([{columns, ["id", "time"]}, {rows, [{I, I * 3600} || I <- lists:seq(1, 15)]}],
+                 sqlite3_partition:read(partition, Backfill, 0, 16 * 3600)),
+    sqlite3:close(partition),
+    [file:delete(F) || F <- filelib:wildcard(Dir ++ "/*")],
+    file:del_dir(Dir).
+
+shard_test() ->
+    [file:delete(F) || F <- filelib:wildcard("shard_test-*.db*")],
+    {ok, Shards} = sqlite3_shard:open("shard_test", 3, []),
+    ok = sqlite3_shard:create_table(Shards, t, [{id, integer, [primary_key]}, {x, integer}]),
+    ?assertEqual({ok, 100},
+                 sqlite3_shard:write_many(Shards, t, id, [[{id, I}, {x, I rem 10}] ||
+                                                             I <- lists:seq(1, 100)])),
+    {rowid, 101} = sqlite3_shard:write(Shards, t, id, [{id, 101}, {x, 1}]),
+    ?assertEqual([{columns, ["id", "x"]}, {rows, [{101, 1}]}],
+                 sqlite3:sql_exec(sqlite3_shard:shard(Shards, 101), "SELECT * FROM t WHERE id = 101;")),
+    [{columns, ["n"]}, {rows, Counts}] =
+        sqlite3_shard:select(Shards, "SELECT count(*) AS n FROM t", [], []),
+    ?assertEqual(3, length(Counts)),
+    ?assertEqual(101, lists:sum([N || {N} <- Counts])),
+    ?assertEqual([{columns, ["id", "x"]}, {rows, [{100, 0}, {90, 0}, {80, 0}]}],
+                 sqlite3_shard:select(Shards, "SELECT id, x FROM t WHERE x = ?", [0],
+                                      [{order_by, [{id, desc}]}, {limit, 3}])),
+    ?assertEqual([{columns, ["id", "x"]}, {rows, [{10, 0}, {20, 0}, {1, 1}, {11, 1}]}],
+                 sqlite3_shard:select(Shards, "SELECT id, x FROM t", [],
+                                      [{order_by, [x, id]}, {limit, 4}])),
+    % values of different types are merged in the order SQLite sorts them
+    ok = sqlite3_shard:create_table(Shards, m, [{id, integer, [primary_key]}, {v, blob}]),
+    Values = [null, 1.5, 2, <<"a">>, <<"b">>, {blob, <<0>>}],
+    ?assertEqual({ok, 6},
+                 sqlite3_shard:write_many(Shards, m, id,
+                                          [[{id, I}, {v, V}] ||
+                                              {I, V} <- lists:zip(lists:seq(1, 6),
+                                                                  lists:reverse(Values))])),
+    ?assertEqual([{columns, ["v"]}, {rows, [{V} || V <- Values]}],
+                 sqlite3_shard:select(Shards, "SELECT v FROM m", [], [{order_by, [v]}])),
+    ok = sqlite3_shard:close(Shards),
+    [file:delete(F) || F <- filelib:wildcard("shard_test-*.db*")].
+
+queue_test() ->
+    {ok, _} = sqlite3:open(queue, [in_memory]),
+    ok = sqlite3_queue:install(queue, jobs),
+    ok = sqlite3_queue:install(queue, jobs),
+    {ok, 1} = sqlite3_queue:enqueue(queue, jobs, <<"a">>),
+    {ok, 2} = sqlite3_queue:enqueue_many(queue, jobs, [<<"b">>, <<"c">>]),
+    {ok, _} = sqlite3_queue:enqueue(queue, jobs, <<"later">>, 60000),
+    {ok, [{1, Lease, <<"a">>}, {2, Lease, <<"b">>}] = Claimed} =
+        sqlite3_queue:claim(queue, jobs, 2, 60000),
+    % leased jobs and delayed ones aren't visible
+    ?assertMatch({ok, [{3, _, <<"c">>}]}, sqlite3_queue:claim(queue, jobs, 10, 1)),
+    ok = sqlite3_queue:ack(queue, jobs, Claimed),
+    timer:sleep(10),
+    % the lease of job 3 ran out
+    ?assertMatch({ok, [{3, _, <<"c">>}]}, sqlite3_queue:claim(queue, jobs, 10, 60000)),
+    ?assertEqual([{columns, ["id"]}, {rows, [{3}, {4}]}],
+                 sqlite3:sql_exec(queue, "SELECT id FROM jobs ORDER BY id;")),
+    % BEGIN IMMEDIATE fails inside a transaction, which is left alone
+    ok = sqlite3:sql_exec(queue, "BEGIN;"),
+    ?assertMatch({error, _, _}, sqlite3_queue:claim(queue, jobs, 10, 60000)),
+    ?assertEqual(ok, sqlite3:sql_exec(queue, "COMMIT;")),
+    sqlite3:close(queue).
+
+upsert_many_test() ->
+    {ok, _} = sqlite3:open(upsert, [in_memory]),
+    ok = sqlite3:create_table(upsert, t, [{id, integer, [primary_key]}, {name, text, [not_null]}]),
+    ?assertEqual({ok, [{inserted, 2}, {updated, 0}, {unchanged, 0}]},
+                 sqlite3:upsert_many(upsert, t, [id], [[{id, 1}, {name, "a"}],
+                                                       [{id, 2}, {name, "b"}]])),
+    ?assertEqual({ok, [{inserted, 1}, {updated, 1}, {unchanged, 1}]},
+                 sqlite3:upsert_many(upsert, t, [id], [[{id, 1}, {name, "a"}],
+                                                       [{id, 2}, {name, "c"}],
+                                                       [{id, 3}, {name, "d"}]],
+                                     [{batch_size, 2}])),
+    ?assertEqual([{columns, ["id", "name"]}, {rows, [{1, <<"a">>}, {2, <<"c">>}, {3, <<"d">>}]}],
+                 sqlite3:read_all(upsert, t)),
+    % the first batch is rolled back with the failing second one
+    ?assertMatch({error, _, _},
+                 sqlite3:upsert_many(upsert, t, [id], [[{id, 4}, {name, "e"}],
+                                                       [{id, 5}, {name, null}]],
+                                     [{batch_size, 1}])),
+    ?assertMatch({error, _, _},
+                 sqlite3:upsert_many(upsert, t, [name], [[{id, 4}, {name, "e"}]])),
+    ?assertMatch([{columns, _}, {rows, [_, _, _]}], sqlite3:read_all(upsert, t)),
+    % a row inserted with rowid 0 is still counted as inserted
+    ?assertEqual({ok, [{inserted, 1}, {updated, 0}, {unchanged, 0}]},
+                 sqlite3:upsert_many(upsert, t, [id], [[{id, 0}, {name, "z"}]])),
+    % inserts into WITHOUT ROWID tables can't be told apart from updates
+    ok = sqlite3:sql_exec(upsert, "CREATE TABLE w (k TEXT PRIMARY KEY, v INTEGER) WITHOUT ROWID;"),
+    ?assertEqual({error, {without_rowid, w}},
+                 sqlite3:upsert_many(upsert, w, [k], [[{k, "a"}, {v, 1}]])),
+    ?assertEqual([{columns, ["k", "v"]}, {rows, []}], sqlite3:read_all(upsert, w)),
+    sqlite3:close(upsert).
+
+storage_stats_test() ->
+    {ok, _} = sqlite3:open(storage, [in_memory]),
+    ok = sqlite3:create_table(storage, t, [{id, integer, [primary_key]}, {data, blob}]),
+    ok = sqlite3:sql_exec(storage, "CREATE INDEX t_data ON t (data);"),
+    {ok, 200} = sqlite3:bulk_insert(storage, t, [[{id, I}, {data, {blob, binary:copy(<<I>>, 300)}}]
+                                                 || I <- lists:seq(1, 200)]),
+    {ok, Stats} = sqlite3:storage_stats(storage),
+    % slices ending inside a table or index give the same totals
+    ?assertEqual({ok, Stats}, sqlite3:storage_stats(storage, [{slice_pages, 3}])),
+    ?assertEqual(["sqlite_master", "t", "t_data"], lists:sort([Name || {Name, _} <- Stats])),
+    Pages = [proplists:get_value(pages, Props) || {_, Props} <- Stats],
+    ?assertEqual(lists:reverse(lists:sort(Pages)), Pages),
+    T = proplists:get_value("t", Stats),
+    ?assertEqual(200, proplists:get_value(leaf_cells, T)),
+    ?assert(proplists:get_value(leaf_pages, T) > 1),
+    ?assert(proplists:get_value(payload_bytes, T) > 200 * 300),
+    ?assertEqual(proplists:get_value(pages, T),
+                 proplists:get_value(leaf_pages, T) + proplists:get_value(interior_pages, T) +
+                     proplists:get_value(overflow_pages, T)),
+    Fragmentation = proplists:get_value(fragmentation, T),
+    ?assert((Fragmentation >= 0) andalso (Fragmentation =< 1)),
+    sqlite3:close(storage).
+
+cache_test() ->
+    {ok, _} = sqlite3:open(cached, [in_memory, {cache, [t, v]}]),
+    ok = sqlite3:create_table(cached, t, [{id, integer, [primary_key]}, {name, text}]),
+    {rowid, 1} = sqlite3:write(cached, t, [{id, 1}, {name, "a"}]),
+    {ok, Cache} = sqlite3:cache(cached),
+    Row = [{columns, ["id", "name"]}, {rows, [{1, <<"a">>}]}],
+    ?assertEqual(Row, sqlite3:cached_read(Cache, t, 1)),
+    ?assertEqual(Row, sqlite3:cached_read(Cache, t, 1)),
+    ?assertEqual([{columns, ["id", "name"]}, {rows, []}], sqlite3:cached_read(Cache, t, 2)),
+    ok = sqlite3:sql_exec(cached, "UPDATE t SET name = 'b' WHERE id = 1;"),
+    ?assertEqual([{columns, ["id", "name"]}, {rows, [{1, <<"b">>}]}],
+                 sqlite3:cached_read(Cache, t, 1)),
+    ?assertEqual([{hits, 1}, {misses, 3}, {hit_rate, 0.25}, {size, 1}],
+                 sqlite3:cache_stats(Cache)),
+    ?assertEqual({error, {not_cached, u}}, sqlite3:cached_read(Cache, u, 1)),
+    % identifiers are case-insensitive
+    ok = sqlite3:sql_exec(cached, "UPDATE T SET name = 'c' WHERE id = 1;"),
+    ?assertEqual([{columns, ["id", "name"]}, {rows, [{1, <<"c">>}]}],
+                 sqlite3:cached_read(Cache, t, 1)),
+    % rows deleted by REPLACE and by DELETE without WHERE
+    ok = sqlite3:sql_exec(cached, "CREATE TABLE v (id INTEGER PRIMARY KEY, name TEXT UNIQUE);"),
+    {rowid, 1} = sqlite3:write(cached, v, [{id, 1}, {name, "a"}]),
+    ?assertEqual(Row, sqlite3:cached_read(Cache, v, 1)),
+    {rowid, 2} = sqlite3:sql_exec(cached, "INSERT OR REPLACE INTO v VALUES (2, 'a');"),
+    ?assertEqual([{columns, ["id", "name"]}, {rows, []}], sqlite3:cached_read(Cache, v, 1)),
+    ?assertEqual([{columns, ["id", "name"]}, {rows, [{2, <<"a">>}]}],
+                 sqlite3:cached_read(Cache, v, 2)),
+    ok = sqlite3:sql_exec(cached, "DELETE FROM v;"),
+    ?assertEqual([{columns, ["id", "name"]}, {rows, []}], sqlite3:cached_read(Cache, v, 2)),
+    % statements prepared by the connection process: ALTER TABLE, then
+    % DROP TABLE and a new table of the same name without the row
+    ?assertEqual([{columns, ["id", "name"]}, {rows, [{1, <<"c">>}]}],
+                 sqlite3:cached_read(Cache, t, 1)),
+    ok = sqlite3:sql_exec(cached, "ALTER TABLE t ADD COLUMN extra INTEGER;"),
+    ?assertEqual([{columns, ["id", "name", "extra"]}, {rows, [{1, <<"c">>, null}]}],
+                 sqlite3:cached_read(Cache, t, 1)),
+    ok = sqlite3:drop_table(cached, t),
+    ok = sqlite3:create_table(cached, t, [{id, integer, [primary_key]}, {name, text}]),
+    {rowid, 2} = sqlite3:write(cached, t, [{id, 2}, {name, "d"}]),
+    ?assertEqual([{columns, ["id", "name"]}, {rows, []}], sqlite3:cached_read(Cache, t, 1)),
+    {ok, _} = sqlite3:open(uncached, [in_memory]),
+    ?assertEqual({error, no_cache}, sqlite3:cache(uncached)),
+    sqlite3:close(uncached),
+    sqlite3:close(cached).
+
+pool_test() ->
+    [file:delete(F) || F <- filelib:wildcard("pool_test.db*")],
+    {ok, Pool} = sqlite3_pool:start_link([{max_idle, 1}]),
+    {ok, Db} = sqlite3_pool:checkout("pool_test.db", []),
+    ok = sqlite3:create_table(Db, t, [{x, integer}]),
+    {ok, Ref} = sqlite3:prepare(Db, "INSERT INTO t (x) VALUES (?)"),
+    [ok, ok, ok] = sqlite3:sql_exec_script(Db, "ATTACH DATABASE ':memory:' AS other;"
+                                           " CREATE TEMP TABLE scratch (y);"
+                                           " PRAGMA foreign_keys = 1;"),
+    ok = sqlite3:sql_exec(Db, "BEGIN;"),
+    {rowid, 1} = sqlite3:write(Db, t, [{x, 1}]),
+    ?assertEqual([{idle, 0}, {busy, 1}], sqlite3_pool:info()),
+    ok = sqlite3_pool:checkin(Db),
+    ?assertEqual([{idle, 1}, {busy, 0}], sqlite3_pool:info()),
+    % the same connection, without the prepared statement and the transaction
+    ?assertEqual({ok, Db}, sqlite3_pool:checkout("pool_test.db", [])),
+    ?assertEqual({error, badarg}, sqlite3:bind(Db, Ref, [2])),
+    ?assertEqual([{columns, ["x"]}, {rows, []}], sqlite3:read_all(Db, t)),
+    % and without the session state of its last user
+    ?assertMatch([{columns, _}, {rows, [{0, <<"main">>, _}]}],
+                 sqlite3:sql_exec(Db, "PRAGMA database_list;")),
+    ?assertEqual([{columns, ["count(*)"]}, {rows, [{0}]}],
+                 sqlite3:sql_exec(Db, "SELECT count(*) FROM sqlite_temp_master;")),
+    ?assertEqual([{columns, ["foreign_keys"]}, {rows, [{0}]}],
+                 sqlite3:sql_exec(Db, "PRAGMA foreign_keys;")),
+    {ok, Db2} = sqlite3_pool:checkout("pool_test.db", []),
+    ?assertNotEqual(Db, Db2),
+    ok = sqlite3_pool:checkin(Db),
+    ok = sqlite3_pool:checkin(Db2),
+    ?assertEqual([{idle, 1}, {busy, 0}], sqlite3_pool:info()),
+    unlink(Pool),
+    ok = sqlite3_pool:stop(),
+    [file:delete(F) || F <- filelib:wildcard("pool_test.db*")].
+
+compiled_queries_test() ->
+    sqlite3:open(compiled_queries, [in_memory]),
+    ok = sqlite3:create_table(compiled_queries, compiled, [{x, integer}, {y, text}]),
+    {rowid, 1} = insert_compiled(compiled_queries, 1, "a"),
+    {rowid, 2} = insert_compiled(compiled_queries, 2, <<"b">>),
+    ok = update_compiled(compiled_queries, "c", 2),
+    ?assertEqual([{columns, ["x", "y"]}, {rows, [{1, <<"a">>}, {2, <<"c">>}]}],
+                 select_compiled(compiled_queries, 0)),
+    ?assertEqual([{columns, ["x", "y"]}, {rows, []}], select_compiled(compiled_queries, 2)),
+    sqlite3:close(compiled_queries).
+
+named_queries_test() ->
+    {ok, _} = sqlite3:open(named_queries, [in_memory, {queries, [{add_one, "SELECT ?1 + 1"}]}]),
+    ?assertEqual([{columns, ["?1 + 1"]}, {rows, [{2}]}], sqlite3:q(named_queries, add_one, [1])),
+    ok = sqlite3:create_table(named_queries, t, [{x, integer}]),
+    ?assertMatch({error, _, _}, sqlite3:register_queries(named_queries,
+                                                         [{insert, "INSERT INTO t (x) VALUES (?)"},
+                                                          {bad, "SELECT y FROM t"}])),
+    ?assertEqual({error, badarg}, sqlite3:q(named_queries, insert, [1])),
+    ok = sqlite3:register_queries(named_queries, [{insert, "INSERT INTO t (x) VALUES (?)"},
+                                                  {select, "SELECT x FROM t WHERE x > :min"}]),
+    {rowid, 1} = sqlite3:q(named_queries, insert, [1]),
+    {rowid, 2} = sqlite3:q(named_queries, insert, [2]),
+    ?assertEqual([{columns, ["x"]}, {rows, [{2}]}],
+                 sqlite3:q(named_queries, select, [{':min', 1}])),
+    ok = sqlite3:register_queries(named_queries, [{select, "SELECT count(*) FROM t"}]),
+    ?assertEqual([{columns, ["count(*)"]}, {rows, [{2}]}], sqlite3:q(named_queries, select)),
+    sqlite3:close(named_queries),
+    process_flag(trap_exit, true),
+    ?assertMatch({error, _}, sqlite3:open(named_queries, [in_memory, {queries, [{bad, "SELEC 1"}]}])),
+    receive {'EXIT', _, _} -> ok after 1000 -> ok end,
+    process_flag(trap_exit, false).
+
 non_db_file_test() ->
     process_flag(trap_exit, true),
     ?assertMatch({error, _},